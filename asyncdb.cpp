@@ -0,0 +1,514 @@
+/*
+ * asyncdb.cpp -- database writer using the non-blocking MariaDB API
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "asyncdb.h"
+#include "statistics.h"
+#include "metrics.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <cmath>
+#include <poll.h>
+
+namespace shelly {
+
+/**
+ * \brief Create the writer and connect to the database
+ *
+ * \param config	the configuration containing the database section
+ */
+asyncdatabase::asyncdatabase(configuration_ptr config) : _config(config),
+	_schema(config), _mysql(NULL), _connected(false), _phase(idle),
+	_status(0), _values(0), _devices(0) {
+	connect();
+}
+
+/**
+ * \brief Complete all queued statements and close the connection
+ */
+asyncdatabase::~asyncdatabase() {
+	flush();
+	drain();
+	disconnect();
+}
+
+/**
+ * \brief Connect to the database and read the field ids
+ *
+ * The connection is established with the blocking call, this only
+ * happens once for every configuration. The connection is then
+ * switched to non-blocking operation.
+ */
+void	asyncdatabase::connect() {
+	stopwatch	watch(statistics::connect);
+	_mysql = mysql_init(NULL);
+	if (NULL == _mysql) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot create mysql");
+		return;
+	}
+	mysql_options(_mysql, MYSQL_OPT_NONBLOCK, 0);
+	unsigned int	timeout = 30;
+	if (_config->has("database.timeout")) {
+		timeout = _config->intvalue("database.timeout");
+	}
+	mysql_options(_mysql, MYSQL_OPT_READ_TIMEOUT, &timeout);
+	mysql_options(_mysql, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+	std::string	hostname = _config->stringvalue("database.hostname");
+	std::string	username = _config->stringvalue("database.username");
+	std::string	password = _config->stringvalue("database.password");
+	std::string	dbname = _config->stringvalue("database.dbname");
+	int	port = _config->intvalue("database.port");
+	if (NULL == mysql_real_connect(_mysql, hostname.c_str(),
+		username.c_str(), password.c_str(), dbname.c_str(),
+		port, NULL, 0)) {
+		debug(LOG_ERR, DEBUG_LOG, 0,
+			"cannot connect to the database: %s",
+			mysql_error(_mysql));
+		disconnect();
+		return;
+	}
+	metrics::connects++;
+	try {
+		for (int f = 0; f < schema::nfields; f++) {
+			_fieldids[f] = fieldid(schema::fieldname(f));
+		}
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot read field ids: %s",
+			x.what());
+		disconnect();
+		return;
+	}
+	_connected = true;
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "non-blocking database connection "
+		"established");
+}
+
+/**
+ * \brief Close the connection and forget everything tied to it
+ */
+void	asyncdatabase::disconnect() {
+	if (_mysql) {
+		mysql_close(_mysql);
+		_mysql = NULL;
+	}
+	_connected = false;
+	_phase = idle;
+	_status = 0;
+	_sensors.clear();
+}
+
+/**
+ * \brief Get the id of a field
+ *
+ * \param name		the name of the field
+ */
+int	asyncdatabase::fieldid(const std::string& name) {
+	std::string	query = "select id from mfield where name = "
+		+ database::quote(_mysql, name);
+	if (mysql_real_query(_mysql, query.data(), query.size())) {
+		throw shellyexception(stringprintf("query for field %s "
+			"failed: %s", name.c_str(), mysql_error(_mysql)));
+	}
+	MYSQL_RES	*res = mysql_store_result(_mysql);
+	MYSQL_ROW	row = (res) ? mysql_fetch_row(res) : NULL;
+	int	id = (row && row[0]) ? std::stoi(row[0]) : -1;
+	if (res) {
+		mysql_free_result(res);
+	}
+	if (id < 0) {
+		throw shellyexception(stringprintf("no field %s",
+			name.c_str()));
+	}
+	return id;
+}
+
+/**
+ * \brief Buffer the values of a sensor
+ *
+ * \param station	station name
+ * \param sensor	sensor name
+ * \param timekey	timekey of the values
+ * \param temperature	temperature in degrees Celsius
+ * \param humidity	relative humidity in percent
+ * \param voltage	battery voltage
+ * \param capacity	battery capacity in percent
+ */
+void	asyncdatabase::add(const std::string& station,
+		const std::string& sensor, time_t timekey,
+		float temperature, float humidity, float voltage,
+		float capacity) {
+	if (!_buffer) {
+		_buffer = batch(new std::vector<row>());
+	}
+	row	r;
+	r.station = station;
+	r.sensor = sensor;
+	r.timekey = timekey;
+	r.values[0] = temperature;
+	r.values[1] = humidity;
+	r.values[2] = voltage;
+	r.values[3] = capacity;
+	_buffer->push_back(r);
+}
+
+/**
+ * \brief Queue the statements for the buffered values
+ *
+ * The statements are built when they are started, so that a lookup
+ * queued earlier is complete by then.
+ */
+void	asyncdatabase::flush() {
+	if (!_buffer || (_buffer->size() == 0)) {
+		return;
+	}
+	batch	b = _buffer;
+	_buffer.reset();
+	if (!_connected) {
+		connect();
+	}
+	if (!_connected) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "no database, %lu devices not "
+			"stored", (unsigned long)b->size());
+		metrics::inserterrors += b->size();
+		return;
+	}
+
+	// look up the sensors not known yet
+	for (auto r : *b) {
+		if (_sensors.count(std::make_pair(r.station, r.sensor)) == 0) {
+			job	j;
+			j.description = "sensor id lookup";
+			j.stage = statistics::sensorid;
+			j.sql = [this, b]() { return lookup(b); };
+			j.result = [this](MYSQL_RES *res) {
+				MYSQL_ROW	row;
+				while (NULL != (row = mysql_fetch_row(res))) {
+					_sensors[std::make_pair(
+						std::string(row[0]),
+						std::string(row[1]))]
+						= std::stoi(row[2]);
+				}
+			};
+			_jobs.push_back(j);
+			metrics::queuedepth[metrics::statements] = _jobs.size();
+			break;
+		}
+	}
+
+	// insert the values of all devices of the batch
+	job	j;
+	j.description = "insert";
+	j.stage = statistics::insert;
+	j.sql = [this, b]() { return insert(b); };
+	_jobs.push_back(j);
+	metrics::queuedepth[metrics::statements] = _jobs.size();
+	if (_phase == idle) {
+		start();
+	}
+}
+
+/**
+ * \brief Build the query for the sensor ids still unknown
+ *
+ * \param b		the batch to find the sensors for
+ */
+std::string	asyncdatabase::lookup(batch b) {
+	std::set<database::sensorkey>	unknown;
+	for (auto r : *b) {
+		database::sensorkey	key(r.station, r.sensor);
+		if (_sensors.count(key) == 0) {
+			unknown.insert(key);
+		}
+	}
+	return database::sensorquery(_mysql, unknown);
+}
+
+/**
+ * \brief Build the multi-row insert for a batch
+ *
+ * Devices whose sensor is not in the database are skipped.
+ *
+ * \param b		the batch to insert
+ */
+std::string	asyncdatabase::insert(batch b) {
+	std::string	values;
+	_values = 0;
+	_devices = 0;
+	for (auto r : *b) {
+		auto	s = _sensors.find(std::make_pair(r.station, r.sensor));
+		if (s == _sensors.end()) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "no sensor id for %s/%s",
+				r.station.c_str(), r.sensor.c_str());
+			metrics::inserterrors++;
+			continue;
+		}
+		if (_schema.wide) {
+			values += stringprintf("%s(%ld,%d", (_devices > 0)
+				? "," : "", (long)r.timekey, s->second);
+			for (auto c : _schema.columns) {
+				values += (std::isnan(r.values[c]))
+					? std::string(",NULL") : stringprintf(
+					",%.9g", (double)r.values[c]);
+				_values++;
+			}
+			values += ")";
+		} else {
+			for (int f = 0; f < schema::nfields; f++) {
+				if (std::isnan(r.values[f])) {
+					continue;
+				}
+				values += stringprintf("%s(%ld,%d,%d,%.9g)",
+					(_values > 0) ? "," : "",
+					(long)r.timekey, s->second,
+					_fieldids[f], (double)r.values[f]);
+				_values++;
+			}
+		}
+		_devices++;
+	}
+	if (_values == 0) {
+		return std::string();
+	}
+	if (dryrun) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "dryrun: not adding %lu values",
+			(unsigned long)_values);
+		return std::string();
+	}
+	return "insert into " + _schema.table + "("
+		+ _schema.insertcolumns() + ") values " + values;
+}
+
+/**
+ * \brief Remember the events the connection waits for
+ *
+ * \param status	the status returned by a _start or _cont function
+ */
+void	asyncdatabase::wait(int status) {
+	_status = status;
+	if (status & MYSQL_WAIT_TIMEOUT) {
+		_timeout = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(
+				mysql_get_timeout_value_ms(_mysql));
+	}
+}
+
+/**
+ * \brief Start queued statements until one has to wait
+ */
+void	asyncdatabase::start() {
+	while ((_phase == idle) && (_jobs.size() > 0) && _connected) {
+		_query = _jobs.front().sql();
+		if (_query.size() == 0) {
+			_jobs.pop_front();
+			metrics::queuedepth[metrics::statements] = _jobs.size();
+			continue;
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "starting %s, %lu bytes",
+			_jobs.front().description.c_str(),
+			(unsigned long)_query.size());
+		_jobstart = std::chrono::steady_clock::now();
+		_phase = querying;
+		int	err = 0;
+		int	status = mysql_real_query_start(&err, _mysql,
+			_query.data(), _query.size());
+		if (status) {
+			wait(status);
+			return;
+		}
+		queried(err);
+	}
+}
+
+/**
+ * \brief Continue after the query was sent and its result announced
+ *
+ * \param err		the return value of the query
+ */
+void	asyncdatabase::queried(int err) {
+	if (err || !_jobs.front().result) {
+		complete(!err);
+		return;
+	}
+	_phase = storing;
+	MYSQL_RES	*res = NULL;
+	int	status = mysql_store_result_start(&res, _mysql);
+	if (status) {
+		wait(status);
+		return;
+	}
+	stored(res);
+}
+
+/**
+ * \brief Hand the stored result to the job
+ *
+ * \param res		the result, NULL if it could not be read
+ */
+void	asyncdatabase::stored(MYSQL_RES *res) {
+	if (NULL == res) {
+		complete(false);
+		return;
+	}
+	_jobs.front().result(res);
+	mysql_free_result(res);
+	complete(true);
+}
+
+/**
+ * \brief Finish the current job
+ *
+ * Client errors mean that the connection is no longer usable, the
+ * remaining jobs are then dropped and the next flush reconnects.
+ *
+ * \param ok		whether the statement succeeded
+ */
+void	asyncdatabase::complete(bool ok) {
+	job	j = _jobs.front();
+	_jobs.pop_front();
+	metrics::queuedepth[metrics::statements] = _jobs.size();
+	_phase = idle;
+	_status = 0;
+	if (statistics::enabled) {
+		statistics::get(j.stage).record(std::chrono::duration_cast<
+			std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - _jobstart).count());
+	}
+	if (ok) {
+		if (j.stage == statistics::insert) {
+			metrics::inserted += _values;
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "%s complete",
+			j.description.c_str());
+		return;
+	}
+	debug(LOG_ERR, DEBUG_LOG, 0, "%s failed: %s", j.description.c_str(),
+		mysql_error(_mysql));
+	if (j.stage == statistics::insert) {
+		metrics::inserterrors += _devices;
+	}
+	if (mysql_errno(_mysql) >= 2000) {
+		for (auto k : _jobs) {
+			if (k.stage == statistics::insert) {
+				metrics::inserterrors++;
+			}
+		}
+		debug(LOG_ERR, DEBUG_LOG, 0, "database connection lost, "
+			"%lu statements dropped", (unsigned long)_jobs.size());
+		_jobs.clear();
+		metrics::queuedepth[metrics::statements] = 0;
+		disconnect();
+	}
+}
+
+/**
+ * \brief Find out whether a statement is running
+ */
+bool	asyncdatabase::busy() const {
+	return _phase != idle;
+}
+
+/**
+ * \brief Describe the events the running statement waits for
+ *
+ * \param w		the wait descriptor to fill in
+ * \param timeout	set to the milliseconds left until the statement
+ *			times out, -1 if it does not wait for a timeout
+ */
+void	asyncdatabase::prepare(struct curl_waitfd& w, long& timeout) const {
+	w.fd = mysql_get_socket(_mysql);
+	w.events = 0;
+	w.revents = 0;
+	if (_status & MYSQL_WAIT_READ) {
+		w.events |= CURL_WAIT_POLLIN;
+	}
+	if (_status & MYSQL_WAIT_WRITE) {
+		w.events |= CURL_WAIT_POLLOUT;
+	}
+	if (_status & MYSQL_WAIT_EXCEPT) {
+		w.events |= CURL_WAIT_POLLPRI;
+	}
+	timeout = -1;
+	if (_status & MYSQL_WAIT_TIMEOUT) {
+		timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+			_timeout - std::chrono::steady_clock::now()).count();
+		if (timeout < 0) {
+			timeout = 0;
+		}
+	}
+}
+
+/**
+ * \brief Continue the running statement if its events occurred
+ *
+ * \param w		the wait descriptor with the events that occurred
+ */
+void	asyncdatabase::step(const struct curl_waitfd& w) {
+	if (_phase == idle) {
+		return;
+	}
+	int	ready = 0;
+	if (w.revents & CURL_WAIT_POLLIN) {
+		ready |= MYSQL_WAIT_READ;
+	}
+	if (w.revents & CURL_WAIT_POLLOUT) {
+		ready |= MYSQL_WAIT_WRITE;
+	}
+	if (w.revents & CURL_WAIT_POLLPRI) {
+		ready |= MYSQL_WAIT_EXCEPT;
+	}
+	if ((_status & MYSQL_WAIT_TIMEOUT)
+		&& (std::chrono::steady_clock::now() >= _timeout)) {
+		ready |= MYSQL_WAIT_TIMEOUT;
+	}
+	if (ready == 0) {
+		return;
+	}
+	int	status;
+	if (_phase == querying) {
+		int	err = 0;
+		status = mysql_real_query_cont(&err, _mysql, ready);
+		if (status) {
+			wait(status);
+			return;
+		}
+		queried(err);
+	} else {
+		MYSQL_RES	*res = NULL;
+		status = mysql_store_result_cont(&res, _mysql, ready);
+		if (status) {
+			wait(status);
+			return;
+		}
+		stored(res);
+	}
+	start();
+}
+
+/**
+ * \brief Wait until all queued statements are complete
+ */
+void	asyncdatabase::drain() {
+	while (busy()) {
+		struct curl_waitfd	w;
+		long	timeout;
+		prepare(w, timeout);
+		struct pollfd	pfd;
+		pfd.fd = w.fd;
+		pfd.events = ((w.events & CURL_WAIT_POLLIN) ? POLLIN : 0)
+			| ((w.events & CURL_WAIT_POLLOUT) ? POLLOUT : 0)
+			| ((w.events & CURL_WAIT_POLLPRI) ? POLLPRI : 0);
+		pfd.revents = 0;
+		if (poll(&pfd, 1, (timeout < 0) ? 1000 : timeout) < 0) {
+			continue;
+		}
+		w.revents = ((pfd.revents & (POLLIN | POLLHUP | POLLERR))
+				? CURL_WAIT_POLLIN : 0)
+			| ((pfd.revents & POLLOUT) ? CURL_WAIT_POLLOUT : 0)
+			| ((pfd.revents & POLLPRI) ? CURL_WAIT_POLLPRI : 0);
+		step(w);
+	}
+}
+
+} // namespace shelly
@@ -0,0 +1,99 @@
+/*
+ * asyncdb.h -- database writer using the non-blocking MariaDB API
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _asyncdb_h
+#define _asyncdb_h
+
+#include <mysql.h>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <memory>
+#include <string>
+#include <vector>
+#include "configuration.h"
+#include "database.h"
+#include "schema.h"
+#include "statistics.h"
+#include "cloud.h"
+
+namespace shelly {
+
+/**
+ * \brief Database writer that never blocks the loop thread
+ *
+ * Values added to the writer are buffered, flush() turns the buffer
+ * into a multi-row insert and queues it. The queued statements are run
+ * with the non-blocking functions of MariaDB Connector/C: every call
+ * returns as soon as the connection would block, together with the
+ * events it waits for. The writer is a pollsource, so the cloud poller
+ * waits for these events together with its own transfers, and the
+ * inserts for one chunk run while the next chunk is being transferred.
+ * Sensor ids are looked up with one query for all sensors of a batch
+ * that are not known yet and kept for the lifetime of the connection.
+ */
+class asyncdatabase : public datasink, public pollsource {
+	typedef struct {
+		std::string	station;
+		std::string	sensor;
+		time_t	timekey;
+		float	values[4];
+	} row;
+	typedef std::shared_ptr<std::vector<row> >	batch;
+	typedef struct {
+		std::string	description;
+		statistics::stage	stage;
+		std::function<std::string()>	sql;
+		std::function<void(MYSQL_RES *)>	result;
+	} job;
+	typedef enum { idle, querying, storing } phase;
+	configuration_ptr	_config;
+	schema	_schema;
+	MYSQL	*_mysql;
+	bool	_connected;
+	phase	_phase;
+	int	_status;
+	std::chrono::steady_clock::time_point	_timeout;
+	std::chrono::steady_clock::time_point	_jobstart;
+	std::list<job>	_jobs;
+	std::string	_query;
+	batch	_buffer;
+	int	_fieldids[schema::nfields];
+	std::map<std::pair<std::string, std::string>, int>	_sensors;
+	size_t	_values;
+	size_t	_devices;
+	void	connect();
+	void	disconnect();
+	int	fieldid(const std::string& name);
+	std::string	lookup(batch b);
+	std::string	insert(batch b);
+	void	start();
+	void	wait(int status);
+	void	queried(int err);
+	void	stored(MYSQL_RES *res);
+	void	complete(bool ok);
+	asyncdatabase(const asyncdatabase& other);
+	asyncdatabase&	operator=(const asyncdatabase& other);
+public:
+	asyncdatabase(configuration_ptr config);
+	~asyncdatabase();
+	virtual void	add(const std::string& station,
+			const std::string& sensor, time_t timekey,
+			float temperature, float humidity, float voltage,
+			float capacity);
+	virtual void	flush();
+	virtual bool	busy() const;
+	virtual void	prepare(struct curl_waitfd& w, long& timeout) const;
+	virtual void	step(const struct curl_waitfd& w);
+	void	drain();
+};
+
+typedef std::shared_ptr<asyncdatabase>	asyncdatabase_ptr;
+
+} // namespace shelly
+
+#endif /* _asyncdb_h */
@@ -0,0 +1,199 @@
+/*
+ * bulkload.cpp -- bulk loading of readings with LOAD DATA LOCAL INFILE
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "bulkload.h"
+#include "statistics.h"
+#include "metrics.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <cmath>
+#include <cstring>
+
+namespace shelly {
+
+/**
+ * \brief Open the file the server asks for, this is always the buffer
+ */
+int	bulkloader::infile_init(void **ptr, const char *filename,
+		void *userdata) {
+	bulkloader	*loader = (bulkloader *)userdata;
+	loader->_offset = 0;
+	*ptr = userdata;
+	return 0;
+}
+
+/**
+ * \brief Hand the next part of the buffer to the client library
+ */
+int	bulkloader::infile_read(void *ptr, char *buf, unsigned int len) {
+	bulkloader	*loader = (bulkloader *)ptr;
+	size_t	n = loader->_buffer.size() - loader->_offset;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(buf, loader->_buffer.data() + loader->_offset, n);
+	loader->_offset += n;
+	return n;
+}
+
+/**
+ * \brief Close the file, nothing to do for the buffer
+ */
+void	bulkloader::infile_end(void *ptr) {
+}
+
+/**
+ * \brief Report an error of the infile handler, which cannot happen
+ */
+int	bulkloader::infile_error(void *ptr, char *msg, unsigned int len) {
+	strncpy(msg, "cannot read load buffer", len);
+	return 2000;
+}
+
+/**
+ * \brief Connect with local infile enabled and install the handler
+ *
+ * \param config	the configuration to use
+ */
+bulkloader::bulkloader(configuration_ptr config)
+	: database(config, CLIENT_LOCAL_FILES), _offset(0), _rows(0),
+	  _loaddevices(0), _chunksize(100000) {
+	if (_config->has("database.loadchunk")) {
+		_chunksize = _config->intvalue("database.loadchunk");
+	}
+	mysql_set_local_infile_handler(mysql, infile_init, infile_read,
+		infile_end, infile_error, this);
+}
+
+/**
+ * \brief Load the rows that are still buffered
+ */
+bulkloader::~bulkloader() {
+	try {
+		flush();
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "rows lost: %s", x.what());
+	}
+}
+
+/**
+ * \brief Add the values of a sensor to the buffer
+ *
+ * A full buffer is loaded right away, a failure of that load is
+ * counted and logged, but does not concern the device added.
+ *
+ * \param station	station name
+ * \param sensor	sensor name
+ * \param timekey	timekey of the values
+ * \param temperature	temperature in degrees Celsius
+ * \param humidity	relative humidity in percent
+ * \param voltage	battery voltage
+ * \param capacity	battery capacity in percent
+ */
+void	bulkloader::add(const std::string& station, const std::string& sensor,
+		time_t timekey, float temperature, float humidity,
+		float voltage, float capacity) {
+	int	sid = sensorid(station, sensor);
+	const struct {
+		int	fieldid;
+		float	value;
+	} values[schema::nfields] = {
+		{ temperature_id, temperature }, { humidity_id, humidity },
+		{ battery_id, voltage }, { capacity_id, capacity }
+	};
+	if (_schema.wide) {
+		_buffer += stringprintf("%lld\t%d", (long long)timekey, sid);
+		for (auto c : _schema.columns) {
+			_buffer += (std::isnan(values[c].value))
+				? std::string("\t\\N") : stringprintf("\t%.9g",
+				(double)values[c].value);
+		}
+		_buffer += "\n";
+		_rows++;
+	} else {
+		for (int i = 0; i < schema::nfields; i++) {
+			if (std::isnan(values[i].value)) {
+				continue;
+			}
+			_buffer += stringprintf("%lld\t%d\t%d\t%.9g\n",
+				(long long)timekey, sid, values[i].fieldid,
+				(double)values[i].value);
+			_rows++;
+		}
+	}
+	_loaddevices++;
+	if (_rows >= _chunksize) {
+		try {
+			load();
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "load failed: %s",
+				x.what());
+		}
+	}
+}
+
+/**
+ * \brief Load all buffered rows
+ */
+void	bulkloader::flush() {
+	load();
+}
+
+/**
+ * \brief Load the buffer in a transaction of its own
+ *
+ * Rows that duplicate existing keys are skipped by the server, as is
+ * the default for local files, so the number of rows inserted is
+ * taken from the affected rows.
+ */
+void	bulkloader::load() {
+	if (_rows == 0) {
+		return;
+	}
+	stopwatch	watch(statistics::insert);
+	size_t	rows = _rows;
+	size_t	devices = _loaddevices;
+	std::string	error;
+	if (dryrun) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "dryrun: not loading %lu rows",
+			(unsigned long)rows);
+	} else {
+		std::string	query = "load data local infile 'shellyd.tsv' "
+			"into table " + _schema.table + " "
+			"fields terminated by '\\t' lines terminated by '\\n' "
+			"(" + _schema.insertcolumns() + ")";
+		mysql_autocommit(mysql, 0);
+		if (mysql_real_query(mysql, query.data(), query.size())) {
+			error = stringprintf("cannot load %lu rows: %s",
+				(unsigned long)rows, mysql_error(mysql));
+			mysql_rollback(mysql);
+		} else {
+			my_ulonglong	inserted = mysql_affected_rows(mysql);
+			if (mysql_commit(mysql)) {
+				error = stringprintf("cannot commit %lu rows: "
+					"%s", (unsigned long)rows,
+					mysql_error(mysql));
+			} else {
+				metrics::inserted += inserted * ((_schema.wide)
+					? _schema.columns.size() : 1);
+				debug(LOG_DEBUG, DEBUG_LOG, 0, "%lu rows "
+					"loaded, %llu inserted",
+					(unsigned long)rows,
+					(unsigned long long)inserted);
+			}
+		}
+		mysql_autocommit(mysql, 1);
+	}
+	_buffer.clear();
+	_rows = 0;
+	_loaddevices = 0;
+	if (error.size() > 0) {
+		metrics::inserterrors += devices;
+		throw shellyexception(error);
+	}
+}
+
+} // namespace shelly
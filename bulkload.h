@@ -0,0 +1,49 @@
+/*
+ * bulkload.h -- bulk loading of readings with LOAD DATA LOCAL INFILE
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _bulkload_h
+#define _bulkload_h
+
+#include <string>
+#include "database.h"
+
+namespace shelly {
+
+/**
+ * \brief Database sink loading large amounts of readings at once
+ *
+ * Replaying recorded responses or catching up after an outage produces
+ * far more rows than a cycle. The loader formats the rows as tab
+ * separated lines in memory and streams them to the server with
+ * LOAD DATA LOCAL INFILE, the file is read by a local infile handler
+ * from the buffer, so nothing is written to disk. Whenever the buffer
+ * holds chunksize rows, they are loaded in a transaction of their own,
+ * which bounds the size of a transaction and the memory used.
+ */
+class bulkloader : public database {
+	std::string	_buffer;
+	size_t	_offset;
+	size_t	_rows;
+	size_t	_loaddevices;
+	size_t	_chunksize;
+	static int	infile_init(void **ptr, const char *filename,
+				void *userdata);
+	static int	infile_read(void *ptr, char *buf, unsigned int len);
+	static void	infile_end(void *ptr);
+	static int	infile_error(void *ptr, char *msg, unsigned int len);
+	void	load();
+public:
+	bulkloader(configuration_ptr config);
+	virtual ~bulkloader();
+	virtual void	add(const std::string& station,
+			const std::string& sensor, time_t timekey,
+			float temperature, float humidity, float voltage,
+			float capacity);
+	virtual void	flush();
+};
+
+} // namespace shelly
+
+#endif /* _bulkload_h */
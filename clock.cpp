@@ -0,0 +1,72 @@
+/*
+ * clock.cpp -- clock abstraction for the scheduler
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "clock.h"
+#include <thread>
+
+namespace shelly {
+
+clocksource::~clocksource() {
+}
+
+/**
+ * \brief Get the current time
+ */
+clocksource::time_point	systemclock::now() {
+	return std::chrono::system_clock::now();
+}
+
+/**
+ * \brief Sleep until a point in time
+ *
+ * \param t		the time to wake up
+ */
+void	systemclock::sleep_until(const time_point& t) {
+	std::this_thread::sleep_until(t);
+}
+
+/**
+ * \brief Create a simulated clock
+ *
+ * \param start		the simulated time to start at
+ * \param speedup	factor applied to the real time spent between sleeps
+ */
+simulatedclock::simulatedclock(const time_point& start, double speedup)
+	: _base(start), _realbase(std::chrono::steady_clock::now()),
+	  _speedup(speedup) {
+}
+
+/**
+ * \brief Get the current simulated time
+ */
+clocksource::time_point	simulatedclock::now() {
+	std::chrono::duration<double>	elapsed
+		= std::chrono::steady_clock::now() - _realbase;
+	return _base + std::chrono::duration_cast<
+		std::chrono::system_clock::duration>(elapsed * _speedup);
+}
+
+/**
+ * \brief Advance the simulated time to t without waiting
+ *
+ * \param t		the time to wake up
+ */
+void	simulatedclock::sleep_until(const time_point& t) {
+	time_point	current = now();
+	_base = (t > current) ? t : current;
+	_realbase = std::chrono::steady_clock::now();
+}
+
+/**
+ * \brief Advance the simulated time by some duration
+ *
+ * \param d		the duration to advance the clock by
+ */
+void	simulatedclock::advance(const std::chrono::system_clock::duration& d) {
+	_base = now() + d;
+	_realbase = std::chrono::steady_clock::now();
+}
+
+} // namespace shelly
@@ -0,0 +1,60 @@
+/*
+ * clock.h -- clock abstraction for the scheduler
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _clock_h
+#define _clock_h
+
+#include <chrono>
+#include <memory>
+
+namespace shelly {
+
+/**
+ * \brief Source of wall clock time for the scheduler
+ *
+ * The loop reads the time and sleeps only through this interface, so
+ * that the real clock can be replaced by a simulated one.
+ */
+class clocksource {
+public:
+	typedef std::chrono::system_clock::time_point	time_point;
+	virtual ~clocksource();
+	virtual time_point	now() = 0;
+	virtual void	sleep_until(const time_point& t) = 0;
+};
+
+typedef std::shared_ptr<clocksource>	clocksource_ptr;
+
+/**
+ * \brief The real system clock
+ */
+class systemclock : public clocksource {
+public:
+	virtual time_point	now();
+	virtual void	sleep_until(const time_point& t);
+};
+
+/**
+ * \brief Simulated clock that advances instantly when sleeping
+ *
+ * Sleeping sets the simulated time to the end of the sleep without
+ * waiting. Between sleeps the simulated time advances with the real
+ * time spent working, multiplied by the speedup factor, so that slow
+ * cycles still lead to drift and overruns in the simulation.
+ */
+class simulatedclock : public clocksource {
+	time_point	_base;
+	std::chrono::steady_clock::time_point	_realbase;
+	double	_speedup;
+public:
+	simulatedclock(const time_point& start, double speedup = 1.);
+	virtual time_point	now();
+	virtual void	sleep_until(const time_point& t);
+	void	advance(const std::chrono::system_clock::duration& d);
+};
+
+} // namespace shelly
+
+#endif /* _clock_h */
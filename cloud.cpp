@@ -0,0 +1,603 @@
+/*
+ * cloud.cpp -- concurrent polling of one or more cloud endpoints
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "cloud.h"
+#include "metrics.h"
+#include "statistics.h"
+#include "trace.h"
+#include "debug.h"
+#include "format.h"
+
+namespace shelly {
+
+/**
+ * \brief Callback to collect the response of an endpoint
+ *
+ * \param data		data buffer containing the data
+ * \param size		item size
+ * \param nmemb		number of items received
+ * \param userdata	pointer to the endpoint
+ */
+static size_t	cloud_write_callback(void *data, size_t size, size_t nmemb,
+		void *userdata) {
+	cloudendpoint	*e = (cloudendpoint *)userdata;
+	e->received((const char *)data, size * nmemb);
+	return size * nmemb;
+}
+
+/**
+ * \brief Add the phases of a completed curl transfer to the trace
+ *
+ * \param curl		the curl handle of the completed transfer
+ * \param start		trace time when the transfer was started
+ */
+static void	tracephases(CURL *curl, int64_t start) {
+	static const struct {
+		CURLINFO	info;
+		const char	*name;
+	} phases[] = {
+		{ CURLINFO_NAMELOOKUP_TIME_T,	"dns"		},
+		{ CURLINFO_CONNECT_TIME_T,	"connect"	},
+		{ CURLINFO_APPCONNECT_TIME_T,	"tls"		},
+		{ CURLINFO_PRETRANSFER_TIME_T,	"request"	},
+		{ CURLINFO_STARTTRANSFER_TIME_T, "wait"		},
+		{ CURLINFO_TOTAL_TIME_T,	"receive"	}
+	};
+	curl_off_t	previous = 0;
+	for (auto phase : phases) {
+		curl_off_t	t = 0;
+		if ((CURLE_OK != curl_easy_getinfo(curl, phase.info, &t))
+			|| (t <= previous)) {
+			continue;
+		}
+		tracer::add(phase.name, "curl", start + previous, t - previous);
+		previous = t;
+	}
+}
+
+/**
+ * \brief Get a number from an endpoint section
+ *
+ * \param settings	the endpoint section
+ * \param key		the key of the number
+ * \param value		the default value
+ */
+static double	number(const nlohmann::json& settings, const char *key,
+		double value) {
+	if (settings.contains(key) && settings[key].is_number()) {
+		return settings[key].get<double>();
+	}
+	return value;
+}
+
+/**
+ * \brief Get the token bucket of the account of an endpoint
+ *
+ * The rate limit defaults to one request per second, the limit
+ * documented for the cloud API. Endpoints for the same server and key
+ * share the bucket.
+ *
+ * \param settings	the section describing the endpoint
+ */
+tokenbucket_ptr	cloudendpoint::limiter(const nlohmann::json& settings) {
+	return tokenbucket::shared(settings.value("url", std::string()) + " "
+		+ settings.value("key", std::string()),
+		number(settings, "ratelimit", 1), number(settings, "burst", 1));
+}
+
+/**
+ * \brief Create an endpoint from its section of the configuration
+ *
+ * \param name		the name of the endpoint
+ * \param settings	the section describing the endpoint
+ */
+cloudendpoint::cloudendpoint(const std::string& name,
+	const nlohmann::json& settings) : _name(name), _requests(settings),
+	_limiter(limiter(settings)),
+	_chunksize(number(settings, "chunksize", 0)),
+	_retries(number(settings, "retries", 3)),
+	_backoff(number(settings, "backoff", 1000)),
+	_maxbackoff(number(settings, "maxbackoff", 30000)),
+	_curl(NULL), _headers(NULL), _attempt(0), _reserved(false),
+	_busy(false), _transferstart(0), _random(std::random_device{}()) {
+	_curl = curl_easy_init();
+	_headers = curl_slist_append(_headers,
+		"Content-Type: application/json");
+	if (debuglevel >= LOG_DEBUG) {
+		curl_easy_setopt(_curl, CURLOPT_VERBOSE, 1);
+	}
+	curl_easy_setopt(_curl, CURLOPT_URL, _requests.url().c_str());
+	curl_easy_setopt(_curl, CURLOPT_HTTPHEADER, _headers);
+	curl_easy_setopt(_curl, CURLOPT_WRITEFUNCTION, cloud_write_callback);
+	curl_easy_setopt(_curl, CURLOPT_WRITEDATA, (void *)this);
+	curl_easy_setopt(_curl, CURLOPT_PRIVATE, (void *)this);
+	curl_easy_setopt(_curl, CURLOPT_USERAGENT, "shellyd-agent");
+	if (_requests.compression()) {
+		// offer all encodings curl can decode, it decompresses the
+		// response as it arrives before it reaches the write callback
+		curl_easy_setopt(_curl, CURLOPT_ACCEPT_ENCODING, "");
+	}
+	if (_requests.timeout() > 0) {
+		curl_easy_setopt(_curl, CURLOPT_TIMEOUT, _requests.timeout());
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "cloud endpoint %s at %s",
+		_name.c_str(), _requests.url().c_str());
+}
+
+/**
+ * \brief Release the curl handle
+ */
+cloudendpoint::~cloudendpoint() {
+	curl_easy_cleanup(_curl);
+	curl_slist_free_all(_headers);
+}
+
+/**
+ * \brief Append received data to the response
+ *
+ * \param data		the data received
+ * \param size		the number of bytes received
+ */
+void	cloudendpoint::received(const char *data, size_t size) {
+	_response.append(data, size);
+	metrics::bytesreceived.fetch_add(size, std::memory_order_relaxed);
+}
+
+/**
+ * \brief Split the devices of the endpoint into the chunks of all cycles
+ *
+ * \param ids		the devices normally retrieved from this endpoint
+ */
+void	cloudendpoint::partition(const std::list<std::string>& ids) {
+	_requests.partition(ids, _chunksize);
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "cloud %s: %lu devices in %lu chunks",
+		_name.c_str(), (unsigned long)ids.size(),
+		(unsigned long)_requests.chunks());
+}
+
+/**
+ * \brief Assign the device ids to retrieve in this cycle
+ *
+ * A chunk all of whose devices are requested is sent as it is, with
+ * the body from the request cache. When devices have pushed their
+ * data, the chunks they belong to are sent with the remaining devices
+ * only, and the bodies of these chunks are serialized again in every
+ * cycle. Devices not in any chunk, like devices on the local network
+ * that did not answer, are sent in additional chunks.
+ *
+ * \param ids		the device ids
+ */
+void	cloudendpoint::assign(const std::list<std::string>& ids) {
+	_chunks.clear();
+	size_t	n = _requests.chunks();
+	std::vector<size_t>	requested(n + 1, 0);
+	for (auto& id : ids) {
+		requested[_requests.chunkof(id)]++;
+	}
+	// only the ids of incomplete chunks are collected
+	std::vector<std::list<std::string> >	partial(n + 1);
+	for (auto& id : ids) {
+		size_t	c = _requests.chunkof(id);
+		if ((c == n) || (requested[c] < _requests.chunk(c)->size())) {
+			partial[c].push_back(id);
+		}
+	}
+	for (size_t c = 0; c < n; c++) {
+		if (requested[c] == 0) {
+			continue;
+		}
+		chunk	k;
+		if (partial[c].size() == 0) {
+			k.ids = _requests.chunk(c);
+			k.body = _requests.body(c);
+		} else {
+			k.ids = std::shared_ptr<const std::list<std::string> >(
+				new std::list<std::string>(partial[c]));
+		}
+		_chunks.push_back(k);
+	}
+	auto	i = partial[n].begin();
+	while (i != partial[n].end()) {
+		std::shared_ptr<std::list<std::string> >	ids(
+			new std::list<std::string>());
+		while ((i != partial[n].end()) && ((_chunksize == 0)
+			|| (ids->size() < _chunksize))) {
+			ids->push_back(*i++);
+		}
+		chunk	k;
+		k.ids = ids;
+		_chunks.push_back(k);
+	}
+	_attempt = 0;
+	_notbefore = clocksource::time_point();
+}
+
+/**
+ * \brief Find out when the next request may be sent
+ *
+ * Once any backoff is over, a token is taken from the bucket, the
+ * request is due when the bucket allows it. If the request is not
+ * started after all, abandon() returns the token.
+ *
+ * \param now		the current time
+ */
+clocksource::time_point	cloudendpoint::due(const clocksource::time_point& now) {
+	if (now < _notbefore) {
+		return _notbefore;
+	}
+	if (!_reserved) {
+		_due = _limiter->acquire(now);
+		_reserved = true;
+	}
+	return _due;
+}
+
+/**
+ * \brief Prepare the handle for the request for the next chunk
+ *
+ * The body of a complete chunk comes from the request cache, the body
+ * of an incomplete one is serialized here. Either is handed to curl
+ * without copying it.
+ */
+CURL	*cloudendpoint::start() {
+	_reserved = false;
+	_busy = true;
+	chunk&	k = _chunks.front();
+	_body = (k.body) ? k.body : std::shared_ptr<const std::string>(
+		new std::string(requestcache::build(*k.ids)));
+	_response.clear();
+	curl_easy_setopt(_curl, CURLOPT_POSTFIELDS, _body->data());
+	curl_easy_setopt(_curl, CURLOPT_POSTFIELDSIZE, (long)_body->size());
+	_transferstart = tracer::now();
+	return _curl;
+}
+
+/**
+ * \brief Give up the current chunk
+ *
+ * \param reason	the reason to log
+ */
+void	cloudendpoint::giveup(const std::string& reason) {
+	debug(LOG_ERR, DEBUG_LOG, 0, "cloud %s: cannot retrieve data for %lu "
+		"devices: %s", _name.c_str(),
+		(unsigned long)_chunks.front().ids->size(), reason.c_str());
+	metrics::request(_name, metrics::failed);
+	_chunks.pop_front();
+	_attempt = 0;
+	_notbefore = clocksource::time_point();
+}
+
+/**
+ * \brief Give up all chunks not retrieved yet
+ *
+ * The chunk of a request still in flight is given up as well, the
+ * caller must have removed the handle from the multi handle. A token
+ * taken for a request that is not started is returned to the bucket.
+ *
+ * \param reason	the reason to log
+ */
+void	cloudendpoint::abandon(const std::string& reason) {
+	while (_chunks.size() > 0) {
+		giveup(reason);
+	}
+	if (_reserved) {
+		_limiter->refund();
+	}
+	_reserved = false;
+	_busy = false;
+}
+
+/**
+ * \brief Handle the completion of a request
+ *
+ * Throttled requests, server errors and failed transfers are retried
+ * with exponential backoff and full jitter, other failures give up
+ * the chunk.
+ *
+ * \param result	the result of the transfer
+ * \param now		the current time
+ * \param deadline	time after which a retry is no longer useful
+ * \param response	the response if the request succeeded
+ * \return		whether a response was received
+ */
+bool	cloudendpoint::finish(CURLcode result,
+		const clocksource::time_point& now,
+		const clocksource::time_point& deadline,
+		std::string& response) {
+	_busy = false;
+	long	code = 0;
+	curl_off_t	retryafter = 0;
+	if (result == CURLE_OK) {
+		curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &code);
+		curl_easy_getinfo(_curl, CURLINFO_RETRY_AFTER, &retryafter);
+		metrics::status(code);
+		if (tracer::enabled) {
+			tracephases(_curl, _transferstart);
+		}
+		curl_off_t	total = 0;
+		curl_easy_getinfo(_curl, CURLINFO_TOTAL_TIME_T, &total);
+		if (statistics::enabled) {
+			statistics::get(statistics::fetch).record(total);
+		}
+
+		// bytes on the wire versus bytes after decoding
+		curl_off_t	wire = 0;
+		long	headers = 0;
+		curl_easy_getinfo(_curl, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+		curl_easy_getinfo(_curl, CURLINFO_HEADER_SIZE, &headers);
+		metrics::wirebytes.fetch_add(wire + headers,
+			std::memory_order_relaxed);
+		debug(LOG_INFO, DEBUG_LOG, 0, "cloud %s, %lu devices: %ld "
+			"bytes on the wire, %lu bytes decoded", _name.c_str(),
+			(unsigned long)_chunks.front().ids->size(),
+			(long)(wire + headers),
+			(unsigned long)_response.size());
+	}
+	if ((result == CURLE_OK) && (code == 200)) {
+		metrics::request(_name, metrics::succeeded);
+		_chunks.pop_front();
+		_attempt = 0;
+		_notbefore = clocksource::time_point();
+		response = std::string();
+		std::swap(response, _response);
+		return true;
+	}
+
+	// throttling and server errors are not parseable responses
+	cloudexception	x = (result != CURLE_OK)
+		? cloudexception(stringprintf("curl failed: %s",
+			curl_easy_strerror(result)), 0)
+		: cloudexception(stringprintf("HTTP status %ld", code), code,
+			(long)retryafter);
+	if (!x.retryable() || (_attempt >= _retries)) {
+		giveup(x.what());
+		return false;
+	}
+
+	// exponential backoff with full jitter
+	long	limit = _backoff;
+	for (int i = 0; (i < _attempt) && (limit < _maxbackoff); i++) {
+		limit *= 2;
+	}
+	if (limit > _maxbackoff) {
+		limit = _maxbackoff;
+	}
+	std::uniform_int_distribution<long>	jitter(0, limit);
+	clocksource::time_point	retry = now
+		+ std::chrono::milliseconds(jitter(_random));
+	if (x.retryafter() > 0) {
+		clocksource::time_point	after = now
+			+ std::chrono::seconds(x.retryafter());
+		_limiter->hold(after);
+		if (retry < after) {
+			retry = after;
+		}
+	}
+	if (retry > deadline) {
+		giveup(stringprintf("%s, no time left to retry", x.what()));
+		return false;
+	}
+	debug(LOG_WARNING, DEBUG_LOG, 0, "cloud %s: %s, retry %d in %ld ms",
+		_name.c_str(), x.what(), _attempt + 1, (long)std::chrono::
+		duration_cast<std::chrono::milliseconds>(retry - now).count());
+	metrics::retries++;
+	metrics::request(_name, metrics::retried);
+	_attempt++;
+	_notbefore = retry;
+	return false;
+}
+
+/**
+ * \brief Create the endpoints and assign the devices to them
+ *
+ * \param config	the configuration containing the cloud section
+ */
+cloudpoller::cloudpoller(configuration_ptr config) {
+	_multi = curl_multi_init();
+	nlohmann::json	cloud = config->value("cloud");
+	if (cloud.is_array()) {
+		for (size_t i = 0; i < cloud.size(); i++) {
+			std::string	name = cloud[i].value("name",
+				stringprintf("cloud%lu", (unsigned long)i));
+			_endpoints.push_back(cloudendpoint_ptr(
+				new cloudendpoint(name, cloud[i])));
+		}
+	} else if (cloud.is_object()) {
+		_endpoints.push_back(cloudendpoint_ptr(new cloudendpoint(
+			cloud.value("name", std::string("default")), cloud)));
+	}
+	if (_endpoints.size() == 0) {
+		throw shellyexception("no cloud endpoint configured");
+	}
+
+	// devices without a cloud key belong to the first endpoint
+	for (auto device : config->value("devices")) {
+		if (!device.contains("cloud")) {
+			continue;
+		}
+		std::string	id = device["id"];
+		std::string	name = device["cloud"];
+		cloudendpoint_ptr	e;
+		for (auto endpoint : _endpoints) {
+			if (endpoint->name() == name) {
+				e = endpoint;
+			}
+		}
+		if (!e) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "device %s: unknown cloud "
+				"%s, not polled", id.c_str(), name.c_str());
+		}
+		_devices[id] = e;
+	}
+
+	// the chunks of all cycles, devices on the local network are only
+	// retrieved from the cloud if they do not answer
+	std::map<std::string, std::string>	addresses = config->addresses();
+	std::map<cloudendpoint_ptr, std::list<std::string> >	members;
+	for (auto e : _endpoints) {
+		members[e];
+	}
+	for (auto id : config->idlist()) {
+		if (addresses.count(id) > 0) {
+			continue;
+		}
+		auto	d = _devices.find(id);
+		cloudendpoint_ptr	e = (d == _devices.end())
+			? _endpoints.front() : d->second;
+		if (e) {
+			members[e].push_back(id);
+		}
+	}
+	for (auto& m : members) {
+		m.first->partition(m.second);
+	}
+}
+
+/**
+ * \brief Release all handles
+ */
+cloudpoller::~cloudpoller() {
+	_devices.clear();
+	_endpoints.clear();
+	curl_multi_cleanup(_multi);
+}
+
+/**
+ * \brief Retrieve the status of a set of devices from all endpoints
+ *
+ * The requests of all endpoints run concurrently, each response is
+ * handed to the deliver function as soon as it is complete. The
+ * events of the companion, if there is one, are waited for together
+ * with the transfers.
+ *
+ * \param ids		the ids of the devices to retrieve
+ * \param clock		the clock of the loop
+ * \param deadline	time after which no more requests are sent
+ * \param deliver	function to call with every response
+ * \param companion	other work to drive while waiting, or NULL
+ */
+void	cloudpoller::fetch(const std::list<std::string>& ids,
+		clocksource_ptr clock, const clocksource::time_point& deadline,
+		std::function<void(const std::string&)> deliver,
+		pollsource *companion) {
+	tracespan	span("cloud", "fetch",
+		stringprintf("%lu devices", (unsigned long)ids.size()));
+
+	// assign the devices to their endpoints
+	std::map<cloudendpoint_ptr, std::list<std::string> >	assigned;
+	for (auto id : ids) {
+		auto	d = _devices.find(id);
+		cloudendpoint_ptr	e = (d == _devices.end())
+			? _endpoints.front() : d->second;
+		if (e) {
+			assigned[e].push_back(id);
+		}
+	}
+	for (auto a : assigned) {
+		a.first->assign(a.second);
+	}
+
+	int	inflight = 0;
+	while (1) {
+		// start the requests that are due
+		clocksource::time_point	now = clock->now();
+		clocksource::time_point	next = clocksource::time_point::max();
+		for (auto e : _endpoints) {
+			if (e->busy() || !e->pending()) {
+				continue;
+			}
+			clocksource::time_point	due = e->due(now);
+			if (due > deadline) {
+				e->abandon("no time left in this cycle");
+			} else if (due <= now) {
+				curl_multi_add_handle(_multi, e->start());
+				inflight++;
+			} else if (due < next) {
+				next = due;
+			}
+		}
+		bool	companionbusy = companion && companion->busy();
+		if (inflight == 0) {
+			if (next == clocksource::time_point::max()) {
+				break;
+			}
+			if (!companionbusy) {
+				clock->sleep_until(next);
+				continue;
+			}
+		}
+
+		// run the transfers and collect the completed ones
+		CURLMcode	mc = CURLM_OK;
+		if (inflight > 0) {
+			int	running = 0;
+			mc = curl_multi_perform(_multi, &running);
+		}
+		CURLMsg	*msg;
+		int	left;
+		while (NULL != (msg = curl_multi_info_read(_multi, &left))) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			CURL	*curl = msg->easy_handle;
+			CURLcode	result = msg->data.result;
+			cloudendpoint	*e = NULL;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&e);
+			curl_multi_remove_handle(_multi, curl);
+			inflight--;
+			std::string	response;
+			if (e->finish(result, clock->now(), deadline,
+				response)) {
+				deliver(response);
+			}
+		}
+
+		// wait for the transfers, the companion or the next request
+		companionbusy = companion && companion->busy();
+		if ((mc == CURLM_OK) && ((inflight > 0) || companionbusy)) {
+			long	timeout = 1000;
+			if (next != clocksource::time_point::max()) {
+				long	ms = std::chrono::duration_cast<
+					std::chrono::milliseconds>(
+					next - clock->now()).count();
+				timeout = (ms < 1) ? 1
+					: ((ms < timeout) ? ms : timeout);
+			}
+			struct curl_waitfd	w;
+			int	nfds = 0;
+			if (companionbusy) {
+				long	t;
+				companion->prepare(w, t);
+				if ((t >= 0) && (t < timeout)) {
+					timeout = t;
+				}
+				nfds = 1;
+			}
+			mc = curl_multi_poll(_multi, &w, nfds, timeout, NULL);
+			if (companionbusy) {
+				companion->step(w);
+			}
+		}
+		if (mc != CURLM_OK) {
+			// give up the transfers in flight and the chunks not
+			// sent yet, so the endpoints are polled next cycle
+			std::string	reason = stringprintf(
+				"curl multi failed: %s",
+				curl_multi_strerror(mc));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", reason.c_str());
+			for (auto e : _endpoints) {
+				if (e->busy()) {
+					curl_multi_remove_handle(_multi,
+						e->handle());
+					inflight--;
+				}
+				e->abandon(reason);
+			}
+			break;
+		}
+	}
+}
+
+} // namespace shelly
@@ -0,0 +1,150 @@
+/*
+ * cloud.h -- concurrent polling of one or more cloud endpoints
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _cloud_h
+#define _cloud_h
+
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <json.hpp>
+#include <curl/curl.h>
+#include "configuration.h"
+#include "clock.h"
+#include "ratelimit.h"
+#include "requestcache.h"
+#include "common.h"
+
+namespace shelly {
+
+/**
+ * \brief Failure of a cloud request
+ *
+ * Carries the HTTP status, 0 if the transfer itself failed, and the
+ * number of seconds the server asked the client to wait, 0 if it did
+ * not send a Retry-After header.
+ */
+class cloudexception : public shellyexception {
+	long	_status;
+	long	_retryafter;
+public:
+	cloudexception(const std::string& w, long status, long retryafter = 0)
+		: shellyexception(w), _status(status),
+		  _retryafter(retryafter) { }
+	long	status() const { return _status; }
+	long	retryafter() const { return _retryafter; }
+	bool	retryable() const {
+		return (_status == 0) || (_status == 429) || (_status >= 500);
+	}
+};
+
+/**
+ * \brief Work that runs on the event loop of the cloud poller
+ *
+ * While a fetch is running, the poller also waits for the events a
+ * busy pollsource asks for and lets it proceed when they occur, so
+ * that other I/O overlaps with the cloud transfers on the same thread.
+ */
+class pollsource {
+public:
+	virtual ~pollsource() { }
+	virtual bool	busy() const = 0;
+	virtual void	prepare(struct curl_waitfd& w, long& timeout) const = 0;
+	virtual void	step(const struct curl_waitfd& w) = 0;
+};
+
+/**
+ * \brief A cloud server and account the devices are retrieved from
+ *
+ * Each endpoint has its own request parameters, rate limit and retry
+ * policy, and its own curl handle, so that the connection to the
+ * server is reused from request to request. The ids assigned to the
+ * endpoint are sent in chunks, one request at a time: a chunk is only
+ * started once the token bucket allows it, a failed chunk is retried
+ * after an exponential backoff with full jitter, but not before the
+ * time asked for by a Retry-After header and not past the deadline.
+ */
+class cloudendpoint {
+	std::string	_name;
+	requestcache	_requests;
+	tokenbucket_ptr	_limiter;
+	size_t	_chunksize;
+	int	_retries;
+	long	_backoff;
+	long	_maxbackoff;
+	CURL	*_curl;
+	struct curl_slist	*_headers;
+	std::shared_ptr<const std::string>	_body;
+	std::string	_response;
+	typedef struct {
+		std::shared_ptr<const std::list<std::string> >	ids;
+		std::shared_ptr<const std::string>	body;
+	} chunk;
+	std::list<chunk>	_chunks;
+	int	_attempt;
+	bool	_reserved;
+	bool	_busy;
+	clocksource::time_point	_due;
+	clocksource::time_point	_notbefore;
+	int64_t	_transferstart;
+	std::mt19937	_random;
+	void	giveup(const std::string& reason);
+	cloudendpoint(const cloudendpoint& other);
+	cloudendpoint&	operator=(const cloudendpoint& other);
+public:
+	cloudendpoint(const std::string& name, const nlohmann::json& settings);
+	~cloudendpoint();
+	static tokenbucket_ptr	limiter(const nlohmann::json& settings);
+	const std::string&	name() const { return _name; }
+	void	partition(const std::list<std::string>& ids);
+	void	assign(const std::list<std::string>& ids);
+	bool	pending() const { return _chunks.size() > 0; }
+	bool	busy() const { return _busy; }
+	CURL	*handle() const { return _curl; }
+	clocksource::time_point	due(const clocksource::time_point& now);
+	CURL	*start();
+	bool	finish(CURLcode result, const clocksource::time_point& now,
+			const clocksource::time_point& deadline,
+			std::string& response);
+	void	abandon(const std::string& reason);
+	void	received(const char *data, size_t size);
+};
+
+typedef std::shared_ptr<cloudendpoint>	cloudendpoint_ptr;
+
+/**
+ * \brief Poller sending the requests to all endpoints concurrently
+ *
+ * The cloud section of the configuration is either a single endpoint
+ * or an array of endpoints, devices name the endpoint they belong to
+ * in their cloud key, devices without one belong to the first
+ * endpoint. All endpoints share a curl multi handle, so the requests
+ * to different endpoints run at the same time on the loop thread,
+ * while each endpoint observes its own limits.
+ */
+class cloudpoller {
+	CURLM	*_multi;
+	std::vector<cloudendpoint_ptr>	_endpoints;
+	std::map<std::string, cloudendpoint_ptr>	_devices;
+	cloudpoller(const cloudpoller& other);
+	cloudpoller&	operator=(const cloudpoller& other);
+public:
+	cloudpoller(configuration_ptr config);
+	~cloudpoller();
+	void	fetch(const std::list<std::string>& ids, clocksource_ptr clock,
+			const clocksource::time_point& deadline,
+			std::function<void(const std::string&)> deliver,
+			pollsource *companion = NULL);
+};
+
+typedef std::shared_ptr<cloudpoller>	cloudpoller_ptr;
+
+} // namespace shelly
+
+#endif /* _cloud_h */
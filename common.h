@@ -3,7 +3,11 @@
  *
  * (c) 2025 Prof Dr Andreas Müller
  */
+#ifndef _common_h
+#define _common_h
+
 #include <stdexcept>
+#include <string>
 
 namespace shelly {
 
@@ -15,3 +19,5 @@ public:
 extern bool	dryrun;
 
 } // namespace shelly
+
+#endif /* _common_h */
@@ -6,11 +6,39 @@
 #include "configuration.h"
 #include "debug.h"
 #include "common.h"
+#include "format.h"
 #include <iostream>
 #include <fstream>
+#include <set>
+#include <climits>
+#include <cstdlib>
 
 namespace shelly {
 
+/**
+ * \brief Make a file name relative to the configuration file absolute
+ *
+ * The daemon changes to the root directory, so names relative to the
+ * configuration file must be resolved while it is read.
+ *
+ * \param filename	name of the configuration file
+ * \param name		the file name to resolve
+ */
+static std::string	absolute(const std::string& filename,
+		const std::string& name) {
+	if ((name.size() == 0) || (name[0] == '/')) {
+		return name;
+	}
+	size_t	s = filename.rfind('/');
+	std::string	directory = (s == std::string::npos)
+		? "." : filename.substr(0, (s > 0) ? s : 1);
+	char	path[PATH_MAX];
+	if (NULL != realpath(directory.c_str(), path)) {
+		directory = path;
+	}
+	return directory + "/" + name;
+}
+
 /**
  * \brief read configuration from a file
  *
@@ -19,8 +47,91 @@ namespace shelly {
 configuration::configuration(const std::string& filename) {
 	std::ifstream	ifs(filename);
 	data = nlohmann::json::parse(ifs);
+	if (has("rollup.averages")) {
+		data["rollup"]["averages"] = absolute(filename,
+			stringvalue("rollup.averages"));
+	}
+	if (has("discovery.file")) {
+		std::string	f = absolute(filename,
+			stringvalue("discovery.file"));
+		data["discovery"]["file"] = f;
+		merge(f);
+	}
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "configuration data: %s",
 		data.dump(4).c_str());
+	buildindex();
+}
+
+/**
+ * \brief Add the devices of a file written by device discovery
+ *
+ * Devices listed in the configuration file itself take precedence, the
+ * devices added are marked as discovered. A missing or unreadable file
+ * only means that no devices have been discovered yet.
+ *
+ * \param filename	name of the file with the discovered devices
+ */
+void	configuration::merge(const std::string& filename) {
+	std::ifstream	ifs(filename);
+	if (!ifs) {
+		return;
+	}
+	nlohmann::json	fragment;
+	try {
+		fragment = nlohmann::json::parse(ifs);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "ignoring %s: %s",
+			filename.c_str(), x.what());
+		return;
+	}
+	if (!fragment.contains("devices") || !fragment["devices"].is_array()) {
+		return;
+	}
+	if (!data.contains("devices")) {
+		data["devices"] = nlohmann::json::array();
+	}
+	std::set<std::string>	ids;
+	for (auto device : data["devices"]) {
+		if (device.contains("id") && device["id"].is_string()) {
+			ids.insert(device["id"].get<std::string>());
+		}
+	}
+	for (auto device : fragment["devices"]) {
+		if (!device.contains("id") || !device["id"].is_string()
+			|| (ids.count(device["id"]) > 0)) {
+			continue;
+		}
+		device["discovered"] = true;
+		data["devices"].push_back(device);
+	}
+}
+
+/**
+ * \brief construct a configuration from JSON data
+ *
+ * \param data		the configuration data
+ */
+configuration::configuration(const nlohmann::json& data) : data(data) {
+	buildindex();
+}
+
+/**
+ * \brief Index the devices by id
+ *
+ * If an id appears more than once, the first entry wins, as it did when
+ * the device list was searched.
+ */
+void	configuration::buildindex() {
+	if (!data.contains("devices") || !data["devices"].is_array()) {
+		return;
+	}
+	const nlohmann::json&	devices = data["devices"];
+	for (size_t i = 0; i < devices.size(); i++) {
+		if (devices[i].contains("id") && devices[i]["id"].is_string()) {
+			_index.insert(std::make_pair(
+				devices[i]["id"].get<std::string>(), i));
+		}
+	}
 }
 
 /**
@@ -80,6 +191,22 @@ int	configuration::intvalue(const std::string& path) const {
 	return result;
 }
 
+/**
+ * \brief retrieve an arbitrary JSON value from the configuration
+ *
+ * \param path		json path to the value
+ */
+nlohmann::json	configuration::value(const std::string& path) const {
+	std::list<std::string>	pc = splitpath(path);
+	nlohmann::json	d = data;
+	while (pc.size() > 0) {
+		std::string	c = pc.front();
+		d = d[c];
+		pc.pop_front();
+	}
+	return d;
+}
+
 /**
  * \brief Retrieve list of device ids from 
  */
@@ -92,18 +219,50 @@ std::list<std::string>	configuration::idlist() const {
 	return result;
 }
 
+/**
+ * \brief Get the LAN addresses of all devices that have one
+ *
+ * Devices with an address are polled directly on the local network
+ * instead of through the cloud.
+ */
+std::map<std::string, std::string>	configuration::addresses() const {
+	std::map<std::string, std::string>	result;
+	nlohmann::json	devices = data["devices"];
+	for (auto device : devices) {
+		if (device.contains("address")) {
+			result[device["id"]] = device["address"];
+		}
+	}
+	return result;
+}
+
+/**
+ * \brief Get the MQTT topic prefixes of all devices that have one
+ *
+ * The map is keyed by the topic prefix and gives the device id.
+ */
+std::map<std::string, std::string>	configuration::topics() const {
+	std::map<std::string, std::string>	result;
+	nlohmann::json	devices = data["devices"];
+	for (auto device : devices) {
+		if (device.contains("topic")) {
+			result[device["topic"]] = device["id"];
+		}
+	}
+	return result;
+}
+
 /**
  * \brief Retrieve a json structure for a device by id
  *
  * \param id	the id of the device
  */
 nlohmann::json	configuration::device(const std::string& id) const {
-	nlohmann::json	devices = data["devices"];
-	for (auto device : devices) {
-		if (device["id"] == id)
-			return device;
+	auto	i = _index.find(id);
+	if (i == _index.end()) {
+		throw shellyexception("device not found");
 	}
-	throw shellyexception("device not found");
+	return data["devices"][i->second];
 }
 
 /**
@@ -124,4 +283,83 @@ bool	configuration::has(const std::string& path) const {
 	return true;
 }
 
+/**
+ * \brief Check that the configuration can be used by the daemon
+ *
+ * The accessors assume that values they are asked for are present, so
+ * a configuration replacing a running one is checked for the values
+ * the loop needs before it is put into service.
+ */
+void	configuration::validate() const {
+	static const char	*required[] = {
+		"database.hostname", "database.username", "database.password",
+		"database.dbname", "database.port", NULL
+	};
+	for (int i = 0; NULL != required[i]; i++) {
+		if (!has(required[i])) {
+			throw shellyexception(stringprintf("%s missing",
+				required[i]));
+		}
+	}
+	// the cloud section is a single endpoint or a list of endpoints
+	std::set<std::string>	endpoints;
+	if (data.contains("cloud")) {
+		nlohmann::json	cloud = data["cloud"];
+		if (!cloud.is_array()) {
+			cloud = nlohmann::json::array({ cloud });
+		}
+		for (size_t i = 0; i < cloud.size(); i++) {
+			static const char	*keys[] = {
+				"url", "endpoint", "key", NULL };
+			for (int k = 0; NULL != keys[k]; k++) {
+				if (!cloud[i].is_object()
+					|| !cloud[i].contains(keys[k])) {
+					throw shellyexception(stringprintf(
+						"cloud %lu: %s missing",
+						(unsigned long)i, keys[k]));
+				}
+			}
+			std::string	name = cloud[i].value("name",
+				(data["cloud"].is_array()) ? stringprintf(
+				"cloud%lu", (unsigned long)i) : "default");
+			if (!endpoints.insert(name).second) {
+				throw shellyexception(stringprintf("duplicate "
+					"cloud %s", name.c_str()));
+			}
+		}
+	}
+	// defaults for the columns of provisioned rows
+	for (auto table : { "station", "sensor" }) {
+		if (data.contains("provision") && data["provision"].is_object()
+			&& data["provision"].contains(table)
+			&& !data["provision"][table].is_object()) {
+			throw shellyexception(stringprintf("provision.%s is "
+				"not an object", table));
+		}
+	}
+	if (!data.contains("devices") || !data["devices"].is_array()) {
+		throw shellyexception("no device list");
+	}
+	for (auto device : data["devices"]) {
+		static const char	*keys[] = { "id", "station", "sensor",
+						NULL };
+		for (int i = 0; NULL != keys[i]; i++) {
+			if (!device.contains(keys[i])
+				|| !device[keys[i]].is_string()) {
+				throw shellyexception(stringprintf("device "
+					"without %s: %s", keys[i],
+					device.dump().c_str()));
+			}
+		}
+		if (device.contains("cloud") && (!device["cloud"].is_string()
+			|| (endpoints.count(device["cloud"]) == 0))) {
+			throw shellyexception(stringprintf("device with "
+				"unknown cloud: %s", device.dump().c_str()));
+		}
+	}
+	if (_index.size() != data["devices"].size()) {
+		throw shellyexception("duplicate device ids");
+	}
+}
+
 } // namespace shelly
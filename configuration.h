@@ -8,21 +8,38 @@
 
 #include <string>
 #include <list>
+#include <map>
 #include <memory>
 #include "json.hpp"
 
 namespace shelly {
 
+/**
+ * \brief Immutable snapshot of the configuration
+ *
+ * A configuration is never modified once constructed, a reload creates
+ * a new snapshot that replaces the old one as a whole. The devices are
+ * indexed by id, so that looking up a device does not need to scan the
+ * device list.
+ */
 class configuration {
 	nlohmann::json	data;
+	std::map<std::string, size_t>	_index;
 	static std::list<std::string>	splitpath(const std::string& path);
+	void	buildindex();
+	void	merge(const std::string& filename);
 public:
 	configuration(const std::string& filename);
+	configuration(const nlohmann::json& data);
 	std::string	stringvalue(const std::string& path) const;
 	int	intvalue(const std::string& path) const;
+	nlohmann::json	value(const std::string& path) const;
 	std::list<std::string>	idlist() const;
+	std::map<std::string, std::string>	addresses() const;
+	std::map<std::string, std::string>	topics() const;
 	nlohmann::json	device(const std::string& id) const;
 	bool	has(const std::string& path) const;
+	void	validate() const;
 };
 
 typedef std::shared_ptr<configuration>	configuration_ptr;
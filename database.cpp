@@ -7,17 +7,71 @@
 #include "format.h"
 #include "debug.h"
 #include "common.h"
+#include "statistics.h"
+#include "metrics.h"
+#include <cmath>
 
 namespace shelly {
 
+std::mutex	database::_sensorlock;
+std::map<database::sensorkey, int>	database::_knownsensors;
+
+/**
+ * \brief Quote a string for use in a statement
+ *
+ * \param mysql		the connection whose character set is used
+ * \param s		the string to quote
+ */
+std::string	database::quote(MYSQL *mysql, const std::string& s) {
+	std::vector<char>	buffer(2 * s.size() + 1);
+	unsigned long	l = mysql_real_escape_string(mysql, buffer.data(),
+		s.data(), s.size());
+	return "'" + std::string(buffer.data(), l) + "'";
+}
+
+/**
+ * \brief Build the query for the sensor ids of many sensors at once
+ *
+ * The rows of the result contain the station name, the sensor name and
+ * the sensor id of the pairs found.
+ *
+ * \param mysql		the connection used to quote the names
+ * \param pairs		the station/sensor pairs to look up
+ * \return		the query, empty if there are no pairs
+ */
+std::string	database::sensorquery(MYSQL *mysql,
+		const std::set<sensorkey>& pairs) {
+	std::string	list;
+	for (auto& p : pairs) {
+		list += (list.size() ? ",(" : "(") + quote(mysql, p.first)
+			+ "," + quote(mysql, p.second) + ")";
+	}
+	if (list.size() == 0) {
+		return list;
+	}
+	return "select a.name, b.name, b.id from station a, sensor b "
+		"where a.id = b.stationid and (a.name, b.name) in ("
+		+ list + ")";
+}
+
 /**
  * \brief Retrieving the sensor id
  *
+ * Ids found before are taken from the cache of known sensors.
+ *
  * \param station	the station name
  * \param sensor	the sensor name
  */
 int	database::sensorid(const std::string& station,
 		const std::string& sensor) {
+	{
+		std::unique_lock<std::mutex>	lock(_sensorlock);
+		auto	k = _knownsensors.find(sensorkey(station, sensor));
+		if (k != _knownsensors.end()) {
+			return k->second;
+		}
+	}
+	stopwatch	watch(statistics::sensorid);
 	int	rc = -1;
 	MYSQL_BIND	bind[2];
 	MYSQL_BIND	result[1];
@@ -118,6 +172,10 @@ int	database::sensorid(const std::string& station,
 
 	// retrieve the result id from the row, use it as return value
 	rc = resultid;
+	{
+		std::unique_lock<std::mutex>	lock(_sensorlock);
+		_knownsensors[sensorkey(station, sensor)] = rc;
+	}
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "sensor id for %s/%s is %d",
 		station.c_str(), sensor.c_str(), resultid);
 
@@ -238,14 +296,28 @@ cleanup:
  * \brief construct a database connection
  *
  * \param config	the configuration to use
+ * \param clientflags	client flags for the connection
  */
-database::database(configuration_ptr config) : _config(config), mysql(NULL) {
+database::database(configuration_ptr config, unsigned long clientflags)
+	: _insert(NULL), _bulk(false), _devices(0), _stored(0), _config(config),
+	  _schema(config), mysql(NULL) {
+	stopwatch	watch(statistics::connect);
+
+	// one value array in the sdata layout, one per column if wide
+	_values.resize((_schema.wide) ? _schema.columns.size() : 1);
+
 	// initialize mysql
 	mysql = mysql_init(mysql);
 	if (NULL == mysql) {
 		debug(LOG_ERR, DEBUG_LOG, 0, "cannot create mysql");
 	}
 
+	// loading local files must be enabled before connecting
+	if (clientflags & CLIENT_LOCAL_FILES) {
+		unsigned int	enable = 1;
+		mysql_options(mysql, MYSQL_OPT_LOCAL_INFILE, &enable);
+	}
+
 	// connect to the database
 	std::string	hostname = _config->stringvalue("database.hostname");
 	std::string	username = _config->stringvalue("database.username");
@@ -254,10 +326,12 @@ database::database(configuration_ptr config) : _config(config), mysql(NULL) {
 	int	port = _config->intvalue("database.port");
 	if (NULL == mysql_real_connect(mysql, hostname.c_str(),
 		username.c_str(), password.c_str(), dbname.c_str(),
-		port, NULL, 0)) {
+		port, NULL, clientflags)) {
 		debug(LOG_ERR, DEBUG_LOG, 0,
 			"cannot connect to the database: %s",
 			mysql_error(mysql));
+	} else {
+		metrics::connects++;
 	}
 
 	// read the field ids
@@ -269,12 +343,27 @@ database::database(configuration_ptr config) : _config(config), mysql(NULL) {
 		"temperature_id = %d, humidity_id = %d, capacity_id = %d, "
 		"battery_id  = %d",
 		temperature_id, humidity_id, capacity_id, battery_id);
+
+	// array binding needs Connector/C 3.0 and MariaDB server 10.2.6
+	std::string	mode("array");
+	if (_config->has("database.insert")) {
+		mode = _config->stringvalue("database.insert");
+	}
+#if defined(MARIADB_PACKAGE_VERSION_ID) && (MARIADB_PACKAGE_VERSION_ID >= 30000)
+	_bulk = (mode == "array")
+		&& (mysql_get_server_version(mysql) >= 100206);
+#endif
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "using %s inserts",
+		(_bulk) ? "array" : "multi-row");
 }
 
 /**
  * \brief Close the database connection
  */
 database::~database() {
+	if (_insert) {
+		mysql_stmt_close(_insert);
+	}
 	mysql_close(mysql);
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "database connection closed");
 }
@@ -282,6 +371,8 @@ database::~database() {
 /**
  * \brief Add data for a given sensor
  *
+ * The values are only collected here, they are inserted by flush().
+ *
  * \param station		station name
  * \param sensor		sensor name
  * \param temperature		temperature in degrees Celsius
@@ -295,144 +386,277 @@ void	database::add(const std::string& station, const std::string& sensor,
 		float capacity) {
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "adding data for %s/%s",
 		station.c_str(), sensor.c_str());
-	std::string	error;
-	MYSQL_STMT	*stmt;
 
 	// retrieve the sensor id for this station/sensor combination
 	int	sid = sensorid(station, sensor);
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "found sensor id %s/%s -> %d",
 		station.c_str(), sensor.c_str(), sid);
 
-	// prepare the insert statement
-	if (NULL == (stmt = mysql_stmt_init(mysql))) {
-		error = stringprintf("cannot create a statement: %s",
-			mysql_error(mysql));
-		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-		throw shellyexception(error);
-	}
-	std::string	query(	"insert into "
-				"sdata(timekey, sensorid, fieldid, value) "
-				"values (?, ?, ?, ?)");
-	if (mysql_stmt_prepare(stmt, query.c_str(), query.size())) {
-		error = stringprintf("cannot parse '%s': %s",
-			query.c_str(), mysql_stmt_error(stmt));
-		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-		goto cleanup;
+	const struct {
+		int	fieldid;
+		float	value;
+	} values[schema::nfields] = {
+		{ temperature_id, temperature }, { humidity_id, humidity },
+		{ battery_id, battery }, { capacity_id, capacity }
+	};
+	if (_schema.wide) {
+		_timekeys.push_back(timekey);
+		_sensorids.push_back(sid);
+		for (size_t c = 0; c < _schema.columns.size(); c++) {
+			_values[c].push_back(values[_schema.columns[c]].value);
+		}
+	} else {
+		for (int i = 0; i < schema::nfields; i++) {
+			if (std::isnan(values[i].value)) {
+				continue;
+			}
+			_timekeys.push_back(timekey);
+			_sensorids.push_back(sid);
+			_fieldids.push_back(values[i].fieldid);
+			_values[0].push_back(values[i].value);
+		}
 	}
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "insert query prepared: %s",
-		query.c_str());
-
-	// setup binding
-	MYSQL_BIND	bind[4];
-	memset(bind, 0, sizeof(bind));
+	_devices++;
+}
 
-	bind[0].buffer_type = MYSQL_TYPE_LONG;
-	bind[0].buffer = &timekey;
-	bind[0].is_null = 0;
-	bind[0].length = 0;
+/**
+ * \brief Forget the collected values
+ */
+void	database::clear() {
+	_timekeys.clear();
+	_sensorids.clear();
+	_fieldids.clear();
+	for (auto& v : _values) {
+		v.clear();
+	}
+	_devices = 0;
+}
 
-	bind[1].buffer_type = MYSQL_TYPE_LONG;
-	bind[1].buffer = &sid;
-	bind[1].is_null = 0;
-	bind[1].length = 0;
+/**
+ * \brief The parametrized insert statement for the schema
+ */
+std::string	database::insertquery() const {
+	std::string	query = "insert into " + _schema.table + "("
+		+ _schema.insertcolumns() + ") values (?, ?";
+	for (size_t c = 0; c < _values.size(); c++) {
+		query += ", ?";
+	}
+	if (!_schema.wide) {
+		query += ", ?";
+	}
+	return query + ")";
+}
 
-	bind[2].buffer_type = MYSQL_TYPE_LONG;
-	bind[2].is_null = 0;
-	bind[2].length = 0;
+/**
+ * \brief Insert the collected values with a single array execute
+ *
+ * \return		false if array binding is not available
+ */
+bool	database::insertarray() {
+#if defined(MARIADB_PACKAGE_VERSION_ID) && (MARIADB_PACKAGE_VERSION_ID >= 30000)
+	std::string	error;
+	if (NULL == _insert) {
+		if (NULL == (_insert = mysql_stmt_init(mysql))) {
+			error = stringprintf("cannot create a statement: %s",
+				mysql_error(mysql));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+			throw shellyexception(error);
+		}
+		std::string	query = insertquery();
+		if (mysql_stmt_prepare(_insert, query.c_str(), query.size())) {
+			error = stringprintf("cannot parse '%s': %s",
+				query.c_str(), mysql_stmt_error(_insert));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+			mysql_stmt_close(_insert);
+			_insert = NULL;
+			throw shellyexception(error);
+		}
+	}
 
-	bind[3].buffer_type = MYSQL_TYPE_FLOAT;
-	bind[3].is_null = 0;
-	bind[3].length = 0;
+	// the number of rows in the parameter arrays
+	unsigned int	size = _timekeys.size();
+	if (mysql_stmt_attr_set(_insert, STMT_ATTR_ARRAY_SIZE, &size)) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "no array binding: %s",
+			mysql_stmt_error(_insert));
+		return false;
+	}
 
-	// bind timekey, sid, temperature_id, temperature
-	bind[2].buffer = &temperature_id;
-	bind[3].buffer = &temperature;
-	if (mysql_stmt_bind_param(stmt, bind)) {
-		error = stringprintf("cannot bind for temperature: %s",
-			mysql_stmt_error(stmt));
-		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-		goto cleanup;
+	// bind the column arrays
+	std::vector<MYSQL_BIND>	bind(3 + _values.size());
+	memset(bind.data(), 0, bind.size() * sizeof(MYSQL_BIND));
+	size_t	b = 0;
+	bind[b].buffer_type = MYSQL_TYPE_LONGLONG;
+	bind[b++].buffer = _timekeys.data();
+	bind[b].buffer_type = MYSQL_TYPE_LONG;
+	bind[b++].buffer = _sensorids.data();
+	if (!_schema.wide) {
+		bind[b].buffer_type = MYSQL_TYPE_LONG;
+		bind[b++].buffer = _fieldids.data();
 	}
-	if (dryrun) 
-		debug(LOG_DEBUG, DEBUG_LOG, 0,
-			"dryrun: not adding temperature %.1f", temperature);
-	else
-		if (mysql_stmt_execute(stmt)) {
-			error = stringprintf("cannot add temperature: %s",
-				mysql_stmt_error(stmt));
-			debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-			goto cleanup;
+	std::vector<std::vector<char> >	indicators(_values.size());
+	for (size_t c = 0; c < _values.size(); c++) {
+		bind[b].buffer_type = MYSQL_TYPE_FLOAT;
+		bind[b].buffer = _values[c].data();
+		// unknown values are sent as NULL
+		for (size_t i = 0; i < size; i++) {
+			if (std::isnan(_values[c][i])) {
+				indicators[c].resize(size, STMT_INDICATOR_NONE);
+				indicators[c][i] = STMT_INDICATOR_NULL;
+			}
 		}
-
-	// bind timekey, sid, humidity_id, humidity
-	bind[2].buffer = &humidity_id;
-	bind[3].buffer = &humidity;
-	if (mysql_stmt_bind_param(stmt, bind)) {
-		error = stringprintf("cannot bind for humidity: %s",
-			mysql_stmt_error(stmt));
+		if (indicators[c].size() > 0) {
+			bind[b].u.indicator = indicators[c].data();
+		}
+		b++;
+	}
+	if (mysql_stmt_bind_param(_insert, bind.data())) {
+		error = stringprintf("cannot bind arrays: %s",
+			mysql_stmt_error(_insert));
 		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-		goto cleanup;
+		throw shellyexception(error);
 	}
-	if (dryrun) 
-		debug(LOG_DEBUG, DEBUG_LOG, 0,
-			"dryrun: not adding humidity %.1f", humidity);
-	else
-		if (mysql_stmt_execute(stmt)) {
-			error = stringprintf("cannot add temperature: %s",
-				mysql_stmt_error(stmt));
-			debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-			goto cleanup;
-		}
-
-	// bind timekey, sid, battery_id, battery
-	bind[2].buffer = &battery_id;
-	bind[3].buffer = &battery;
-	if (mysql_stmt_bind_param(stmt, bind)) {
-		error = stringprintf("cannot bind for battery: %s",
-			mysql_stmt_error(stmt));
+	if (mysql_stmt_execute(_insert)) {
+		error = stringprintf("cannot add %u values: %s", size,
+			mysql_stmt_error(_insert));
 		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-		goto cleanup;
+		throw shellyexception(error);
 	}
-	if (dryrun) 
-		debug(LOG_DEBUG, DEBUG_LOG, 0,
-			"dryrun: not adding battery %.2f", battery);
-	else
-		if (mysql_stmt_execute(stmt)) {
-			error = stringprintf("cannot add battery: %s",
-				mysql_stmt_error(stmt));
-			debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-			goto cleanup;
-		}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%u rows added with one execute",
+		size);
+	return true;
+#else
+	return false;
+#endif
+}
 
-	// bind timekey, sid, capacity_id, capacity
-	bind[2].buffer = &capacity_id;
-	bind[3].buffer = &capacity;
-	if (mysql_stmt_bind_param(stmt, bind)) {
-		error = stringprintf("cannot bind for capacity: %s",
-			mysql_stmt_error(stmt));
-		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-		goto cleanup;
+/**
+ * \brief The values of a row for a multi-row insert statement
+ *
+ * \param i		the index of the row
+ */
+std::string	database::rowvalues(size_t i) const {
+	std::string	row = stringprintf("(%lld,%d", _timekeys[i],
+		_sensorids[i]);
+	if (!_schema.wide) {
+		row += stringprintf(",%d", _fieldids[i]);
+	}
+	for (auto& v : _values) {
+		row += (std::isnan(v[i])) ? std::string(",NULL")
+			: stringprintf(",%.9g", (double)v[i]);
 	}
-	if (dryrun) 
-		debug(LOG_DEBUG, DEBUG_LOG, 0,
-			"dryrun: not adding capacity %.0f", capacity);
-	else
-		if (mysql_stmt_execute(stmt)) {
-			error = stringprintf("cannot add capacity: %s",
-				mysql_stmt_error(stmt));
+	return row + ")";
+}
+
+/**
+ * \brief Insert the collected values with multi-row insert statements
+ *
+ * Each statement carries at most 1000 rows, to stay well below the
+ * maximum packet size of the server. The rows of the statements that
+ * succeeded are counted in _stored.
+ */
+void	database::insertrows() {
+	size_t	n = _timekeys.size();
+	size_t	i = 0;
+	while (i < n) {
+		std::string	query = "insert into " + _schema.table + "("
+			+ _schema.insertcolumns() + ") values ";
+		for (size_t j = 0; (j < 1000) && (i < n); j++, i++) {
+			query += ((j > 0) ? "," : "") + rowvalues(i);
+		}
+		if (mysql_real_query(mysql, query.data(), query.size())) {
+			std::string	error = stringprintf(
+				"cannot add values: %s", mysql_error(mysql));
 			debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
-			goto cleanup;
+			throw shellyexception(error);
 		}
+		_stored = i;
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%lu rows added with multi-row "
+		"inserts", (unsigned long)n);
+}
 
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "data added");
+/**
+ * \brief Insert the rows not stored yet with one statement per device
+ *
+ * Used when a batch insert failed, so that a single bad row, like a
+ * duplicate key of a device both pushed and polled in the same minute,
+ * only costs the device it belongs to. The rows of a device are the
+ * consecutive rows with the same timekey and sensor id.
+ *
+ * \return		the number of values inserted
+ */
+size_t	database::insertdevices() {
+	size_t	n = _timekeys.size();
+	size_t	i = _stored;
+	size_t	inserted = 0;
+	size_t	failed = 0;
+	std::string	error;
+	while (i < n) {
+		std::string	query = "insert into " + _schema.table + "("
+			+ _schema.insertcolumns() + ") values " + rowvalues(i);
+		size_t	rows = 1;
+		while ((i + rows < n) && (_timekeys[i + rows] == _timekeys[i])
+			&& (_sensorids[i + rows] == _sensorids[i])) {
+			query += "," + rowvalues(i + rows);
+			rows++;
+		}
+		if (mysql_real_query(mysql, query.data(), query.size())) {
+			error = mysql_error(mysql);
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot add values of "
+				"sensor %d at %lld: %s", _sensorids[i],
+				_timekeys[i], error.c_str());
+			failed++;
+		} else {
+			inserted += rows * _values.size();
+		}
+		i += rows;
+	}
+	metrics::inserterrors += failed;
+	if ((failed > 0) && (inserted == 0)) {
+		metrics::inserted += _stored * _values.size();
+		throw shellyexception(stringprintf("cannot add values of %lu "
+			"devices: %s", (unsigned long)failed, error.c_str()));
+	}
+	return inserted;
+}
 
-	// close the statement
-cleanup:
-	mysql_stmt_close(stmt);
-	if (error.size() > 0) {
-		throw shellyexception(error);
+/**
+ * \brief Insert all values collected since the last flush
+ *
+ * If the batch insert fails, the rows not stored by it are inserted
+ * device by device, and only the devices whose rows fail count as
+ * failed.
+ */
+void	database::flush() {
+	if (_timekeys.size() == 0) {
+		return;
+	}
+	size_t	values = _timekeys.size() * _values.size();
+	stopwatch	watch(statistics::insert);
+	if (dryrun) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "dryrun: not adding %lu values",
+			(unsigned long)values);
+		clear();
+		return;
+	}
+	_stored = 0;
+	try {
+		if (!(_bulk && insertarray())) {
+			_bulk = false;
+			insertrows();
+		}
+	} catch (const std::exception& x) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "batch insert failed, adding "
+			"the remaining rows device by device: %s", x.what());
+		try {
+			values = _stored * _values.size() + insertdevices();
+		} catch (...) {
+			clear();
+			throw;
+		}
 	}
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "statement closed");
+	metrics::inserted += values;
+	clear();
 }
 
 } // namespace shelly
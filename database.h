@@ -7,12 +7,72 @@
 #define _database_h
 
 #include <mysql.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
 #include "configuration.h"
+#include "schema.h"
 
 namespace shelly {
 
-class database {
+/**
+ * \brief Destination for the values retrieved from the cloud
+ *
+ * A sink may buffer the values it is given, flush() is called after
+ * each batch of devices to hand them to the database. A value that is
+ * not known, like the battery of a device that only pushes temperature
+ * and humidity, is NaN, it is stored as NULL in the wide schema and
+ * its row is left out in the entity-attribute-value schema.
+ */
+class datasink {
+public:
+	virtual ~datasink() { }
+	virtual void	add(const std::string& station,
+			const std::string& sensor, time_t timekey,
+			float temperature, float humidity, float voltage,
+			float capacity) = 0;
+	virtual void	flush() { }
+};
+
+typedef std::shared_ptr<datasink>	datasink_ptr;
+
+/**
+ * \brief Connection to the meteo database
+ *
+ * The values added are collected in one array per column of the table
+ * the schema stores them in and inserted by flush(). If the client
+ * library and the server support it, the arrays are bound to the
+ * insert statement as a whole and sent with a single execute (MariaDB
+ * array binding), otherwise they are sent as multi-row insert
+ * statements. Sensor ids found are remembered for the lifetime of the
+ * process, so that a connection opened for a cycle does not have to
+ * look them up again.
+ */
+class database : public datasink {
+	MYSQL_STMT	*_insert;
+	bool	_bulk;
+	std::vector<long long>	_timekeys;
+	std::vector<int>	_sensorids;
+	std::vector<int>	_fieldids;
+	std::vector<std::vector<float> >	_values;
+	size_t	_devices;
+	size_t	_stored;
+	std::string	insertquery() const;
+	std::string	rowvalues(size_t i) const;
+	bool	insertarray();
+	void	insertrows();
+	size_t	insertdevices();
+	void	clear();
+public:
+	typedef std::pair<std::string, std::string>	sensorkey;
+protected:
+	static std::mutex	_sensorlock;
+	static std::map<sensorkey, int>	_knownsensors;
 	configuration_ptr	_config;
+	schema	_schema;
 	MYSQL	*mysql;
 	int	temperature_id;
 	int	humidity_id;
@@ -21,12 +81,16 @@ class database {
 	int	sensorid(const std::string& station, const std::string& sensor);
 	int	fieldid(const std::string& fieldname);
 public:
-	database(configuration_ptr config);
+	database(configuration_ptr config, unsigned long clientflags = 0);
 	~database();
-	void	add(const std::string& station, const std::string& sensor,
-			time_t timekey,
+	virtual void	add(const std::string& station,
+			const std::string& sensor, time_t timekey,
 			float temperature, float humidity, float voltage,
 			float capacity);
+	virtual void	flush();
+	static std::string	quote(MYSQL *mysql, const std::string& s);
+	static std::string	sensorquery(MYSQL *mysql,
+				const std::set<sensorkey>& pairs);
 };
 
 } // namespace shelly
@@ -212,6 +212,7 @@ static void	writeout(char *prefix, char *msgbuffer) {
 	char	msgbuffer2[MSGSIZE];
 	snprintf(msgbuffer2, sizeof(msgbuffer2), "%s %s",
 		prefix, msgbuffer);
+	std::call_once(thread_helper_once, thread_helper_initialize);
 	{
 		std::unique_lock<std::recursive_mutex>	lock(th->mtx);
 		linecounter++;
@@ -0,0 +1,334 @@
+/*
+ * discovery.cpp -- discover the devices of the cloud accounts
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "discovery.h"
+#include "cloud.h"
+#include "metrics.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <curl/curl.h>
+
+namespace shelly {
+
+/**
+ * \brief Callback to collect the response of the cloud
+ *
+ * \param data		data buffer containing the data
+ * \param size		item size
+ * \param nmemb		number of items received
+ * \param userdata	pointer to the response string
+ */
+static size_t	discovery_write_callback(void *data, size_t size,
+		size_t nmemb, void *userdata) {
+	std::string	*response = (std::string *)userdata;
+	response->append((char *)data, size * nmemb);
+	metrics::bytesreceived.fetch_add(size * nmemb,
+		std::memory_order_relaxed);
+	return size * nmemb;
+}
+
+/**
+ * \brief Create the discoverer and start its thread
+ *
+ * \param watcher	the watcher providing the current configuration
+ */
+discoverer::discoverer(configwatcher_ptr watcher) : _watcher(watcher),
+	_running(true) {
+	_thread = std::thread(&discoverer::main, this);
+}
+
+/**
+ * \brief Stop the thread
+ */
+discoverer::~discoverer() {
+	_running = false;
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+/**
+ * \brief Build a name from a naming template
+ *
+ * The placeholders {id}, {code} and {cloud} are replaced by the device
+ * id, the model code and the name of the cloud account.
+ *
+ * \param pattern	the naming template
+ * \param id		the device id
+ * \param code		the model code of the device
+ * \param cloud		the name of the cloud account
+ */
+std::string	discoverer::expand(const std::string& pattern,
+		const std::string& id, const std::string& code,
+		const std::string& cloud) {
+	const std::pair<const char *, const std::string *>	keys[3] = {
+		{ "{id}", &id }, { "{code}", &code }, { "{cloud}", &cloud }
+	};
+	std::string	result = pattern;
+	for (auto& k : keys) {
+		size_t	p;
+		while (std::string::npos != (p = result.find(k.first))) {
+			result.replace(p, strlen(k.first), *k.second);
+		}
+	}
+	return result;
+}
+
+/**
+ * \brief Retrieve the status of all devices of a cloud account
+ *
+ * The request takes a token from the bucket of the account, which it
+ * shares with the requests of the loop, and waits until it may be sent.
+ *
+ * \param endpoint	the settings of the cloud endpoint
+ * \param status	receives the status of the devices by id
+ * \return		false if the devices could not be retrieved
+ */
+bool	discoverer::fetch(const nlohmann::json& endpoint,
+		nlohmann::json& status) {
+	tokenbucket_ptr	limiter = cloudendpoint::limiter(endpoint);
+	std::chrono::system_clock::time_point	due
+		= limiter->acquire(std::chrono::system_clock::now());
+	while (_running && (std::chrono::system_clock::now() < due)) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	if (!_running) {
+		limiter->refund();
+		return false;
+	}
+	std::string	url = endpoint.value("url", std::string())
+		+ "/device/all_status?auth_key="
+		+ endpoint.value("key", std::string());
+	std::string	response;
+	CURL	*curl = curl_easy_init();
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
+		discovery_write_callback);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&response);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "shellyd-agent");
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT,
+		endpoint.value("timeout", 10L));
+	CURLcode	rc = curl_easy_perform(curl);
+	long	code = 0;
+	curl_off_t	retryafter = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+	curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retryafter);
+	curl_easy_cleanup(curl);
+	if (retryafter > 0) {
+		limiter->hold(std::chrono::system_clock::now()
+			+ std::chrono::seconds(retryafter));
+	}
+	if (rc != CURLE_OK) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot list devices: %s",
+			curl_easy_strerror(rc));
+		return false;
+	}
+	metrics::status(code);
+	if (code != 200) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot list devices: status %ld",
+			code);
+		return false;
+	}
+	try {
+		nlohmann::json	r = nlohmann::json::parse(response);
+		if (!r.value("isok", false)) {
+			throw shellyexception("request not ok");
+		}
+		status = r["data"]["devices_status"];
+		if (!status.is_object()) {
+			throw shellyexception("no device status");
+		}
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "bad device list: %s", x.what());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * \brief List the devices of all accounts and update the file
+ */
+void	discoverer::discover() {
+	configuration_ptr	config = _watcher->current();
+	std::string	filename = config->stringvalue("discovery.file");
+	std::string	station("Shelly");
+	if (config->has("discovery.station")) {
+		station = config->stringvalue("discovery.station");
+	}
+	std::string	sensor("{id}");
+	if (config->has("discovery.sensor")) {
+		sensor = config->stringvalue("discovery.sensor");
+	}
+	bool	prune = config->has("discovery.prune")
+		&& config->value("discovery.prune").get<bool>();
+
+	// devices listed by hand are left alone
+	std::set<std::string>	listed;
+	for (auto device : config->value("devices")) {
+		if (!device.value("discovered", false)) {
+			listed.insert(device["id"].get<std::string>());
+		}
+	}
+
+	// the devices discovered before
+	nlohmann::json	previous = nlohmann::json::array();
+	std::ifstream	ifs(filename);
+	if (ifs) {
+		try {
+			previous = nlohmann::json::parse(ifs)["devices"];
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot read %s: %s",
+				filename.c_str(), x.what());
+			return;
+		}
+	}
+	std::map<std::string, nlohmann::json>	known;
+	for (auto device : previous) {
+		known[device["id"].get<std::string>()] = device;
+	}
+
+	// ask every account for its devices
+	nlohmann::json	cloud = config->value("cloud");
+	bool	array = cloud.is_array();
+	if (!array) {
+		cloud = nlohmann::json::array({ cloud });
+	}
+	bool	complete = true;
+	std::map<std::string, nlohmann::json>	found;
+	for (size_t i = 0; i < cloud.size(); i++) {
+		std::string	name = cloud[i].value("name", (array)
+			? stringprintf("cloud%lu", (unsigned long)i)
+			: std::string("default"));
+		nlohmann::json	status;
+		if (!fetch(cloud[i], status)) {
+			complete = false;
+			continue;
+		}
+		for (auto s = status.begin(); s != status.end(); s++) {
+			std::string	id = s.key();
+			// only humidity and temperature sensors can be stored
+			if (!s.value().contains("temperature:0")
+				|| !s.value().contains("humidity:0")) {
+				debug(LOG_DEBUG, DEBUG_LOG, 0, "%s: not a "
+					"sensor", id.c_str());
+				continue;
+			}
+			if ((listed.count(id) > 0) || (found.count(id) > 0)) {
+				continue;
+			}
+			nlohmann::json	device;
+			auto	k = known.find(id);
+			if (k != known.end()) {
+				device = k->second;
+			} else {
+				std::string	code;
+				if (s.value().contains("_dev_info")) {
+					code = s.value()["_dev_info"].value(
+						"code", std::string());
+				}
+				std::string	stationname
+					= expand(station, id, code, name);
+				std::string	sensorname
+					= expand(sensor, id, code, name);
+				device["id"] = id;
+				device["station"] = stationname;
+				device["sensor"] = sensorname;
+				debug(LOG_INFO, DEBUG_LOG, 0, "discovered %s "
+					"as %s/%s", id.c_str(),
+					stationname.c_str(),
+					sensorname.c_str());
+				metrics::discovered++;
+			}
+			if (array) {
+				device["cloud"] = name;
+			}
+			found[id] = device;
+		}
+	}
+
+	// devices that have disappeared, or are now listed by hand
+	for (auto& k : known) {
+		if ((found.count(k.first) > 0) || (listed.count(k.first) > 0)) {
+			continue;
+		}
+		if (prune && complete) {
+			debug(LOG_INFO, DEBUG_LOG, 0, "%s no longer in the "
+				"cloud", k.first.c_str());
+			continue;
+		}
+		found[k.first] = k.second;
+	}
+
+	// write the file if anything changed
+	nlohmann::json	devices = nlohmann::json::array();
+	for (auto& f : found) {
+		devices.push_back(f.second);
+	}
+	if (devices == previous) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "no new devices discovered");
+		return;
+	}
+	nlohmann::json	fragment;
+	fragment["devices"] = devices;
+	std::string	tmpname = filename + ".tmp";
+	{
+		std::ofstream	out(tmpname);
+		out << fragment.dump(4) << std::endl;
+		if (!out) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot write %s",
+				tmpname.c_str());
+			return;
+		}
+	}
+	if (rename(tmpname.c_str(), filename.c_str()) < 0) {
+		debug(LOG_ERR, DEBUG_LOG, DEBUG_ERRNO, "cannot replace %s",
+			filename.c_str());
+		return;
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "%lu discovered devices written to %s",
+		(unsigned long)devices.size(), filename.c_str());
+	configwatcher::request();
+}
+
+/**
+ * \brief Main function of the discovery thread
+ *
+ * The devices are listed right away and then every interval seconds,
+ * as given in the configuration current at that time.
+ */
+void	discoverer::main() {
+	while (_running) {
+		int	interval = 3600;
+		try {
+			configuration_ptr	config = _watcher->current();
+			if (config->has("discovery.interval")) {
+				interval = config->intvalue(
+					"discovery.interval");
+			}
+			if (config->has("cloud")
+				&& config->has("discovery.file")) {
+				discover();
+			}
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "discovery failed: %s",
+				x.what());
+		}
+		for (int i = 0; (i < interval) && _running; i++) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "discovery terminated");
+}
+
+} // namespace shelly
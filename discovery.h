@@ -0,0 +1,51 @@
+/*
+ * discovery.h -- discover the devices of the cloud accounts
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _discovery_h
+#define _discovery_h
+
+#include <json.hpp>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "configuration.h"
+#include "reload.h"
+
+namespace shelly {
+
+/**
+ * \brief Thread keeping the discovered devices up to date
+ *
+ * The thread periodically asks every configured cloud account for the
+ * status of all its devices with /device/all_status. Humidity and
+ * temperature sensors that are not listed in the configuration file
+ * are added to the file named in discovery.file, with station and
+ * sensor names built from the naming templates. Entries already in the
+ * file are kept as they are, so they can be renamed there, devices no
+ * longer reported by the cloud are only removed if discovery.prune is
+ * set. When the file changes, a configuration reload is requested, the
+ * configuration merges the file into the device list, so a new device
+ * is polled without editing the configuration or restarting.
+ */
+class discoverer {
+	configwatcher_ptr	_watcher;
+	std::atomic<bool>	_running;
+	std::thread	_thread;
+	static std::string	expand(const std::string& pattern,
+				const std::string& id, const std::string& code,
+				const std::string& cloud);
+	bool	fetch(const nlohmann::json& endpoint, nlohmann::json& status);
+	void	discover();
+	void	main();
+	discoverer(const discoverer& other);
+	discoverer&	operator=(const discoverer& other);
+public:
+	discoverer(configwatcher_ptr watcher);
+	~discoverer();
+};
+
+} // namespace shelly
+
+#endif /* _discovery_h */
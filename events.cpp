@@ -0,0 +1,335 @@
+/*
+ * events.cpp -- consumer of the real time event stream of the cloud
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include "events.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+
+namespace shelly {
+
+// largest message accepted from the server
+static const size_t	MAXMESSAGE = 16 * 1024 * 1024;
+
+/**
+ * \brief Create the client and start the client thread
+ *
+ * \param config	the configuration containing the events section
+ * \param queue		the queue to add the received status to
+ */
+eventstream::eventstream(configuration_ptr config, pushqueue_ptr queue)
+	: _config(config), _queue(queue), _keepalive(30), _curl(NULL),
+	  _fd(CURL_SOCKET_BAD), _lastevent(0), _running(true) {
+	// before 8.11, curl only speaks WebSocket if built to do so
+	bool	websocket = false;
+#ifdef HAVE_CURL_WS_RECV
+	for (const char *const *p
+		= curl_version_info(CURLVERSION_NOW)->protocols; *p; p++) {
+		websocket = websocket || (strcmp(*p, "ws") == 0);
+	}
+#endif /* HAVE_CURL_WS_RECV */
+	if (!websocket) {
+		throw shellyexception("curl has no WebSocket support, cannot "
+			"use the event stream");
+	}
+	_url = config->stringvalue("events.url");
+	if (config->has("events.token")) {
+		_token = config->stringvalue("events.token");
+	}
+	if (config->has("events.keepalive")) {
+		_keepalive = config->intvalue("events.keepalive");
+	}
+	_thread = std::thread(&eventstream::main, this);
+}
+
+/**
+ * \brief Stop the client thread
+ */
+eventstream::~eventstream() {
+	_running = false;
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+#ifdef HAVE_CURL_WS_RECV
+
+/**
+ * \brief Wait for the connection to become readable or writable
+ *
+ * \param events	the poll events to wait for
+ * \param timeout	time in milliseconds to wait
+ * \return		false if the time has expired
+ */
+bool	eventstream::wait(short events, int timeout) {
+	struct pollfd	pfd;
+	pfd.fd = _fd;
+	pfd.events = events;
+	int	r = poll(&pfd, 1, timeout);
+	if (r < 0) {
+		if (errno == EINTR) {
+			return true;
+		}
+		throw shellyexception(stringprintf("poll failed: %s",
+			strerror(errno)));
+	}
+	return (r > 0);
+}
+
+/**
+ * \brief Send a frame
+ *
+ * \param flags		the frame type, CURLWS_PING or CURLWS_CLOSE
+ * \param payload	the payload of the frame
+ */
+void	eventstream::send(unsigned int flags, const std::string& payload) {
+	size_t	offset = 0;
+	while (1) {
+		size_t	bytes = 0;
+		CURLcode	rc = curl_ws_send(_curl,
+			payload.data() + offset, payload.size() - offset,
+			&bytes, 0, flags);
+		if (rc == CURLE_AGAIN) {
+			wait(POLLOUT, 1000);
+			continue;
+		}
+		if (rc != CURLE_OK) {
+			throw shellyexception(stringprintf("cannot send: %s",
+				curl_easy_strerror(rc)));
+		}
+		offset += bytes;
+		if (offset >= payload.size()) {
+			break;
+		}
+	}
+	_lastsent = std::chrono::steady_clock::now();
+}
+
+/**
+ * \brief Receive a control frame or a complete message
+ *
+ * curl hands out frames in pieces that fit the buffer, the pieces and
+ * the fragments of a message are collected until the message is
+ * complete. Control frames are short and returned immediately, pings
+ * have already been answered by curl. Data already decrypted by the
+ * TLS layer is not visible to poll, so reading is attempted before
+ * waiting for the socket.
+ *
+ * \param flags		the frame type of the frame or message
+ * \param payload	the payload of the frame or message
+ * \param timeout	time in milliseconds to wait for more data
+ * \return		false if nothing complete arrived in time
+ */
+bool	eventstream::receive(unsigned int& flags, std::string& payload,
+		int timeout) {
+	while (1) {
+		char	data[16384];
+		size_t	bytes = 0;
+		const struct curl_ws_frame	*meta = NULL;
+		CURLcode	rc = curl_ws_recv(_curl, data, sizeof(data),
+			&bytes, &meta);
+		if (rc == CURLE_AGAIN) {
+			if (!wait(POLLIN, timeout)) {
+				return false;
+			}
+			continue;
+		}
+		if (rc != CURLE_OK) {
+			throw shellyexception(stringprintf("cannot receive: %s",
+				curl_easy_strerror(rc)));
+		}
+		_lastreceived = std::chrono::steady_clock::now();
+		if (meta->flags & (CURLWS_CLOSE | CURLWS_PING | CURLWS_PONG)) {
+			flags = meta->flags;
+			payload = std::string(data, bytes);
+			return true;
+		}
+		_message.append(data, bytes);
+		if (_message.size() > MAXMESSAGE) {
+			throw shellyexception("message too large");
+		}
+		if ((meta->bytesleft > 0) || (meta->flags & CURLWS_CONT)) {
+			continue;
+		}
+		flags = meta->flags;
+		payload = std::string();
+		std::swap(payload, _message);
+		return true;
+	}
+}
+
+/**
+ * \brief Connect to the event stream
+ *
+ * curl establishes the connection and performs the upgrade to the
+ * WebSocket protocol. After a reconnect, the time of the last event
+ * received is sent along, so that a server keeping a backlog can
+ * resume the stream.
+ */
+void	eventstream::connect() {
+	if ((_url.compare(0, 5, "ws://") != 0)
+		&& (_url.compare(0, 6, "wss://") != 0)) {
+		throw shellyexception(stringprintf("bad url %s", _url.c_str()));
+	}
+
+	// add the token and the resume point to the query
+	std::string	url = _url;
+	if (_token.size() > 0) {
+		char	*t = curl_easy_escape(NULL, _token.c_str(),
+			_token.size());
+		url.append((url.find('?') == std::string::npos) ? "?" : "&");
+		url.append(stringprintf("t=%s", t));
+		curl_free(t);
+	}
+	if (_lastevent > 0) {
+		url.append((url.find('?') == std::string::npos) ? "?" : "&");
+		url.append(stringprintf("since=%.3f", _lastevent));
+	}
+
+	// open the connection and request the upgrade
+	_curl = curl_easy_init();
+	curl_easy_setopt(_curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(_curl, CURLOPT_CONNECT_ONLY, 2L);
+	curl_easy_setopt(_curl, CURLOPT_CONNECTTIMEOUT, 10L);
+	curl_easy_setopt(_curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(_curl, CURLOPT_USERAGENT, "shellyd-agent");
+	CURLcode	rc = curl_easy_perform(_curl);
+	if (rc != CURLE_OK) {
+		throw shellyexception(stringprintf("cannot connect to %s: %s",
+			_url.c_str(), curl_easy_strerror(rc)));
+	}
+	curl_easy_getinfo(_curl, CURLINFO_ACTIVESOCKET, &_fd);
+	_message = std::string();
+	_lastsent = _lastreceived = std::chrono::steady_clock::now();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "event stream connected to %s",
+		_url.c_str());
+}
+
+/**
+ * \brief Close the connection
+ */
+void	eventstream::disconnect() {
+	if (NULL == _curl) {
+		return;
+	}
+	if (_fd != CURL_SOCKET_BAD) {
+		try {
+			send(CURLWS_CLOSE, std::string("\x03\xe8", 2));
+		} catch (const std::exception& x) {
+		}
+	}
+	curl_easy_cleanup(_curl);
+	_curl = NULL;
+	_fd = CURL_SOCKET_BAD;
+}
+
+/**
+ * \brief Convert an event into a device status
+ *
+ * \param payload	the JSON text of the event
+ */
+void	eventstream::event(const std::string& payload) {
+	nlohmann::json	j;
+	try {
+		j = nlohmann::json::parse(payload);
+	} catch (const std::exception& x) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "event is not JSON");
+		return;
+	}
+	if (!j.is_object() || !j.contains("event")
+		|| !j["event"].is_string()) {
+		return;
+	}
+	if (j.contains("ts") && j["ts"].is_number()) {
+		_lastevent = j["ts"];
+	}
+	if ((j["event"] != "Shelly:StatusOnChange") || !j.contains("deviceId")
+		|| !j.contains("status") || !j["status"].is_object()) {
+		return;
+	}
+	std::string	source = j["deviceId"].is_string()
+		? j["deviceId"].get<std::string>() : j["deviceId"].dump();
+	std::string	id = _queue->deviceid(source);
+	if (id.size() == 0) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "event for unknown device %s",
+			source.c_str());
+		return;
+	}
+	_queue->push(id, j["status"]);
+}
+
+/**
+ * \brief Main function of the client thread
+ */
+void	eventstream::main() {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "event stream client started");
+	while (_running) {
+		try {
+			connect();
+			while (_running) {
+				unsigned int	flags;
+				std::string	payload;
+				if (receive(flags, payload, 1000)) {
+					if (flags & CURLWS_CLOSE) {
+						throw shellyexception(
+							"connection closed "
+							"by server");
+					}
+					if (flags & (CURLWS_TEXT
+						| CURLWS_BINARY)) {
+						event(payload);
+					}
+				}
+
+				// keep the connection alive
+				if (_keepalive <= 0) {
+					continue;
+				}
+				std::chrono::steady_clock::time_point	now
+					= std::chrono::steady_clock::now();
+				if (now - _lastsent >= std::chrono::seconds(
+					_keepalive)) {
+					send(CURLWS_PING, std::string());
+				}
+				if (now - _lastreceived > std::chrono::seconds(
+					3 * _keepalive)) {
+					throw shellyexception("server does not "
+						"respond");
+				}
+			}
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "events: %s", x.what());
+		}
+		disconnect();
+
+		// events may have been missed, poll until they arrive again
+		_queue->invalidate();
+
+		// wait a few seconds before reconnecting
+		for (int i = 0; (i < 5) && _running; i++) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+	}
+	disconnect();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "event stream client terminated");
+}
+
+#else /* HAVE_CURL_WS_RECV */
+
+/**
+ * \brief The client thread is never started without WebSocket support
+ */
+void	eventstream::main() {
+}
+
+#endif /* HAVE_CURL_WS_RECV */
+
+} // namespace shelly
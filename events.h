@@ -0,0 +1,63 @@
+/*
+ * events.h -- consumer of the real time event stream of the cloud
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _events_h
+#define _events_h
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <curl/curl.h>
+#include "configuration.h"
+#include "pushqueue.h"
+
+namespace shelly {
+
+/**
+ * \brief WebSocket client for the status change events of the cloud
+ *
+ * The client keeps a single WebSocket connection to the event stream
+ * of the cloud open in a thread of its own and converts the
+ * Shelly:StatusOnChange events of the configured devices into device
+ * status for the push queue. The WebSocket protocol is that of curl,
+ * which is used in connect only mode, so that the thread can wait for
+ * frames and send its keepalive pings itself. When the connection is
+ * lost, the client reconnects and asks the server to resume after the
+ * last event it received, it also invalidates the push queue, so that
+ * the loop polls all devices until events arrive again.
+ */
+class eventstream {
+	configuration_ptr	_config;
+	pushqueue_ptr	_queue;
+	std::string	_url;
+	std::string	_token;
+	int	_keepalive;
+	CURL	*_curl;
+	curl_socket_t	_fd;
+	std::string	_message;
+	double	_lastevent;
+	std::chrono::steady_clock::time_point	_lastsent;
+	std::chrono::steady_clock::time_point	_lastreceived;
+	std::atomic<bool>	_running;
+	std::thread	_thread;
+	void	main();
+	void	connect();
+	void	disconnect();
+	bool	wait(short events, int timeout);
+	void	send(unsigned int flags, const std::string& payload);
+	bool	receive(unsigned int& flags, std::string& payload,
+			int timeout);
+	void	event(const std::string& payload);
+	eventstream(const eventstream& other);
+	eventstream&	operator=(const eventstream& other);
+public:
+	eventstream(configuration_ptr config, pushqueue_ptr queue);
+	~eventstream();
+};
+
+} // namespace shelly
+
+#endif /* _events_h */
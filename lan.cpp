@@ -0,0 +1,209 @@
+/*
+ * lan.cpp -- poll Gen2 devices directly on the local network
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "lan.h"
+#include "metrics.h"
+#include "statistics.h"
+#include "trace.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <set>
+
+namespace shelly {
+
+/**
+ * \brief Callback to collect the response of a device
+ *
+ * \param data		data buffer containing the data
+ * \param size		item size
+ * \param nmemb		number of items received
+ * \param userdata	pointer to the request
+ */
+static size_t	lan_write_callback(void *data, size_t size, size_t nmemb,
+		void *userdata) {
+	lanpoller::request	*r = (lanpoller::request *)userdata;
+	r->response.append((char *)data, size * nmemb);
+	metrics::bytesreceived.fetch_add(size * nmemb,
+		std::memory_order_relaxed);
+	return size * nmemb;
+}
+
+/**
+ * \brief Create the poller
+ *
+ * \param config	the configuration
+ */
+lanpoller::lanpoller(configuration_ptr config) : _config(config) {
+	_multi = curl_multi_init();
+	long	concurrency = 32;
+	if (_config->has("lan.concurrency")) {
+		concurrency = _config->intvalue("lan.concurrency");
+	}
+	curl_multi_setopt(_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, concurrency);
+}
+
+/**
+ * \brief Release all handles
+ */
+lanpoller::~lanpoller() {
+	for (auto r : _requests) {
+		curl_easy_cleanup(r.second.curl);
+	}
+	curl_multi_cleanup(_multi);
+}
+
+/**
+ * \brief Get the request for a device, creating its handle if necessary
+ *
+ * The address is host name or IP address of the device, optionally
+ * followed by a port and a path prefix.
+ *
+ * \param id		the id of the device
+ * \param address	the address of the device
+ */
+lanpoller::request&	lanpoller::prepare(const std::string& id,
+		const std::string& address) {
+	request&	r = _requests[id];
+	std::string	url = stringprintf("http://%s/rpc/Shelly.GetStatus",
+		address.c_str());
+	if ((NULL != r.curl) && (r.url == url)) {
+		r.response = std::string();
+		return r;
+	}
+	if (NULL != r.curl) {
+		curl_easy_cleanup(r.curl);
+	}
+	r.id = id;
+	r.url = url;
+	r.response = std::string();
+	r.curl = curl_easy_init();
+	long	timeout = 2000;
+	if (_config->has("lan.timeout")) {
+		timeout = _config->intvalue("lan.timeout");
+	}
+	std::string	password;
+	if (_config->has("lan.password")) {
+		password = _config->stringvalue("lan.password");
+	}
+	nlohmann::json	device = _config->device(id);
+	if (device.contains("timeout")) {
+		timeout = device["timeout"];
+	}
+	if (device.contains("password")) {
+		password = device["password"];
+	}
+	if (debuglevel >= LOG_DEBUG) {
+		curl_easy_setopt(r.curl, CURLOPT_VERBOSE, 1);
+	}
+	curl_easy_setopt(r.curl, CURLOPT_URL, r.url.c_str());
+	curl_easy_setopt(r.curl, CURLOPT_WRITEFUNCTION, lan_write_callback);
+	curl_easy_setopt(r.curl, CURLOPT_WRITEDATA, (void *)&r);
+	curl_easy_setopt(r.curl, CURLOPT_PRIVATE, (void *)&r);
+	curl_easy_setopt(r.curl, CURLOPT_USERAGENT, "shellyd-agent");
+	curl_easy_setopt(r.curl, CURLOPT_TIMEOUT_MS, timeout);
+	curl_easy_setopt(r.curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	if (password.size() > 0) {
+		// Gen2 devices use digest authentication with user admin
+		curl_easy_setopt(r.curl, CURLOPT_HTTPAUTH, CURLAUTH_DIGEST);
+		curl_easy_setopt(r.curl, CURLOPT_USERNAME, "admin");
+		curl_easy_setopt(r.curl, CURLOPT_PASSWORD, password.c_str());
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "device %s at %s", id.c_str(),
+		r.url.c_str());
+	return r;
+}
+
+/**
+ * \brief Query the status of a set of devices concurrently
+ *
+ * \param devices	map of device ids to addresses
+ * \param failed	ids of the devices that could not be queried
+ * \return		array of items of the same form as the cloud returns
+ */
+nlohmann::json	lanpoller::poll(
+		const std::map<std::string, std::string>& devices,
+		std::list<std::string>& failed) {
+	stopwatch	watch(statistics::fetch);
+	tracespan	span("lan", "fetch",
+		stringprintf("%lu devices", (unsigned long)devices.size()));
+	for (auto d : devices) {
+		request&	r = prepare(d.first, d.second);
+		curl_multi_add_handle(_multi, r.curl);
+	}
+
+	// run all transfers to completion
+	int	running = 0;
+	do {
+		CURLMcode	mc = curl_multi_perform(_multi, &running);
+		if ((mc == CURLM_OK) && (running > 0)) {
+			mc = curl_multi_poll(_multi, NULL, 0, 1000, NULL);
+		}
+		if (mc != CURLM_OK) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "curl multi failed: %s",
+				curl_multi_strerror(mc));
+			break;
+		}
+	} while (running > 0);
+
+	// collect the results
+	nlohmann::json	items = nlohmann::json::array();
+	std::set<std::string>	done;
+	CURLMsg	*msg;
+	int	left;
+	while (NULL != (msg = curl_multi_info_read(_multi, &left))) {
+		if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+		request	*r = NULL;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+			(char **)&r);
+		done.insert(r->id);
+		long	code = 0;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE,
+			&code);
+		metrics::status(code);
+		try {
+			if (msg->data.result != CURLE_OK) {
+				throw shellyexception(curl_easy_strerror(
+					msg->data.result));
+			}
+			if (code != 200) {
+				throw shellyexception(stringprintf(
+					"HTTP status %ld", code));
+			}
+			nlohmann::json	status = nlohmann::json::parse(
+				r->response);
+			// the POST /rpc variant wraps the status in a result
+			if (status.contains("result")) {
+				status = status["result"];
+			}
+			nlohmann::json	item;
+			item["id"] = r->id;
+			item["status"] = status;
+			items.push_back(item);
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot query %s: %s",
+				r->id.c_str(), x.what());
+			failed.push_back(r->id);
+		}
+	}
+
+	// remove the handles but keep them for the next cycle, transfers
+	// cut short by a failure of the multi handle count as failed
+	for (auto d : devices) {
+		curl_multi_remove_handle(_multi, _requests[d.first].curl);
+		if (done.count(d.first) == 0) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot query %s: "
+				"transfer not completed", d.first.c_str());
+			failed.push_back(d.first);
+		}
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%lu devices polled locally, %lu failed",
+		(unsigned long)items.size(), (unsigned long)failed.size());
+	return items;
+}
+
+} // namespace shelly
@@ -0,0 +1,50 @@
+/*
+ * lan.h -- poll Gen2 devices directly on the local network
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _lan_h
+#define _lan_h
+
+#include <list>
+#include <map>
+#include <string>
+#include <json.hpp>
+#include <curl/curl.h>
+#include "configuration.h"
+
+namespace shelly {
+
+/**
+ * \brief Concurrent poller for the local Shelly.GetStatus RPC
+ *
+ * All devices are queried at the same time through a curl multi handle.
+ * The easy handle of each device is kept from cycle to cycle, so that
+ * the connections to the devices can be reused.
+ */
+class lanpoller {
+public:
+	typedef struct {
+		std::string	id;
+		std::string	url;
+		CURL	*curl;
+		std::string	response;
+	} request;
+private:
+	configuration_ptr	_config;
+	CURLM	*_multi;
+	std::map<std::string, request>	_requests;
+	request&	prepare(const std::string& id,
+				const std::string& address);
+	lanpoller(const lanpoller& other);
+	lanpoller&	operator=(const lanpoller& other);
+public:
+	lanpoller(configuration_ptr config);
+	~lanpoller();
+	nlohmann::json	poll(const std::map<std::string, std::string>& devices,
+				std::list<std::string>& failed);
+};
+
+} // namespace shelly
+
+#endif /* _lan_h */
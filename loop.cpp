@@ -7,13 +7,19 @@
 #include "json.hpp"
 #include "debug.h"
 #include "database.h"
+#include "bulkload.h"
+#include "provision.h"
 #include "format.h"
+#include "statistics.h"
+#include "metrics.h"
+#include "trace.h"
+#include "common.h"
 #include <chrono>
-#include <thread>
 #include <iostream>
 #include <sstream>
 #include <curl/curl.h>
 #include <cstring>
+#include <limits>
 #include <list>
 
 namespace shelly {
@@ -23,9 +29,12 @@ namespace shelly {
  *
  * \param config	the configuration to use in the looop
  */
-loop::loop(configuration_ptr config) : _config(config),
-	// this initialization makes sure the json strings are parseable
-	request("{}"), response("{}") {
+loop::loop(configuration_ptr config) : _config(config), cycles(0),
+	_clock(new systemclock()) {
+	if (_config->has("rollup")) {
+		_rollupsection = _config->value("rollup");
+		_rollup = rollup_ptr(new rollup(_config));
+	}
 }
 
 /**
@@ -35,186 +44,88 @@ loop::~loop() {
 }
 
 /**
- * \brief read data from the request string
+ * \brief Open the destination for the data of a cycle
  *
- * \param data		the data buffer to write to
- * \param size		the size of a data item
- * \param nitems	the number of items
+ * By default, this is a connection to the meteo database, or the
+ * non-blocking writer if it is in use. Benchmarks override this method
+ * to replace the database by a stand-in.
  */
-size_t	loop::read_callback(char *data, size_t size, size_t nitems) {
-	// check for empty request
-	if (request.size() == 0) {
-		return 0;
-	}
-
-	// find out what to send
-	std::string	senddata;
-	size_t	l = size * nitems;
-	if (l < request.size()) {
-		senddata = request.substr(0, l);
-		request = request.substr(l);
-	} else {
-		senddata = request;
-		request = std::string();
-	}
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "next batch to send: '%s'",
-		senddata.c_str());
-
-	// send the data
-	l = senddata.size();
-	strncpy(data, senddata.c_str(), l);
-	return l;
+datasink_ptr	loop::opensink() {
+	if (_writer) {
+		return _writer;
+	}
+	return datasink_ptr(new database(_config));
 }
 
 /**
- * \brief Callback to write received data
- *
- * \param data		the buffer to read the data from
- * \param size		the size of an item
- * \param nitems	the number of items available in the buffer
+ * \brief Find out whether the non-blocking database writer is used
  */
-size_t	loop::write_callback(char *data, size_t size, size_t nitems) {
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "write %ld bytes from %p", size * nitems,
-		data);
-	std::string	newdata(data, size * nitems);
-	response = response.append(newdata);
-	return size * nitems;
+bool	loop::nonblocking() const {
+	return _config->has("database.nonblocking")
+		&& _config->value("database.nonblocking").get<bool>();
 }
 
 /**
- * \brief Callback to write data from the response
+ * \brief Open the destination for replayed or backfilled data
  *
- * \param data		data buffer containing the data
- * \param size		item size
- * \param nmemb		number of items received
- * \param userdata	pointer to the loop object
- * \return		data size written to the data buffer
- */
-static size_t	write_callback(void *data, size_t size, size_t nmemb,
-		void *userdata) {
-	loop	*l = (loop *)userdata;
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "add to %p, size = %ld, nmemb = %ld",
-		data, size, nmemb);
-	return l->write_callback((char *)data, size, nmemb);
-}
-
-/**
- * \brief callback to request data to send to the cloud 
- * 
- * \param data		data buffer to write the request data to
- * \param size		size of an item
- * \param nitems	number of items requested
- * \param userdata	pointer to the loop object
- * \return		data size read from the data buffer
+ * Large amounts of data are loaded in bulk, see bulkloader.
  */
-static size_t	read_callback(void *data, size_t size, size_t nitems,
-		void *userdata) {
-	loop	*l = (loop *)userdata;
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "requesting at most %d bytes",
-		size * nitems);
-	return l->read_callback((char *)data, size, nitems);
+datasink_ptr	loop::openloader() {
+	return datasink_ptr(new bulkloader(_config));
 }
 
 /**
- * \brief send a request to the cloud
+ * \brief Processing a response from the cloud
  *
- * \param idlist		list of device ids to query
+ * The sink only buffers the rows, they are written by the flush, which
+ * must also happen if processing fails halfway.
+ *
+ * \param response	the response as a JSON object
+ * \param t		the timekey to use for all data
  */
-void	loop::sendrequest(const std::list<std::string>& idlist) {
-	// create the request JSON
-	nlohmann::json	requestjson;
-	{
-		auto	ids = nlohmann::json::array();
-		for (auto id : idlist) {
-			ids.push_back(id);
+void	loop::process(const nlohmann::json& response, time_t t) {
+	// to process the item, we need a database
+	datasink_ptr	db = opensink();
+	try {
+		process(response, t, db);
+	} catch (const std::exception& x) {
+		try {
+			db->flush();
+		} catch (...) {
 		}
-		requestjson["ids"] = ids;
-	}
-	{
-		auto	select = nlohmann::json::array();
-		select.push_back("status");
-		requestjson["select"] = select;
-	}
-	{
-		auto	pick = nlohmann::json();
-		auto	status = nlohmann::json::array();
-		status.push_back("ts");
-		status.push_back("temperature:0");
-		status.push_back("humidity:0");
-		status.push_back("devicepower:0");
-		status.push_back("sys");
-		pick["status"] = status;
-		auto	settings = nlohmann::json::array();
-		pick["settings"] = settings;
-		requestjson["pick"] = pick;
-	}
-	request = requestjson.dump();
-
-	// build the URL from configuration data
-	std::string	url = _config->stringvalue("cloud.url");
-	std::string	endpoint = _config->stringvalue("cloud.endpoint");
-	std::string	key = _config->stringvalue("cloud.key");
-	std::string	requesturl = url + endpoint + "?auth_key=" + key;
-	int	timeout = 10;
-	if (_config->has("cloud.timeout")) {
-		timeout = _config->intvalue("cloud.timeout");
-	}
-
-	// empty the response string
-	response = std::string();
-
-	// send the cloud request
-	CURL	*curl;
-	curl = curl_easy_init();
-	if (debuglevel >= LOG_DEBUG) {
-		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-	}
-	curl_easy_setopt(curl, CURLOPT_URL, requesturl.c_str());
-	curl_easy_setopt(curl, CURLOPT_POST, 1);
-	struct curl_slist	*list = NULL;
-	list = curl_slist_append(list,
-		"Content-Type: application/json");
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
-	curl_easy_setopt(curl, CURLOPT_READFUNCTION,
-		shelly::read_callback);
-	curl_easy_setopt(curl, CURLOPT_READDATA, (void*)this);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
-		shelly::write_callback);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)this);
-	curl_easy_setopt(curl, CURLOPT_USERAGENT, "shellyd-agent");
-	if (timeout > 0) {
-		debug(LOG_DEBUG, DEBUG_LOG, 0, "using timeout %d", timeout);
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
-	}
-
-	// perform the request
-	CURLcode	res = curl_easy_perform(curl);
-	if (res != CURLE_OK) {
-		std::string	e = stringprintf("curl failed: %s",
-			curl_easy_strerror(res));
-		throw std::runtime_error(e);
-	}
-
-	// cleanup
-	curl_easy_cleanup(curl);
+		throw;
+	}
+	db->flush();
 }
 
 /**
- * \brief Processing a response from the cloud
+ * \brief Add the data of a response to a sink
  *
  * \param response	the response as a JSON object
+ * \param t		the timekey to use for all data
+ * \param db		the sink to add the data to
  */
-void	loop::process(const nlohmann::json& response) {
+void	loop::process(const nlohmann::json& response, time_t t,
+		datasink_ptr db) {
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "processing response %s",
 		response.dump(4).c_str());
-	// to process the item, we need a database
-	database	db(_config);
+	stopwatch	watch(statistics::process);
+	metrics::devices.fetch_add(response.size());
 
 	for (auto item : response) {
 		std::string	id = item["id"];
+		tracespan	span("device", "process", id);
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "processing id %s", id.c_str());
-		// get the station and the sensor from the id
-		nlohmann::json	device = _config->device(id);
+		// get the station and the sensor from the id, the device
+		// may have been removed from the configuration meanwhile
+		nlohmann::json	device;
+		try {
+			device = _config->device(id);
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "device %s not configured",
+				id.c_str());
+			continue;
+		}
 		std::string	station = device["station"];
 		std::string	sensor = device["sensor"];
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "processing for %s/%s",
@@ -231,21 +142,43 @@ void	loop::process(const nlohmann::json& response) {
 			debug(LOG_INFO, DEBUG_LOG, 0, "no timestamp for id %s",
 				id.c_str());
 		}
-		float	temperature = status["temperature:0"]["tC"];
-		float	humidity = status["humidity:0"]["rh"];
-		float	voltage = status["devicepower:0"]["battery"]["V"];
-		float	percent = status["devicepower:0"]["battery"]["percent"];
+		// an offline device may report no values at all
+		float	temperature;
+		float	humidity;
+		// pushed status may lack the battery, it is stored as NULL
+		float	voltage = std::numeric_limits<float>::quiet_NaN();
+		float	percent = std::numeric_limits<float>::quiet_NaN();
+		try {
+			temperature = status["temperature:0"]["tC"];
+			humidity = status["humidity:0"]["rh"];
+			if (status["devicepower:0"].contains("battery")) {
+				nlohmann::json	battery
+					= status["devicepower:0"]["battery"];
+				voltage = battery.value("V", voltage);
+				percent = battery.value("percent", percent);
+			}
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "no data for id %s: %s",
+				id.c_str(), x.what());
+			metrics::inserterrors++;
+			continue;
+		}
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "device data found: "
 			"id = %s, temperature = %.1f, humidty = %.0f, "
 			"voltage = %.2f, percent = %.0f, last = %.2f",
 			id.c_str(), temperature, humidity,
 			voltage, percent, ts);
 
-		// get the time key to add
+		// add the data with the timekey of the cycle
 		try {
-			time_t	t = timekey().count();	
-			db.add(station, sensor, t,
+			db->add(station, sensor, t,
 				temperature, humidity, voltage, percent);
+			if (_rollup) {
+				const float	values[schema::nfields] = {
+					temperature, humidity, voltage, percent
+				};
+				_rollup->add(station, sensor, t, values);
+			}
 		} catch (const std::exception& x) {
 			debug(LOG_ERR, DEBUG_LOG, 0, "adding to %s/%s "
 				"(temperatur=%.1f,wHumidity=%.0f, battery=%.2f,"
@@ -253,6 +186,7 @@ void	loop::process(const nlohmann::json& response) {
 				station.c_str(), sensor.c_str(),
 				temperature, humidity, voltage, percent,
 				x.what());
+			metrics::inserterrors++;
 		}
 	}
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "all ids processed");
@@ -262,8 +196,7 @@ void	loop::process(const nlohmann::json& response) {
  * \brief get the time rounded down
  */
 std::chrono::seconds	loop::timekey() const {
-	std::chrono::system_clock::time_point	start
-		= std::chrono::system_clock::now();
+	clocksource::time_point	start = _clock->now();
 
 	std::chrono::seconds	d
 		= std::chrono::duration_cast<std::chrono::seconds>(
@@ -273,49 +206,442 @@ std::chrono::seconds	loop::timekey() const {
 }
 
 /**
- * \brief run the main event loop
+ * \brief wait for the next cycle
+ *
+ * The wait is split into short slices so that a summary of the latency
+ * statistics requested through SIGUSR1 is written without delay.
+ *
+ * \param end		the point in time when the next cycle starts
  */
-void	loop::run() {
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "start the event loop");
-	while (1) {
-		// send a request
-		try {
-			std::list<std::string>	ids = _config->idlist();
-			sendrequest(ids);
-		} catch (const std::exception& x) {
-			debug(LOG_ERR, DEBUG_LOG, 0, "cannot retrieve data: %s",
-				x.what());
-			goto next;
+void	loop::wait(const clocksource::time_point& end) {
+	while (_clock->now() < end) {
+		clocksource::time_point	slice
+			= _clock->now() + std::chrono::seconds(1);
+		_clock->sleep_until((slice < end) ? slice : end);
+		if (_pushes) {
+			ingest();
+		}
+		if (statistics::requested()) {
+			statistics::summarize();
+		}
+	}
+}
+
+/**
+ * \brief switch to the most recent configuration snapshot
+ *
+ * A snapshot is only replaced between cycles, so that a cycle sees a
+ * consistent device list. State derived from the configuration is
+ * rebuilt from the new snapshot, the rollup only if its section has
+ * changed, after writing the averages of the intervals complete.
+ */
+void	loop::refresh() {
+	if (!_watcher) {
+		return;
+	}
+	configuration_ptr	c = _watcher->current();
+	if (c == _config) {
+		return;
+	}
+	_config = c;
+	_lan.reset();
+	_cloud.reset();
+	_writer.reset();
+	if (_pushes) {
+		_pushes->configure(c);
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "using new configuration with %lu "
+		"devices", (unsigned long)_config->idlist().size());
+	provision();
+
+	// buckets of a changed rollup cannot be carried over
+	nlohmann::json	section = (_config->has("rollup"))
+		? _config->value("rollup") : nlohmann::json();
+	if (section == _rollupsection) {
+		return;
+	}
+	_rollupsection = section;
+	if (_rollup) {
+		_rollup->flush(timekey().count());
+	}
+	try {
+		_rollup = (section.is_null()) ? rollup_ptr()
+			: rollup_ptr(new rollup(_config));
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "no averages computed: %s",
+			x.what());
+		_rollup.reset();
+	}
+}
+
+/**
+ * \brief Make sure the sensors of all configured devices exist
+ *
+ * This is only done if the configuration has a provision section, see
+ * provisioner. A failure is logged, the sensor ids are then looked up
+ * in the cycles as usual.
+ */
+void	loop::provision() {
+	if (!_config->has("provision")) {
+		return;
+	}
+	try {
+		provisioner	p(_config);
+		p.run();
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot provision sensors: %s",
+			x.what());
+	}
+}
+
+/**
+ * \brief retrieve and process the data of all devices once
+ *
+ * The device ids are sent to the cloud endpoints they belong to in
+ * chunks, a failing chunk does not prevent the others from being
+ * processed.
+ */
+void	loop::cycle() {
+	refresh();
+	time_t	t = timekey().count();
+	std::list<std::string>	ids = _config->idlist();
+
+	// devices that pushed their data recently need not be polled
+	if (_pushes) {
+		time_t	now = std::chrono::system_clock::to_time_t(
+			_clock->now());
+		int	fallback = 900;
+		if (_config->has("webhook.fallback")) {
+			fallback = _config->intvalue("webhook.fallback");
+		}
+		if (_config->has("mqtt.fallback")) {
+			fallback = _config->intvalue("mqtt.fallback");
+		}
+		if (_config->has("events.fallback")) {
+			fallback = _config->intvalue("events.fallback");
+		}
+		if (_pushes->invalidated()) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "pushed data may be "
+				"missing, polling all devices");
+			_lastpush.clear();
+		}
+		ids.remove_if([&](const std::string& id) {
+			auto	p = _lastpush.find(id);
+			return (p != _lastpush.end())
+				&& (p->second + fallback > now);
+		});
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "polling %lu devices",
+			(unsigned long)ids.size());
+	}
+
+	// devices with an address are polled directly on the local network,
+	// those that do not answer are retrieved from the cloud if possible
+	nlohmann::json	items = nlohmann::json::array();
+	std::map<std::string, std::string>	addresses
+		= _config->addresses();
+	if (addresses.size() > 0) {
+		std::map<std::string, std::string>	local;
+		ids.remove_if([&](const std::string& id) {
+			auto	a = addresses.find(id);
+			if (a == addresses.end()) {
+				return false;
+			}
+			local.insert(*a);
+			return true;
+		});
+		if (!_lan) {
+			_lan = std::shared_ptr<lanpoller>(
+				new lanpoller(_config));
+		}
+		std::list<std::string>	failed;
+		items = _lan->poll(local, failed);
+		ids.splice(ids.end(), failed);
+	}
+
+	// without a cloud, only local and pushed data is available
+	if (!_config->has("cloud")) {
+		ids.clear();
+	}
+
+	// with the non-blocking writer, data is stored as soon as it is
+	// available, while the transfers of the next chunks are running
+	bool	overlap = nonblocking();
+	if (overlap && !_writer) {
+		_writer = asyncdatabase_ptr(new asyncdatabase(_config));
+	}
+	if (overlap && (items.size() > 0)) {
+		store(items, t);
+		items = nlohmann::json::array();
+	}
+
+	// retrieve the data for all chunks from the cloud, each response
+	// is parsed as soon as it arrives
+	if (ids.size() > 0) {
+		if (!_cloud) {
+			_cloud = cloudpoller_ptr(new cloudpoller(_config));
+		}
+		int	chunkno = 0;
+		clocksource::time_point	deadline = clocksource::time_point(
+			std::chrono::seconds(t + 60));
+		_cloud->fetch(ids, _clock, deadline,
+			[&](const std::string& response) {
+			// keep a copy of the raw response if requested
+			if (_recorder) {
+				try {
+					_recorder->record(t, chunkno++,
+						response);
+				} catch (const std::exception& x) {
+					debug(LOG_ERR, DEBUG_LOG, 0, "cannot "
+						"record: %s", x.what());
+				}
+			}
+
+			// parse the response
+			try {
+				stopwatch	parsewatch(statistics::parse);
+				nlohmann::json	r
+					= nlohmann::json::parse(response);
+				parsewatch.stop();
+				if (!r.is_array()) {
+					throw shellyexception(stringprintf(
+						"unexpected response: %s",
+						response.c_str()));
+				}
+				if (overlap) {
+					store(r, t);
+					return;
+				}
+				for (auto item : r) {
+					items.push_back(item);
+				}
+			} catch (const std::exception& x) {
+				debug(LOG_ERR, DEBUG_LOG, 0, "cannot parse "
+					"data: %s", x.what());
+			}
+		}, (overlap) ? _writer.get() : NULL);
+	}
+
+	// process the response
+	if (items.size() > 0) {
+		store(items, t);
+	}
+	if (_writer) {
+		_writer->drain();
+	}
+
+	// averages of intervals that ended with the previous cycle
+	if (_rollup) {
+		_rollup->flush(t);
+	}
+}
+
+/**
+ * \brief store the data of a set of devices
+ *
+ * \param items		the device status items
+ * \param t		the timekey to use for all data
+ */
+void	loop::store(const nlohmann::json& items, time_t t) {
+	if (_pushes) {
+		for (auto item : items) {
+			_stored[item["id"]] = t;
+		}
+	}
+	try {
+		process(items, t);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot process data: %s",
+			x.what());
+	}
+}
+
+/**
+ * \brief process the data pushed by the devices since the last call
+ *
+ * Pushed data gets the timekey of the current minute. Since only one
+ * value per sensor and minute can be stored, a push for a device that
+ * already has data for the current minute is dropped.
+ */
+void	loop::ingest() {
+	nlohmann::json	pushed = _pushes->receive();
+	if (pushed.size() == 0) {
+		return;
+	}
+	refresh();
+	time_t	t = timekey().count();
+	time_t	now = std::chrono::system_clock::to_time_t(_clock->now());
+	nlohmann::json	items = nlohmann::json::array();
+	for (auto item : pushed) {
+		std::string	id = item["id"];
+		_lastpush[id] = now;
+		auto	s = _stored.find(id);
+		if ((s != _stored.end()) && (s->second == t)) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "%s already stored for "
+				"%ld", id.c_str(), (long)t);
+			continue;
 		}
+		_stored[id] = t;
+		items.push_back(item);
+	}
+	if (items.size() == 0) {
+		return;
+	}
+	try {
+		process(items, t);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot process pushed data: %s",
+			x.what());
+	}
+	if (_writer) {
+		_writer->drain();
+	}
+}
+
+/**
+ * \brief record all raw cloud responses in a directory
+ *
+ * \param directory	the directory to store the responses in
+ */
+void	loop::record(const std::string& directory) {
+	_recorder = std::shared_ptr<recorder>(new recorder(directory));
+}
 
-		// process the response
+/**
+ * \brief process recorded cloud responses
+ *
+ * All responses recorded for the same timekey are processed together
+ * with that timekey, as fast as possible and without contacting the
+ * cloud. The data of all timekeys goes to a single bulk loader, the
+ * averages of the rollup are written as their intervals are replayed.
+ *
+ * \param directory	the directory containing the recorded responses
+ */
+void	loop::replay(const std::string& directory) {
+	datasink_ptr	db = openloader();
+	recorder	r(directory);
+	std::list<recorder::entry>	entries = r.entries();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "replaying %lu responses from %s",
+		(unsigned long)entries.size(), directory.c_str());
+	unsigned long	timekeys = 0;
+	time_t	last = 0;
+	auto	e = entries.begin();
+	while (e != entries.end()) {
+		time_t	t = e->timekey;
+		nlohmann::json	items = nlohmann::json::array();
+		for (; (e != entries.end()) && (e->timekey == t); e++) {
+			try {
+				stopwatch	parsewatch(statistics::parse);
+				nlohmann::json	j = nlohmann::json::parse(
+					r.read(*e));
+				parsewatch.stop();
+				if (!j.is_array()) {
+					throw shellyexception("not an array");
+				}
+				for (auto item : j) {
+					items.push_back(item);
+				}
+			} catch (const std::exception& x) {
+				debug(LOG_ERR, DEBUG_LOG, 0, "cannot replay "
+					"%s: %s", e->filename.c_str(),
+					x.what());
+			}
+		}
+		if (items.size() == 0) {
+			continue;
+		}
 		try {
-			nlohmann::json	r = nlohmann::json::parse(response);
-			process(r);
+			process(items, t, db);
 		} catch (const std::exception& x) {
 			debug(LOG_ERR, DEBUG_LOG, 0, "cannot process data: %s",
 				x.what());
 		}
+		if (_rollup) {
+			_rollup->flush(t);
+		}
+		last = t;
+		timekeys++;
+	}
+	try {
+		db->flush();
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot store data: %s", x.what());
+	}
+
+	// intervals ending with the last minute replayed are complete
+	if (_rollup && (timekeys > 0)) {
+		_rollup->flush(last + 60);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%lu timekeys replayed", timekeys);
+}
+
+/**
+ * \brief run the main event loop
+ *
+ * Each cycle is scheduled at the beginning of the minute after the
+ * scheduled start of the previous one. The delay between the scheduled
+ * and the actual start of a cycle is recorded as drift. A cycle running
+ * past the scheduled start of the next one is counted as an overrun,
+ * the next cycle then starts late, right after it.
+ *
+ * \param maxcycles	number of cycles to run, 0 means run forever
+ */
+void	loop::run(unsigned long maxcycles) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "start the event loop");
+	provision();
+	clocksource::time_point	scheduled = _clock->now();
+	while ((0 == maxcycles) || (cycles < maxcycles)) {
+		// how late does this cycle start
+		if (statistics::enabled) {
+			std::chrono::microseconds	drift
+				= std::chrono::duration_cast<
+					std::chrono::microseconds>(
+					_clock->now() - scheduled);
+			statistics::get(statistics::drift).record(
+				(drift.count() > 0) ? drift.count() : 0);
+		}
 
-	next:
-		// compute how much time we have to wait for the
-		// next run
-		std::chrono::system_clock::time_point	start
-			= std::chrono::system_clock::now();
+		stopwatch	cyclewatch(statistics::cycle);
+		cycle();
+		cyclewatch.stop();
 
+		// summarize the latency statistics every few cycles
+		cycles++;
+		metrics::cycles++;
+		if (statistics::enabled && (statistics::interval > 0)
+			&& (0 == (cycles % statistics::interval))) {
+			statistics::summarize();
+		}
+
+		// the next cycle is scheduled at the beginning of the minute
+		// after the scheduled start of this one
 		std::chrono::seconds	d
 			= std::chrono::duration_cast<std::chrono::seconds>(
 			std::chrono::duration_cast<std::chrono::minutes>(
-			start.time_since_epoch()));
+			scheduled.time_since_epoch()));
+		scheduled = clocksource::time_point(d)
+			+ std::chrono::seconds(60);
 
-		start = std::chrono::time_point<std::chrono::system_clock,
-			std::chrono::seconds>(d);
-		auto end = start + std::chrono::seconds(60);
+		// a cycle running past that start delays it, starts passed
+		// entirely are skipped and the last one is made up late
+		clocksource::time_point	now = _clock->now();
+		if (now > scheduled) {
+			long	passed = std::chrono::duration_cast<
+				std::chrono::minutes>(now - scheduled).count()
+				+ 1;
+			debug(LOG_WARNING, DEBUG_LOG, 0, "cycle overrun, "
+				"%ld start(s) passed", passed);
+			metrics::overruns += passed;
+			scheduled += std::chrono::minutes(passed - 1);
+		}
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "next point in time: %ld",
-			std::chrono::system_clock::to_time_t(end));
+			std::chrono::system_clock::to_time_t(scheduled));
+
+		// hand the trace events of this cycle to the writer
+		tracer::flush();
 
 		// wait
-		std::this_thread::sleep_until(end);
+		tracespan	sleepspan("sleep");
+		wait(scheduled);
 	}
 }
 
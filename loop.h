@@ -10,23 +10,58 @@
 #include <list>
 #include <string>
 #include <chrono>
+#include <map>
 #include "configuration.h"
+#include "database.h"
+#include "recorder.h"
+#include "clock.h"
+#include "pushqueue.h"
+#include "lan.h"
+#include "reload.h"
+#include "cloud.h"
+#include "asyncdb.h"
+#include "rollup.h"
+#include "common.h"
 
 namespace shelly {
 
 class loop {
 	configuration_ptr	_config;
-	std::string	request;
-	std::string	response;
+	configwatcher_ptr	_watcher;
+	unsigned long	cycles;
+	std::shared_ptr<recorder>	_recorder;
+	clocksource_ptr	_clock;
+	pushqueue_ptr	_pushes;
+	std::shared_ptr<lanpoller>	_lan;
+	cloudpoller_ptr	_cloud;
+	asyncdatabase_ptr	_writer;
+	rollup_ptr	_rollup;
+	nlohmann::json	_rollupsection;
+	std::map<std::string, time_t>	_lastpush;
+	std::map<std::string, time_t>	_stored;
+	void	wait(const clocksource::time_point& end);
+	void	refresh();
+	void	provision();
+	bool	nonblocking() const;
+	void	store(const nlohmann::json& items, time_t timekey);
 public:
 	loop(configuration_ptr config);
-	~loop();
-	void	run();
-	size_t	read_callback(char *data, size_t size, size_t nitems);
-	size_t	write_callback(char *data, size_t size, size_t nitems);
-	void	sendrequest(const std::list<std::string>& ids);
-	void	process(const nlohmann::json& response);
+	virtual ~loop();
+	void	run(unsigned long maxcycles = 0);
+	void	cycle();
+	virtual datasink_ptr	opensink();
+	virtual datasink_ptr	openloader();
+	void	process(const nlohmann::json& response, time_t timekey);
+	void	process(const nlohmann::json& response, time_t timekey,
+			datasink_ptr db);
+	void	record(const std::string& directory);
+	void	replay(const std::string& directory);
+	void	pushes(pushqueue_ptr q) { _pushes = q; }
+	void	watch(configwatcher_ptr w) { _watcher = w; }
+	void	ingest();
 	std::chrono::seconds	timekey() const;
+	clocksource_ptr	clock() const { return _clock; }
+	void	clock(clocksource_ptr c) { _clock = c; }
 };
 
 } // namespace shelly
@@ -0,0 +1,392 @@
+/*
+ * metrics.cpp -- counters exported in the prometheus text format
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "metrics.h"
+#include "statistics.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace shelly {
+
+std::atomic<uint64_t>	metrics::cycles(0);
+std::atomic<uint64_t>	metrics::overruns(0);
+std::atomic<uint64_t>	metrics::devices(0);
+std::atomic<uint64_t>	metrics::inserted(0);
+std::atomic<uint64_t>	metrics::inserterrors(0);
+std::atomic<uint64_t>	metrics::bytesreceived(0);
+std::atomic<uint64_t>	metrics::wirebytes(0);
+std::atomic<uint64_t>	metrics::connects(0);
+std::atomic<uint64_t>	metrics::pushes(0);
+std::atomic<uint64_t>	metrics::reloads(0);
+std::atomic<uint64_t>	metrics::retries(0);
+std::atomic<uint64_t>	metrics::partitionsadded(0);
+std::atomic<uint64_t>	metrics::partitionsdropped(0);
+std::atomic<uint64_t>	metrics::averages(0);
+std::atomic<uint64_t>	metrics::provisioned(0);
+std::atomic<uint64_t>	metrics::discovered(0);
+std::atomic<uint64_t>	metrics::httpstatus[metrics::maxstatus];
+std::atomic<int64_t>	metrics::queuedepth[metrics::queues];
+std::mutex	metrics::_mutex;
+std::map<std::pair<std::string, int>, uint64_t>	metrics::_requests;
+
+static const char	*queuenames[metrics::queues] = {
+	"statements", "pushed"
+};
+
+static const char	*outcomenames[metrics::outcomes] = {
+	"succeeded", "retried", "failed"
+};
+
+/**
+ * \brief Get the name of a queue
+ *
+ * \param q		the queue
+ */
+const char	*metrics::name(queue q) {
+	return queuenames[q];
+}
+
+/**
+ * \brief Count a HTTP status code returned by the cloud
+ *
+ * \param code		the HTTP status code
+ */
+void	metrics::status(long code) {
+	if ((code < 0) || (code >= maxstatus)) {
+		code = 0;
+	}
+	httpstatus[code].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * \brief Count the outcome of a request to a cloud endpoint
+ *
+ * \param endpoint	the name of the endpoint
+ * \param o		the outcome of the request
+ */
+void	metrics::request(const std::string& endpoint, outcome o) {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	_requests[std::make_pair(endpoint, (int)o)]++;
+}
+
+/**
+ * \brief Write a counter in the prometheus text format
+ */
+static void	counter(std::ostream& out, const char *name, const char *help,
+		uint64_t value) {
+	out << "# HELP " << name << " " << help << std::endl;
+	out << "# TYPE " << name << " counter" << std::endl;
+	out << name << " " << value << std::endl;
+}
+
+/**
+ * \brief upper bounds in seconds of the exported histogram buckets
+ */
+static const double	bounds[] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+	1, 2.5, 5, 10, 30, 60
+};
+
+/**
+ * \brief Format all metrics in the prometheus text exposition format
+ *
+ * The fine grained buckets of the stage histograms are folded into a
+ * few buckets with decimal bounds. A fine bucket is counted in the first
+ * exported bucket that contains its upper bound, so the exported counts
+ * are accurate to the 6% resolution of the histogram.
+ */
+std::string	metrics::text() {
+	std::ostringstream	out;
+	counter(out, "shellyd_cycles_total", "Number of cycles run",
+		cycles.load());
+	counter(out, "shellyd_cycle_overruns_total",
+		"Number of cycle starts delayed or skipped because a cycle "
+		"ran too long",
+		overruns.load());
+	counter(out, "shellyd_devices_fetched_total",
+		"Number of device status records received", devices.load());
+	counter(out, "shellyd_readings_inserted_total",
+		"Number of values inserted into the database",
+		inserted.load());
+	counter(out, "shellyd_insert_errors_total",
+		"Number of devices for which the insert failed",
+		inserterrors.load());
+	counter(out, "shellyd_cloud_bytes_received_total",
+		"Number of bytes received after decoding",
+		bytesreceived.load());
+	counter(out, "shellyd_cloud_wire_bytes_total",
+		"Number of bytes received from the cloud including headers, "
+		"before decoding", wirebytes.load());
+	counter(out, "shellyd_database_connects_total",
+		"Number of database connections established",
+		connects.load());
+	counter(out, "shellyd_pushes_total",
+		"Number of complete device status pushes received",
+		pushes.load());
+	counter(out, "shellyd_config_reloads_total",
+		"Number of configuration reloads put into service",
+		reloads.load());
+	counter(out, "shellyd_cloud_retries_total",
+		"Number of cloud requests retried after a failure",
+		retries.load());
+	counter(out, "shellyd_partitions_added_total",
+		"Number of table partitions created ahead of time",
+		partitionsadded.load());
+	counter(out, "shellyd_partitions_dropped_total",
+		"Number of table partitions dropped after the retention time",
+		partitionsdropped.load());
+	counter(out, "shellyd_averages_written_total",
+		"Number of averages written by the rollup",
+		averages.load());
+	counter(out, "shellyd_sensors_provisioned_total",
+		"Number of missing sensors created in the database",
+		provisioned.load());
+	counter(out, "shellyd_devices_discovered_total",
+		"Number of new devices found in the cloud accounts",
+		discovered.load());
+
+	// HTTP status codes
+	out << "# HELP shellyd_cloud_http_responses_total Number of cloud "
+		"responses by HTTP status code" << std::endl;
+	out << "# TYPE shellyd_cloud_http_responses_total counter"
+		<< std::endl;
+	for (int code = 0; code < maxstatus; code++) {
+		uint64_t	n = httpstatus[code].load();
+		if (n == 0) {
+			continue;
+		}
+		out << "shellyd_cloud_http_responses_total{code=\"" << code
+			<< "\"} " << n << std::endl;
+	}
+
+	// requests per cloud endpoint
+	out << "# HELP shellyd_cloud_requests_total Number of cloud requests "
+		"by endpoint and outcome" << std::endl;
+	out << "# TYPE shellyd_cloud_requests_total counter" << std::endl;
+	{
+		std::unique_lock<std::mutex>	lock(_mutex);
+		for (auto r : _requests) {
+			out << "shellyd_cloud_requests_total{endpoint=\""
+				<< r.first.first << "\",outcome=\""
+				<< outcomenames[r.first.second] << "\"} "
+				<< r.second << std::endl;
+		}
+	}
+
+	// queue depths
+	out << "# HELP shellyd_queue_depth Number of entries waiting in a "
+		"queue" << std::endl;
+	out << "# TYPE shellyd_queue_depth gauge" << std::endl;
+	for (int q = 0; q < queues; q++) {
+		out << "shellyd_queue_depth{queue=\"" << name((queue)q)
+			<< "\"} " << queuedepth[q].load() << std::endl;
+	}
+
+	// stage duration histograms
+	out << "# HELP shellyd_stage_duration_seconds Time spent in each "
+		"stage of a cycle" << std::endl;
+	out << "# TYPE shellyd_stage_duration_seconds histogram" << std::endl;
+	int	nbounds = sizeof(bounds) / sizeof(bounds[0]);
+	for (int s = 0; s < statistics::stages; s++) {
+		const char	*stage = statistics::name((statistics::stage)s);
+		const histogram&	h
+			= statistics::get((statistics::stage)s);
+		uint64_t	cumulative = 0;
+		int	bucket = 0;
+		for (int b = 0; b < nbounds; b++) {
+			uint64_t	limit = bounds[b] * 1000000;
+			while ((bucket < histogram::nbuckets)
+				&& (histogram::upper(bucket) <= limit)) {
+				cumulative += h.bucketcount(bucket++);
+			}
+			out << "shellyd_stage_duration_seconds_bucket{stage=\""
+				<< stage << "\",le=\"" << bounds[b] << "\"} "
+				<< cumulative << std::endl;
+		}
+		out << "shellyd_stage_duration_seconds_bucket{stage=\""
+			<< stage << "\",le=\"+Inf\"} " << h.count()
+			<< std::endl;
+		out << "shellyd_stage_duration_seconds_sum{stage=\"" << stage
+			<< "\"} " << (h.sum() / 1000000.) << std::endl;
+		out << "shellyd_stage_duration_seconds_count{stage=\"" << stage
+			<< "\"} " << h.count() << std::endl;
+	}
+	return out.str();
+}
+
+/**
+ * \brief Create the metrics server and start the server thread
+ *
+ * \param config	the configuration containing the metrics section
+ */
+metricsserver::metricsserver(configuration_ptr config) : _fd(-1),
+	_running(true) {
+	std::string	error;
+	if (config->has("metrics.socket")) {
+		std::string	path = config->stringvalue("metrics.socket");
+		struct sockaddr_un	sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, path.c_str(), sizeof(sun.sun_path) - 1);
+		unlink(path.c_str());
+		_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if ((_fd < 0) || (bind(_fd, (struct sockaddr *)&sun,
+			sizeof(sun)) < 0)) {
+			error = stringprintf("cannot bind to %s: %s",
+				path.c_str(), strerror(errno));
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "metrics on socket %s",
+			path.c_str());
+	} else {
+		std::string	address("127.0.0.1");
+		if (config->has("metrics.address")) {
+			address = config->stringvalue("metrics.address");
+		}
+		int	port = config->intvalue("metrics.port");
+		struct sockaddr_in	sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		if (0 == inet_aton(address.c_str(), &sin.sin_addr)) {
+			throw shellyexception(stringprintf("bad metrics "
+				"address %s", address.c_str()));
+		}
+		_fd = socket(AF_INET, SOCK_STREAM, 0);
+		int	on = 1;
+		if (_fd >= 0) {
+			setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on,
+				sizeof(on));
+		}
+		if ((_fd < 0) || (bind(_fd, (struct sockaddr *)&sin,
+			sizeof(sin)) < 0)) {
+			error = stringprintf("cannot bind to %s:%d: %s",
+				address.c_str(), port, strerror(errno));
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "metrics on %s:%d",
+			address.c_str(), port);
+	}
+	if ((error.size() == 0) && (listen(_fd, 5) < 0)) {
+		error = stringprintf("cannot listen: %s", strerror(errno));
+	}
+	if (error.size() > 0) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		if (_fd >= 0) {
+			close(_fd);
+		}
+		throw shellyexception(error);
+	}
+	_thread = std::thread(&metricsserver::main, this);
+}
+
+/**
+ * \brief Stop the server thread and close the socket
+ */
+metricsserver::~metricsserver() {
+	_running = false;
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	close(_fd);
+}
+
+/**
+ * \brief Answer a single request on a connection
+ *
+ * Only the request line is looked at, everything else the client sends
+ * is ignored.
+ *
+ * \param fd		the connected socket
+ */
+void	metricsserver::serve(int fd) {
+	// read the request header, waiting at most one second for it
+	std::string	request;
+	char	buffer[1024];
+	while (std::string::npos == request.find("\r\n\r\n")) {
+		struct pollfd	pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) <= 0) {
+			return;
+		}
+		ssize_t	bytes = read(fd, buffer, sizeof(buffer));
+		if (bytes <= 0) {
+			return;
+		}
+		request.append(buffer, bytes);
+		if (request.size() > 8192) {
+			return;
+		}
+	}
+
+	// build the response
+	std::string	status("200 OK");
+	std::string	body;
+	if ((0 == request.compare(0, 13, "GET /metrics ")) ||
+		(0 == request.compare(0, 6, "GET / "))) {
+		body = metrics::text();
+	} else {
+		status = std::string("404 Not Found");
+		body = std::string("not found\n");
+	}
+	std::string	response = stringprintf("HTTP/1.0 %s\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %lu\r\n"
+		"Connection: close\r\n\r\n", status.c_str(),
+		(unsigned long)body.size()) + body;
+
+	// send it
+	const char	*p = response.data();
+	size_t	remaining = response.size();
+	while (remaining > 0) {
+		ssize_t	bytes = write(fd, p, remaining);
+		if (bytes <= 0) {
+			return;
+		}
+		p += bytes;
+		remaining -= bytes;
+	}
+}
+
+/**
+ * \brief Main function of the server thread
+ */
+void	metricsserver::main() {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "metrics server started");
+	while (_running) {
+		struct pollfd	pfd;
+		pfd.fd = _fd;
+		pfd.events = POLLIN;
+		int	rc = poll(&pfd, 1, 1000);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			debug(LOG_ERR, DEBUG_LOG, DEBUG_ERRNO, "poll failed");
+			return;
+		}
+		if (rc == 0) {
+			continue;
+		}
+		int	fd = accept(_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		serve(fd);
+		close(fd);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "metrics server terminated");
+}
+
+} // namespace shelly
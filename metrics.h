@@ -0,0 +1,92 @@
+/*
+ * metrics.h -- counters exported in the prometheus text format
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _metrics_h
+#define _metrics_h
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include "configuration.h"
+
+namespace shelly {
+
+/**
+ * \brief Counters and gauges describing the operation of the daemon
+ *
+ * All values are atomic, so they can be updated from the loop without
+ * a lock and read from the metrics server thread at any time. Only the
+ * request counters per cloud endpoint, whose labels are not known in
+ * advance, are kept in a map protected by a mutex.
+ */
+class metrics {
+public:
+	typedef enum {
+		statements = 0,
+		pushed,
+		queues
+	} queue;
+	typedef enum {
+		succeeded = 0,
+		retried,
+		failed,
+		outcomes
+	} outcome;
+private:
+	static std::mutex	_mutex;
+	static std::map<std::pair<std::string, int>, uint64_t>	_requests;
+public:
+	static const int	maxstatus = 600;
+	static std::atomic<uint64_t>	cycles;
+	static std::atomic<uint64_t>	overruns;
+	static std::atomic<uint64_t>	devices;
+	static std::atomic<uint64_t>	inserted;
+	static std::atomic<uint64_t>	inserterrors;
+	static std::atomic<uint64_t>	bytesreceived;
+	static std::atomic<uint64_t>	wirebytes;
+	static std::atomic<uint64_t>	connects;
+	static std::atomic<uint64_t>	pushes;
+	static std::atomic<uint64_t>	reloads;
+	static std::atomic<uint64_t>	retries;
+	static std::atomic<uint64_t>	partitionsadded;
+	static std::atomic<uint64_t>	partitionsdropped;
+	static std::atomic<uint64_t>	averages;
+	static std::atomic<uint64_t>	provisioned;
+	static std::atomic<uint64_t>	discovered;
+	static std::atomic<uint64_t>	httpstatus[maxstatus];
+	static std::atomic<int64_t>	queuedepth[queues];
+	static const char	*name(queue q);
+	static void	status(long code);
+	static void	request(const std::string& endpoint, outcome o);
+	static std::string	text();
+};
+
+/**
+ * \brief Minimal HTTP server exposing the metrics
+ *
+ * The server runs in a thread of its own and only reads the atomic
+ * counters, so a scrape never delays the polling loop. It listens
+ * either on a TCP port or on a unix domain socket.
+ */
+class metricsserver {
+	int	_fd;
+	std::atomic<bool>	_running;
+	std::thread	_thread;
+	void	serve(int fd);
+	void	main();
+	metricsserver(const metricsserver& other);
+	metricsserver&	operator=(const metricsserver& other);
+public:
+	metricsserver(configuration_ptr config);
+	~metricsserver();
+};
+
+} // namespace shelly
+
+#endif /* _metrics_h */
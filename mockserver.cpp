@@ -0,0 +1,911 @@
+/*
+ * mockserver.cpp -- local stand-in for the shelly cloud
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "mockserver.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <map>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+namespace shelly {
+
+#define	MOCK_IDBASE	0x5432045a0000LL
+
+/**
+ * \brief Create the id of a synthetic device
+ *
+ * \param i		the index of the device in the fleet
+ */
+std::string	mockserver::id(int i) {
+	return stringprintf("%012llx", MOCK_IDBASE + i);
+}
+
+/**
+ * \brief Get the index of a synthetic device from its id
+ *
+ * \param id		the device id
+ * \return		the index or -1 if the id is not a synthetic id
+ */
+int	mockserver::index(const std::string& id) {
+	if (id.size() != 12) {
+		return -1;
+	}
+	char	*end = NULL;
+	long long	v = strtoll(id.c_str(), &end, 16);
+	if ((*end != '\0') || (v < MOCK_IDBASE)) {
+		return -1;
+	}
+	return (int)(v - MOCK_IDBASE);
+}
+
+/**
+ * \brief Construct the status of a synthetic H&T device
+ *
+ * The values vary slowly with the time of day and with the device
+ * index, so that data written to a database looks plausible.
+ *
+ * \param i		the index of the device
+ * \param now		the current time
+ * \param padding	number of additional payload bytes
+ */
+nlohmann::json	mockserver::status(int i, time_t now, int padding) {
+	double	phase = 2 * M_PI * (now % 86400) / 86400. + i;
+	nlohmann::json	status;
+	status["ts"] = (double)now;
+	status["temperature:0"]["id"] = 0;
+	status["temperature:0"]["tC"] = round(200 + 50 * sin(phase)) / 10.;
+	status["humidity:0"]["id"] = 0;
+	status["humidity:0"]["rh"] = round(500 + 200 * cos(phase)) / 10.;
+	status["devicepower:0"]["id"] = 0;
+	status["devicepower:0"]["battery"]["V"] = 5.5 + (i % 10) / 20.;
+	status["devicepower:0"]["battery"]["percent"] = 50 + (i % 50);
+	status["devicepower:0"]["external"]["present"] = false;
+	status["sys"]["mac"] = id(i);
+	status["sys"]["uptime"] = (int)(now % 100000);
+	status["sys"]["ram_free"] = 100000 + i;
+	if (padding > 0) {
+		status["sys"]["padding"] = std::string(padding, 'x');
+	}
+	return status;
+}
+
+/**
+ * \brief Answer a device status request
+ *
+ * Unknown ids are silently skipped, as the cloud does.
+ *
+ * \param request	the request JSON containing the ids
+ */
+nlohmann::json	mockserver::devices(const nlohmann::json& request) {
+	nlohmann::json	result = nlohmann::json::array();
+	time_t	now = time(NULL);
+	for (auto i : request["ids"]) {
+		std::string	deviceid = i;
+		int	n = index(deviceid);
+		if ((n < 0) || (n >= _options.devices)) {
+			continue;
+		}
+		nlohmann::json	item;
+		item["id"] = deviceid;
+		item["type"] = "sensor";
+		item["code"] = "S3SN-0U12A";
+		item["gen"] = "G3";
+		item["online"] = 1;
+		item["status"] = status(n, now, _options.padding);
+		result.push_back(item);
+	}
+	return result;
+}
+
+/**
+ * \brief Answer a request for the status of all devices of an account
+ *
+ * The response has the format of the /device/all_status call of the
+ * cloud API, the status of each device is keyed by its id.
+ *
+ * \param account	the account whose devices to list
+ */
+nlohmann::json	mockserver::allstatus(int account) {
+	nlohmann::json	result;
+	nlohmann::json	devices = nlohmann::json::object();
+	time_t	now = time(NULL);
+	for (int i = account; i < _options.devices; i += _options.accounts) {
+		nlohmann::json	s = status(i, now, _options.padding);
+		s["_dev_info"]["id"] = id(i);
+		s["_dev_info"]["code"] = "S3SN-0U12A";
+		s["_dev_info"]["gen"] = "G3";
+		s["_dev_info"]["online"] = true;
+		devices[id(i)] = s;
+	}
+	result["isok"] = true;
+	result["data"]["devices_status"] = devices;
+	return result;
+}
+
+/**
+ * \brief Create a shellyd configuration for the synthetic fleet
+ *
+ * \param host		host name or address under which the server is reached
+ */
+nlohmann::json	mockserver::configuration(const std::string& host) const {
+	nlohmann::json	config;
+	nlohmann::json	cloud = nlohmann::json::array();
+	for (int a = 0; a < _options.accounts; a++) {
+		nlohmann::json	endpoint;
+		endpoint["url"] = stringprintf("http://%s:%d", host.c_str(),
+			_port);
+		endpoint["endpoint"] = "/v2/devices/api/get";
+		endpoint["key"] = key(a);
+		if (_options.maxids > 0) {
+			endpoint["chunksize"] = _options.maxids;
+		}
+		endpoint["ratelimit"] = _options.ratelimit;
+		if (_options.accounts > 1) {
+			endpoint["name"] = stringprintf("account%d", a);
+		}
+		cloud.push_back(endpoint);
+	}
+	config["cloud"] = (_options.accounts > 1) ? cloud : cloud[0];
+	if (_options.events > 0) {
+		config["events"]["url"] = stringprintf(
+			"ws://%s:%d/shelly/wss/hk_sock", host.c_str(), _port);
+		config["events"]["token"] = key(0);
+	}
+	config["database"]["hostname"] = "localhost";
+	config["database"]["port"] = 3306;
+	config["database"]["dbname"] = "meteo";
+	config["database"]["username"] = "meteo";
+	config["database"]["password"] = "meteo";
+	config["devices"] = nlohmann::json::array();
+	for (int i = 0; i < _options.devices; i++) {
+		nlohmann::json	device;
+		device["id"] = id(i);
+		device["station"] = "Mock";
+		device["sensor"] = stringprintf("mock%d", i);
+		if (_options.accounts > 1) {
+			device["cloud"] = stringprintf("account%d",
+				i % _options.accounts);
+		}
+		if (_options.lan) {
+			device["address"] = stringprintf("%s:%d/device/%s",
+				host.c_str(), _port, id(i).c_str());
+		}
+		config["devices"].push_back(device);
+	}
+	return config;
+}
+
+/**
+ * \brief Get the auth key of an account
+ *
+ * With a single account, the key is the one given in the options,
+ * otherwise the account number is appended to it.
+ *
+ * \param account	the number of the account
+ */
+std::string	mockserver::key(int account) const {
+	std::string	k = (_options.key.size() > 0) ? _options.key
+		: std::string("mock");
+	if (_options.accounts > 1) {
+		k += stringprintf("%d", account);
+	}
+	return k;
+}
+
+/**
+ * \brief Find the account an auth key in a query string belongs to
+ *
+ * \param query		the query string of the request
+ * \return		the account number, -1 if the key is not valid
+ */
+int	mockserver::account(const std::string& query) const {
+	size_t	p = query.find("auth_key=");
+	std::string	k;
+	if (p != std::string::npos) {
+		p += 9;
+		k = query.substr(p, query.find('&', p) - p);
+	}
+	if ((_options.accounts <= 1) && (_options.key.size() == 0)) {
+		return 0;
+	}
+	for (int a = 0; a < _options.accounts; a++) {
+		if (k == key(a)) {
+			return a;
+		}
+	}
+	return -1;
+}
+
+/**
+ * \brief Find out whether the request exceeds the rate limit
+ *
+ * \param account	the account the request is made for
+ */
+bool	mockserver::limited(int account) {
+	if (_options.ratelimit <= 0) {
+		return false;
+	}
+	std::unique_lock<std::mutex>	lock(_mutex);
+	std::chrono::steady_clock::time_point	now
+		= std::chrono::steady_clock::now();
+	if (now - _window[account] >= std::chrono::seconds(1)) {
+		_window[account] = now;
+		_windowcount[account] = 0;
+	}
+	return (++_windowcount[account] > _options.ratelimit);
+}
+
+/**
+ * \brief Handle a request
+ *
+ * \param method	the HTTP method
+ * \param target	the request target including the query string
+ * \param body		the request body
+ * \param status	the HTTP status code to return
+ */
+std::string	mockserver::handle(const std::string& method,
+		const std::string& target, const std::string& body,
+		int& status) {
+	_requests++;
+	status = 200;
+	nlohmann::json	error;
+
+	// split the target into path and query
+	std::string	path = target;
+	std::string	query;
+	size_t	q = target.find('?');
+	if (q != std::string::npos) {
+		path = target.substr(0, q);
+		query = target.substr(q + 1);
+	}
+
+	// local RPC of a single device
+	if ((0 == path.compare(0, 8, "/device/")) && (path.size() > 8)
+		&& (path != "/device/all_status")) {
+		size_t	slash = path.find('/', 8);
+		int	n = index(path.substr(8, slash - 8));
+		if ((slash == std::string::npos) || (n < 0)
+			|| (n >= _options.devices)
+			|| (path.substr(slash) != "/rpc/Shelly.GetStatus")) {
+			status = 404;
+			error["error"] = "not found";
+			return error.dump();
+		}
+		if (_options.latency > 0) {
+			std::this_thread::sleep_for(
+				std::chrono::milliseconds(_options.latency));
+		}
+		if ((_options.errorrate > 0) && (random() < _options.errorrate
+			* (double)RAND_MAX)) {
+			_errors++;
+			status = 500;
+			error["error"] = "internal error";
+			return error.dump();
+		}
+		nlohmann::json	result = mockserver::status(n, time(NULL),
+			_options.padding);
+		result.erase("ts");
+		return result.dump();
+	}
+
+	if ((path != "/v2/devices/api/get") && (path != "/device/all_status")) {
+		status = 404;
+		error["error"] = "not found";
+		return error.dump();
+	}
+	if (method != "POST") {
+		status = 405;
+		error["error"] = "method not allowed";
+		return error.dump();
+	}
+	int	a = account(query);
+	if (a < 0) {
+		status = 401;
+		error["error"] = "unauthorized";
+		return error.dump();
+	}
+
+	// simulated latency and failures
+	if (_options.latency > 0) {
+		std::this_thread::sleep_for(
+			std::chrono::milliseconds(_options.latency));
+	}
+	if (limited(a)) {
+		_errors++;
+		status = 429;
+		error["error"] = "too many requests";
+		return error.dump();
+	}
+	if ((_options.errorrate > 0) && (random() < _options.errorrate
+		* (double)RAND_MAX)) {
+		_errors++;
+		status = 500;
+		error["error"] = "internal error";
+		return error.dump();
+	}
+
+	// discovery lists all devices of the account
+	if (path == "/device/all_status") {
+		return allstatus(a).dump();
+	}
+
+	// parse and check the request
+	nlohmann::json	request;
+	try {
+		request = nlohmann::json::parse(body);
+	} catch (const std::exception& x) {
+		status = 400;
+		error["error"] = "bad request";
+		return error.dump();
+	}
+	if ((_options.maxids > 0) && (request["ids"].size()
+		> (size_t)_options.maxids)) {
+		status = 400;
+		error["error"] = stringprintf("too many ids, at most %d "
+			"allowed", _options.maxids);
+		return error.dump();
+	}
+	if (_options.accounts > 1) {
+		// devices of other accounts are unknown to this one
+		nlohmann::json	ids = nlohmann::json::array();
+		for (auto i : request["ids"]) {
+			if (index(i.get<std::string>()) % _options.accounts
+				== a) {
+				ids.push_back(i);
+			}
+		}
+		request["ids"] = ids;
+	}
+	return devices(request).dump();
+}
+
+/**
+ * \brief Read more data from a connection into a buffer
+ *
+ * \param fd		the connected socket
+ * \param buffer	the buffer to append to
+ * \return		false if the connection was closed
+ */
+static bool	fill(int fd, std::string& buffer) {
+	char	data[16384];
+	ssize_t	bytes = read(fd, data, sizeof(data));
+	if (bytes <= 0) {
+		return false;
+	}
+	buffer.append(data, bytes);
+	return true;
+}
+
+/**
+ * \brief Compress a response body with gzip
+ *
+ * \param data		the data to compress
+ */
+static std::string	gzip(const std::string& data) {
+	z_stream	z;
+	memset(&z, 0, sizeof(z));
+	// window bits 15 + 16 selects the gzip format
+	if (Z_OK != deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		15 + 16, 8, Z_DEFAULT_STRATEGY)) {
+		throw shellyexception("cannot initialize deflate");
+	}
+	std::string	result(deflateBound(&z, data.size()), '\0');
+	z.next_in = (Bytef *)data.data();
+	z.avail_in = data.size();
+	z.next_out = (Bytef *)&result[0];
+	z.avail_out = result.size();
+	int	rc = deflate(&z, Z_FINISH);
+	result.resize(z.total_out);
+	deflateEnd(&z);
+	if (rc != Z_STREAM_END) {
+		throw shellyexception("cannot compress response");
+	}
+	return result;
+}
+
+/**
+ * \brief Write all data to a connection
+ *
+ * \param fd		the connected socket
+ * \param data		the data to write
+ * \return		false if the connection was closed
+ */
+static bool	writeall(int fd, const std::string& data) {
+	const char	*d = data.data();
+	size_t	remaining = data.size();
+	while (remaining > 0) {
+		ssize_t	bytes = send(fd, d, remaining, MSG_NOSIGNAL);
+		if (bytes <= 0) {
+			return false;
+		}
+		d += bytes;
+		remaining -= bytes;
+	}
+	return true;
+}
+
+/**
+ * \brief Compute the SHA-1 digest of a string
+ *
+ * \param s		the data to digest
+ */
+static std::string	sha1(const std::string& s) {
+	uint32_t	h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+				 0xc3d2e1f0 };
+	std::string	m = s;
+	m.push_back((char)0x80);
+	while ((m.size() % 64) != 56) {
+		m.push_back(0);
+	}
+	uint64_t	bits = (uint64_t)s.size() * 8;
+	for (int shift = 56; shift >= 0; shift -= 8) {
+		m.push_back((char)((bits >> shift) & 0xff));
+	}
+#define	ROTL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+	for (size_t block = 0; block < m.size(); block += 64) {
+		uint32_t	w[80];
+		for (int i = 0; i < 16; i++) {
+			const uint8_t	*p = (const uint8_t *)m.data() + block
+						+ 4 * i;
+			w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+				| ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+		}
+		for (int i = 16; i < 80; i++) {
+			w[i] = ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14]
+				^ w[i - 16], 1);
+		}
+		uint32_t	a = h[0], b = h[1], c = h[2];
+		uint32_t	d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++) {
+			uint32_t	f, k;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+			uint32_t	t = ROTL(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = ROTL(b, 30);
+			b = a;
+			a = t;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+#undef ROTL
+	std::string	result;
+	for (int i = 0; i < 5; i++) {
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			result.push_back((char)((h[i] >> shift) & 0xff));
+		}
+	}
+	return result;
+}
+
+/**
+ * \brief Compute the Sec-WebSocket-Accept value for a key
+ *
+ * \param key		the Sec-WebSocket-Key sent by the client
+ */
+static std::string	acceptkey(const std::string& key) {
+	static const char	*alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string	d = sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+	std::string	result;
+	for (size_t i = 0; i < d.size(); i += 3) {
+		uint32_t	v = (uint8_t)d[i] << 16;
+		v |= (i + 1 < d.size()) ? (uint8_t)d[i + 1] << 8 : 0;
+		v |= (i + 2 < d.size()) ? (uint8_t)d[i + 2] : 0;
+		result.push_back(alphabet[(v >> 18) & 0x3f]);
+		result.push_back(alphabet[(v >> 12) & 0x3f]);
+		result.push_back((i + 1 < d.size()) ? alphabet[(v >> 6) & 0x3f]
+			: '=');
+		result.push_back((i + 2 < d.size()) ? alphabet[v & 0x3f] : '=');
+	}
+	return result;
+}
+
+/**
+ * \brief Build an unmasked server frame
+ *
+ * \param opcode	the opcode of the frame
+ * \param payload	the payload of the frame
+ */
+static std::string	frame(uint8_t opcode, const std::string& payload) {
+	std::string	result;
+	result.push_back((char)(0x80 | opcode));
+	size_t	length = payload.size();
+	if (length < 126) {
+		result.push_back((char)length);
+	} else if (length < 65536) {
+		result.push_back((char)126);
+		result.push_back((char)((length >> 8) & 0xff));
+		result.push_back((char)(length & 0xff));
+	} else {
+		result.push_back((char)127);
+		for (int shift = 56; shift >= 0; shift -= 8) {
+			result.push_back((char)((length >> shift) & 0xff));
+		}
+	}
+	return result + payload;
+}
+
+/**
+ * \brief Serve the WebSocket event stream on an upgraded connection
+ *
+ * A round of Shelly:StatusOnChange events for all devices is sent right
+ * after the upgrade and then every _options.events milliseconds. Pings
+ * of the client are answered, a close frame ends the stream.
+ *
+ * \param fd		the connected socket
+ * \param target	the request target including the query string
+ * \param key		the Sec-WebSocket-Key sent by the client
+ * \param buffer	data already received after the request header
+ */
+void	mockserver::stream(int fd, const std::string& target,
+		const std::string& key, std::string& buffer) {
+	_requests++;
+	size_t	q = target.find('?');
+	std::string	path = target.substr(0, q);
+	std::string	query = (q == std::string::npos) ? std::string()
+				: target.substr(q + 1);
+	std::string	refusal;
+	if ((path != "/shelly/wss/hk_sock") || (_options.events <= 0)) {
+		refusal = "HTTP/1.1 404 Not Found\r\n";
+	} else if ((_options.key.size() > 0)
+		&& (std::string::npos == query.find("t=" + _options.key))) {
+		refusal = "HTTP/1.1 401 Unauthorized\r\n";
+	}
+	if (refusal.size() > 0) {
+		writeall(fd, refusal + "Content-Length: 0\r\n"
+			"Connection: close\r\n\r\n");
+		return;
+	}
+	if (!writeall(fd, "HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: " + acceptkey(key) + "\r\n\r\n")) {
+		return;
+	}
+	if (std::string::npos != query.find("since=")) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "event stream resumed");
+	} else {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "event stream opened");
+	}
+
+	std::chrono::steady_clock::time_point	next
+		= std::chrono::steady_clock::now();
+	while (_running) {
+		// send a round of events when it is due
+		std::chrono::steady_clock::time_point	now
+			= std::chrono::steady_clock::now();
+		if (now >= next) {
+			time_t	t = time(NULL);
+			for (int i = 0; i < _options.devices; i++) {
+				nlohmann::json	event;
+				event["event"] = "Shelly:StatusOnChange";
+				event["deviceId"] = id(i);
+				event["status"] = status(i, t,
+					_options.padding);
+				event["ts"] = (double)t;
+				if (!writeall(fd, frame(0x1, event.dump()))) {
+					return;
+				}
+			}
+			next += std::chrono::milliseconds(_options.events);
+			continue;
+		}
+
+		// handle frames of the client until the next round
+		struct pollfd	pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		int	timeout = std::chrono::duration_cast<
+			std::chrono::milliseconds>(next - now).count() + 1;
+		if ((buffer.size() < 2)
+			&& (poll(&pfd, 1, (timeout > 200) ? 200 : timeout)
+				<= 0)) {
+			continue;
+		}
+		if ((buffer.size() < 2) && !fill(fd, buffer)) {
+			return;
+		}
+		size_t	length = buffer[1] & 0x7f;
+		size_t	offset = (length == 126) ? 4
+				: ((length == 127) ? 10 : 2);
+		if (buffer.size() < offset) {
+			if (!fill(fd, buffer)) {
+				return;
+			}
+			continue;
+		}
+		if (offset > 2) {
+			length = 0;
+			for (size_t i = 2; i < offset; i++) {
+				length = (length << 8) | (uint8_t)buffer[i];
+			}
+		}
+		size_t	maskoffset = offset;
+		if (buffer[1] & 0x80) {
+			offset += 4;
+		}
+		if (buffer.size() < offset + length) {
+			if (!fill(fd, buffer)) {
+				return;
+			}
+			continue;
+		}
+		std::string	payload = buffer.substr(offset, length);
+		if (buffer[1] & 0x80) {
+			for (size_t i = 0; i < length; i++) {
+				payload[i] ^= buffer[maskoffset + (i % 4)];
+			}
+		}
+		uint8_t	opcode = buffer[0] & 0x0f;
+		buffer.erase(0, offset + length);
+		if (opcode == 0x9) {
+			if (!writeall(fd, frame(0xa, payload))) {
+				return;
+			}
+		} else if (opcode == 0x8) {
+			writeall(fd, frame(0x8, payload));
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "event stream closed");
+			return;
+		}
+	}
+}
+
+/**
+ * \brief Handle all requests arriving on a connection
+ *
+ * \param fd		the connected socket
+ */
+void	mockserver::connection(int fd) {
+	std::string	buffer;
+	bool	keepalive = true;
+	while (keepalive && _running) {
+		// read the request header
+		size_t	end;
+		while (std::string::npos == (end = buffer.find("\r\n\r\n"))) {
+			if (!fill(fd, buffer)) {
+				return;
+			}
+		}
+		std::string	header = buffer.substr(0, end + 2);
+		buffer = buffer.substr(end + 4);
+
+		// parse request line and header fields
+		size_t	eol = header.find("\r\n");
+		std::string	requestline = header.substr(0, eol);
+		size_t	s1 = requestline.find(' ');
+		size_t	s2 = requestline.find(' ', s1 + 1);
+		if ((s1 == std::string::npos) || (s2 == std::string::npos)) {
+			return;
+		}
+		std::string	method = requestline.substr(0, s1);
+		std::string	target = requestline.substr(s1 + 1,
+			s2 - s1 - 1);
+		std::string	version = requestline.substr(s2 + 1);
+		std::map<std::string, std::string>	fields;
+		size_t	p = eol + 2;
+		while (p < header.size()) {
+			size_t	e = header.find("\r\n", p);
+			std::string	line = header.substr(p, e - p);
+			p = e + 2;
+			size_t	colon = line.find(':');
+			if (colon == std::string::npos) {
+				continue;
+			}
+			std::string	name = line.substr(0, colon);
+			for (auto& c : name) {
+				c = tolower(c);
+			}
+			size_t	v = line.find_first_not_of(" \t", colon + 1);
+			fields[name] = (v == std::string::npos) ? std::string()
+				: line.substr(v);
+		}
+		keepalive = (version == "HTTP/1.1")
+			&& (fields["connection"] != "close");
+
+		// the event stream takes over the connection
+		std::string	upgrade = fields["upgrade"];
+		for (auto& c : upgrade) {
+			c = tolower(c);
+		}
+		if (upgrade == "websocket") {
+			stream(fd, target, fields["sec-websocket-key"], buffer);
+			return;
+		}
+
+		// acknowledge an expected body
+		if (fields["expect"] == "100-continue") {
+			std::string	c("HTTP/1.1 100 Continue\r\n\r\n");
+			if (write(fd, c.data(), c.size()) < 0) {
+				return;
+			}
+		}
+
+		// read the body
+		std::string	body;
+		if (fields["transfer-encoding"] == "chunked") {
+			while (1) {
+				size_t	e;
+				while (std::string::npos
+					== (e = buffer.find("\r\n"))) {
+					if (!fill(fd, buffer)) {
+						return;
+					}
+				}
+				size_t	chunk = strtoul(buffer.c_str(), NULL,
+					16);
+				buffer = buffer.substr(e + 2);
+				while (buffer.size() < chunk + 2) {
+					if (!fill(fd, buffer)) {
+						return;
+					}
+				}
+				body.append(buffer, 0, chunk);
+				buffer = buffer.substr(chunk + 2);
+				if (chunk == 0) {
+					break;
+				}
+			}
+		} else if (fields.count("content-length")) {
+			size_t	length = strtoul(
+				fields["content-length"].c_str(), NULL, 10);
+			while (buffer.size() < length) {
+				if (!fill(fd, buffer)) {
+					return;
+				}
+			}
+			body = buffer.substr(0, length);
+			buffer = buffer.substr(length);
+		}
+
+		// handle the request and send the response
+		int	status = 200;
+		std::string	content = handle(method, target, body, status);
+		std::string	reason = (status == 200) ? "OK" : "Error";
+
+		// compress larger bodies if the client accepts gzip, as the
+		// cloud does
+		bool	compressed = (content.size() >= 1024)
+			&& (std::string::npos
+				!= fields["accept-encoding"].find("gzip"));
+		if (compressed) {
+			content = gzip(content);
+		}
+		std::string	response = stringprintf("HTTP/1.1 %d %s\r\n"
+			"Content-Type: application/json\r\n"
+			"Content-Length: %lu\r\n", status, reason.c_str(),
+			(unsigned long)content.size());
+		if (compressed) {
+			response.append("Content-Encoding: gzip\r\n");
+		}
+		if (status == 429) {
+			response.append("Retry-After: 1\r\n");
+		}
+		if (!keepalive) {
+			response.append("Connection: close\r\n");
+		}
+		response.append("\r\n");
+		response.append(content);
+		const char	*d = response.data();
+		size_t	remaining = response.size();
+		while (remaining > 0) {
+			ssize_t	bytes = write(fd, d, remaining);
+			if (bytes <= 0) {
+				return;
+			}
+			d += bytes;
+			remaining -= bytes;
+		}
+	}
+}
+
+/**
+ * \brief Accept connections and start a thread for each of them
+ */
+void	mockserver::main() {
+	while (_running) {
+		struct pollfd	pfd;
+		pfd.fd = _fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 200) <= 0) {
+			continue;
+		}
+		int	fd = accept(_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		int	on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		{
+			std::unique_lock<std::mutex>	lock(_mutex);
+			_connections.insert(fd);
+		}
+		std::thread	t([this, fd]() {
+			connection(fd);
+			std::unique_lock<std::mutex>	lock(_mutex);
+			close(fd);
+			_connections.erase(fd);
+			_condition.notify_all();
+		});
+		t.detach();
+	}
+}
+
+/**
+ * \brief Create the server and start accepting connections
+ *
+ * \param options	the parameters of the simulation
+ */
+mockserver::mockserver(const mockoptions& options) : _options(options),
+	_fd(-1), _port(options.port), _running(true), _requests(0),
+	_errors(0), _window(options.accounts,
+	std::chrono::steady_clock::now()), _windowcount(options.accounts, 0) {
+	struct sockaddr_in	sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(_port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int	on = 1;
+	setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if ((bind(_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+		|| (listen(_fd, 128) < 0)) {
+		std::string	error = stringprintf("cannot listen on port "
+			"%d: %s", _port, strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		close(_fd);
+		throw shellyexception(error);
+	}
+	socklen_t	l = sizeof(sin);
+	getsockname(_fd, (struct sockaddr *)&sin, &l);
+	_port = ntohs(sin.sin_port);
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "mock cloud listening on port %d, "
+		"%d devices", _port, _options.devices);
+	_thread = std::thread(&mockserver::main, this);
+}
+
+/**
+ * \brief Stop accepting connections and wait for all connections to end
+ */
+mockserver::~mockserver() {
+	_running = false;
+	_thread.join();
+	close(_fd);
+	std::unique_lock<std::mutex>	lock(_mutex);
+	for (auto fd : _connections) {
+		shutdown(fd, SHUT_RDWR);
+	}
+	while (!_connections.empty()) {
+		_condition.wait(lock);
+	}
+}
+
+} // namespace shelly
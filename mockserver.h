@@ -0,0 +1,98 @@
+/*
+ * mockserver.h -- local stand-in for the shelly cloud
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _mockserver_h
+#define _mockserver_h
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include "json.hpp"
+
+namespace shelly {
+
+/**
+ * \brief Parameters of the simulated fleet and cloud
+ */
+class mockoptions {
+public:
+	int	port;		// TCP port, 0 for an ephemeral port
+	int	devices;	// fleet size
+	int	latency;	// response latency in milliseconds
+	double	errorrate;	// fraction of requests failing with 500
+	int	ratelimit;	// requests per second before 429, 0 = none
+	int	maxids;		// maximum number of ids per request, 0 = none
+	int	padding;	// additional payload bytes per device
+	std::string	key;	// auth_key required, empty to accept any
+	bool	lan;		// configure the devices for local polling
+	int	events;		// event stream interval in ms, 0 = none
+	int	accounts;	// cloud accounts the fleet is split into
+	mockoptions() : port(0), devices(10), latency(0), errorrate(0),
+		ratelimit(0), maxids(0), padding(0), lan(false), events(0),
+		accounts(1) { }
+};
+
+/**
+ * \brief HTTP server implementing the /v2/devices/api/get endpoint
+ *
+ * The server answers requests for a fleet of synthetic H&T devices,
+ * whose ids are generated by the id() method. The status of all devices
+ * of an account, as used by device discovery, is available at
+ * /device/all_status. It also stands in for the devices themselves, the
+ * local Shelly.GetStatus RPC of a device is available below
+ * /device/<id>. The WebSocket event stream of the cloud is available at
+ * /shelly/wss/hk_sock. The fleet can be split into several accounts
+ * with keys of their own, device i belongs to account i modulo the
+ * number of accounts, and each account has its own rate limit. Each
+ * connection is handled by a thread of its own, connections are kept
+ * alive as long as the client wants.
+ */
+class mockserver {
+	mockoptions	_options;
+	int	_fd;
+	int	_port;
+	std::atomic<bool>	_running;
+	std::thread	_thread;
+	std::atomic<unsigned long>	_requests;
+	std::atomic<unsigned long>	_errors;
+	std::mutex	_mutex;
+	std::condition_variable	_condition;
+	std::set<int>	_connections;
+	std::vector<std::chrono::steady_clock::time_point>	_window;
+	std::vector<int>	_windowcount;
+	void	main();
+	void	connection(int fd);
+	void	stream(int fd, const std::string& target,
+			const std::string& key, std::string& buffer);
+	bool	limited(int account);
+	std::string	key(int account) const;
+	int	account(const std::string& query) const;
+	std::string	handle(const std::string& method,
+			const std::string& target, const std::string& body,
+			int& status);
+	mockserver(const mockserver& other);
+	mockserver&	operator=(const mockserver& other);
+public:
+	mockserver(const mockoptions& options);
+	~mockserver();
+	int	port() const { return _port; }
+	unsigned long	requests() const { return _requests; }
+	unsigned long	errors() const { return _errors; }
+	static std::string	id(int i);
+	static int	index(const std::string& id);
+	static nlohmann::json	status(int i, time_t now, int padding = 0);
+	nlohmann::json	devices(const nlohmann::json& request);
+	nlohmann::json	allstatus(int account);
+	nlohmann::json	configuration(const std::string& host) const;
+};
+
+} // namespace shelly
+
+#endif /* _mockserver_h */
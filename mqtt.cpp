@@ -0,0 +1,421 @@
+/*
+ * mqtt.cpp -- MQTT subscriber for status published by the devices
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "mqtt.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+namespace shelly {
+
+// MQTT control packet types
+static const uint8_t	CONNECT = 0x10;
+static const uint8_t	CONNACK = 0x20;
+static const uint8_t	PUBLISH = 0x30;
+static const uint8_t	PUBACK = 0x40;
+static const uint8_t	SUBSCRIBE = 0x82;
+static const uint8_t	SUBACK = 0x90;
+static const uint8_t	PINGREQ = 0xc0;
+static const uint8_t	PINGRESP = 0xd0;
+static const uint8_t	DISCONNECT = 0xe0;
+
+/**
+ * \brief Encode a string with its two byte length prefix
+ *
+ * \param s		the string to encode
+ */
+static std::string	encode(const std::string& s) {
+	std::string	result;
+	result.push_back((char)((s.size() >> 8) & 0xff));
+	result.push_back((char)(s.size() & 0xff));
+	return result + s;
+}
+
+/**
+ * \brief Decode a two byte integer
+ *
+ * \param s		the data containing the integer
+ * \param offset	the offset of the integer in the data
+ */
+static unsigned int	decode16(const std::string& s, size_t offset) {
+	return ((unsigned char)s[offset] << 8) | (unsigned char)s[offset + 1];
+}
+
+/**
+ * \brief Create the client and start the client thread
+ *
+ * \param config	the configuration containing the mqtt section
+ * \param queue		the queue to add the received status to
+ */
+mqttclient::mqttclient(configuration_ptr config, pushqueue_ptr queue)
+	: _config(config), _queue(queue), _hostname("localhost"),
+	  _port(1883), _clientid("shellyd"), _keepalive(60), _fd(-1),
+	  _running(true) {
+	if (config->has("mqtt.hostname")) {
+		_hostname = config->stringvalue("mqtt.hostname");
+	}
+	if (config->has("mqtt.port")) {
+		_port = config->intvalue("mqtt.port");
+	}
+	if (config->has("mqtt.clientid")) {
+		_clientid = config->stringvalue("mqtt.clientid");
+	}
+	if (config->has("mqtt.username")) {
+		_username = config->stringvalue("mqtt.username");
+	}
+	if (config->has("mqtt.password")) {
+		_password = config->stringvalue("mqtt.password");
+	}
+	if (config->has("mqtt.keepalive")) {
+		_keepalive = config->intvalue("mqtt.keepalive");
+	}
+	if (config->has("mqtt.topics")) {
+		for (auto topic : config->value("mqtt.topics")) {
+			_topics.push_back(topic);
+		}
+	} else {
+		_topics.push_back("+/events/rpc");
+		_topics.push_back("+/status/+");
+	}
+	_thread = std::thread(&mqttclient::main, this);
+}
+
+/**
+ * \brief Stop the client thread
+ */
+mqttclient::~mqttclient() {
+	_running = false;
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+/**
+ * \brief Send a packet to the broker
+ *
+ * \param header	the first byte of the fixed header
+ * \param body		variable header and payload of the packet
+ */
+void	mqttclient::send(uint8_t header, const std::string& body) {
+	std::string	packet;
+	packet.push_back((char)header);
+	size_t	length = body.size();
+	do {
+		uint8_t	b = length & 0x7f;
+		length >>= 7;
+		packet.push_back((char)(b | ((length > 0) ? 0x80 : 0)));
+	} while (length > 0);
+	packet.append(body);
+	const char	*p = packet.data();
+	size_t	remaining = packet.size();
+	while (remaining > 0) {
+		ssize_t	bytes = ::send(_fd, p, remaining, MSG_NOSIGNAL);
+		if (bytes <= 0) {
+			throw shellyexception(stringprintf("cannot send to "
+				"broker: %s", strerror(errno)));
+		}
+		p += bytes;
+		remaining -= bytes;
+	}
+	_lastsent = std::chrono::steady_clock::now();
+}
+
+/**
+ * \brief Receive a packet from the broker
+ *
+ * \param header	the first byte of the fixed header
+ * \param body		variable header and payload of the packet
+ * \param timeout	time in milliseconds to wait for more data
+ * \return		false if no complete packet arrived in time
+ */
+bool	mqttclient::receive(uint8_t& header, std::string& body, int timeout) {
+	while (1) {
+		// find out whether the buffer contains a complete packet
+		size_t	length = 0;
+		size_t	offset = 1;
+		int	shift = 0;
+		bool	complete = false;
+		while ((offset < _buffer.size()) && (offset < 5)) {
+			uint8_t	b = _buffer[offset++];
+			length |= (size_t)(b & 0x7f) << shift;
+			shift += 7;
+			if (0 == (b & 0x80)) {
+				complete = true;
+				break;
+			}
+		}
+		if (complete && (_buffer.size() >= offset + length)) {
+			header = _buffer[0];
+			body = _buffer.substr(offset, length);
+			_buffer.erase(0, offset + length);
+			_lastreceived = std::chrono::steady_clock::now();
+			return true;
+		}
+		if ((!complete) && (offset >= 5)) {
+			throw shellyexception("malformed packet length");
+		}
+
+		// read more data
+		struct pollfd	pfd;
+		pfd.fd = _fd;
+		pfd.events = POLLIN;
+		int	rc = poll(&pfd, 1, timeout);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw shellyexception(stringprintf("poll failed: %s",
+				strerror(errno)));
+		}
+		if (rc == 0) {
+			return false;
+		}
+		char	data[16384];
+		ssize_t	bytes = read(_fd, data, sizeof(data));
+		if (bytes <= 0) {
+			throw shellyexception("connection closed by broker");
+		}
+		_buffer.append(data, bytes);
+	}
+}
+
+/**
+ * \brief Connect to the broker and subscribe to all topics
+ */
+void	mqttclient::connect() {
+	// open the TCP connection
+	struct addrinfo	hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo	*ai = NULL;
+	std::string	port = stringprintf("%d", _port);
+	int	rc = getaddrinfo(_hostname.c_str(), port.c_str(), &hints, &ai);
+	if (rc != 0) {
+		throw shellyexception(stringprintf("cannot resolve %s: %s",
+			_hostname.c_str(), gai_strerror(rc)));
+	}
+	for (struct addrinfo *a = ai; (NULL != a) && (_fd < 0);
+		a = a->ai_next) {
+		_fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if ((_fd >= 0)
+			&& (::connect(_fd, a->ai_addr, a->ai_addrlen) < 0)) {
+			close(_fd);
+			_fd = -1;
+		}
+	}
+	freeaddrinfo(ai);
+	if (_fd < 0) {
+		throw shellyexception(stringprintf("cannot connect to %s:%d",
+			_hostname.c_str(), _port));
+	}
+	_buffer = std::string();
+
+	// CONNECT with a clean session
+	std::string	body = encode("MQTT");
+	body.push_back(4);
+	uint8_t	flags = 0x02;
+	if (_username.size() > 0) {
+		flags |= 0x80;
+		if (_password.size() > 0) {
+			flags |= 0x40;
+		}
+	}
+	body.push_back((char)flags);
+	body.push_back((char)((_keepalive >> 8) & 0xff));
+	body.push_back((char)(_keepalive & 0xff));
+	body.append(encode(_clientid));
+	if (flags & 0x80) {
+		body.append(encode(_username));
+	}
+	if (flags & 0x40) {
+		body.append(encode(_password));
+	}
+	send(CONNECT, body);
+	uint8_t	header;
+	std::string	reply;
+	if (!receive(header, reply, 10000) || (header != CONNACK)
+		|| (reply.size() < 2)) {
+		throw shellyexception("no CONNACK from broker");
+	}
+	if (reply[1] != 0) {
+		throw shellyexception(stringprintf("connection refused by "
+			"broker: %d", reply[1]));
+	}
+
+	// SUBSCRIBE to all topics with QoS 0, the SUBACK is handled in main
+	body = std::string("\0\1", 2);
+	for (auto topic : _topics) {
+		body.append(encode(topic));
+		body.push_back(0);
+	}
+	send(SUBSCRIBE, body);
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "connected to %s:%d, %lu topics",
+		_hostname.c_str(), _port, (unsigned long)_topics.size());
+}
+
+/**
+ * \brief Disconnect from the broker
+ */
+void	mqttclient::disconnect() {
+	if (_fd < 0) {
+		return;
+	}
+	try {
+		send(DISCONNECT, std::string());
+	} catch (const std::exception& x) {
+	}
+	close(_fd);
+	_fd = -1;
+}
+
+/**
+ * \brief Handle a PUBLISH packet
+ *
+ * \param header	the first byte of the fixed header containing the QoS
+ * \param body		variable header and payload of the packet
+ */
+void	mqttclient::publish(uint8_t header, const std::string& body) {
+	int	qos = (header >> 1) & 0x03;
+	if (body.size() < 2) {
+		throw shellyexception("short PUBLISH packet");
+	}
+	size_t	topiclength = decode16(body, 0);
+	size_t	offset = 2 + topiclength + ((qos > 0) ? 2 : 0);
+	if (body.size() < offset) {
+		throw shellyexception("short PUBLISH packet");
+	}
+	std::string	topic = body.substr(2, topiclength);
+	if (qos == 1) {
+		send(PUBACK, body.substr(2 + topiclength, 2));
+	}
+	message(topic, body.substr(offset));
+}
+
+/**
+ * \brief Convert a message into a device status
+ *
+ * \param topic		the topic the message was published on
+ * \param payload	the payload of the message
+ */
+void	mqttclient::message(const std::string& topic,
+		const std::string& payload) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "message on %s", topic.c_str());
+	nlohmann::json	j;
+	try {
+		j = nlohmann::json::parse(payload);
+	} catch (const std::exception& x) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "no JSON on %s", topic.c_str());
+		return;
+	}
+	if (!j.is_object()) {
+		return;
+	}
+
+	std::string	source;
+	nlohmann::json	status;
+	size_t	p = topic.find("/status/");
+	if (j.contains("src") && j.contains("method")
+		&& j.contains("params")) {
+		// RPC notification on <prefix>/events/rpc
+		if (!j["src"].is_string() || !j["method"].is_string()
+			|| !j["params"].is_object()) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "bad notification on %s",
+				topic.c_str());
+			return;
+		}
+		std::string	method = j["method"];
+		if ((method != "NotifyStatus")
+			&& (method != "NotifyFullStatus")) {
+			return;
+		}
+		source = j["src"];
+		status = j["params"];
+	} else if (p != std::string::npos) {
+		// status of a single component on <prefix>/status/<component>
+		source = topic.substr(0, p);
+		status[topic.substr(p + 8)] = j;
+	} else {
+		return;
+	}
+
+	std::string	id = _queue->deviceid(source);
+	if (id.size() == 0) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "status of unknown device %s",
+			source.c_str());
+		return;
+	}
+	_queue->push(id, status);
+}
+
+/**
+ * \brief Main function of the client thread
+ */
+void	mqttclient::main() {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "mqtt client started");
+	while (_running) {
+		try {
+			connect();
+			while (_running) {
+				uint8_t	header;
+				std::string	body;
+				if (receive(header, body, 1000)) {
+					switch (header & 0xf0) {
+					case PUBLISH:
+						publish(header, body);
+						break;
+					case SUBACK:
+						if (body.find((char)0x80, 2)
+							!= std::string::npos) {
+							debug(LOG_ERR,
+								DEBUG_LOG, 0,
+								"subscription "
+								"refused");
+						}
+						break;
+					case PINGRESP:
+						break;
+					}
+				}
+
+				// keep the connection alive
+				if (_keepalive <= 0) {
+					continue;
+				}
+				std::chrono::steady_clock::time_point	now
+					= std::chrono::steady_clock::now();
+				if (now - _lastsent >= std::chrono::seconds(
+					_keepalive / 2)) {
+					send(PINGREQ, std::string());
+				}
+				if (now - _lastreceived > std::chrono::seconds(
+					2 * _keepalive)) {
+					throw shellyexception("broker does not "
+						"respond");
+				}
+			}
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "mqtt: %s", x.what());
+		}
+		disconnect();
+
+		// status published meanwhile is lost, poll until it arrives
+		_queue->invalidate();
+
+		// wait a few seconds before reconnecting
+		for (int i = 0; (i < 5) && _running; i++) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "mqtt client terminated");
+}
+
+} // namespace shelly
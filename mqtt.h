@@ -0,0 +1,62 @@
+/*
+ * mqtt.h -- MQTT subscriber for status published by the devices
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _mqtt_h
+#define _mqtt_h
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <thread>
+#include "configuration.h"
+#include "pushqueue.h"
+
+namespace shelly {
+
+/**
+ * \brief Minimal MQTT 3.1.1 client subscribing to device status topics
+ *
+ * The client runs in a thread of its own, subscribes to the configured
+ * topic filters with QoS 0 and converts the Gen2 NotifyStatus and
+ * NotifyFullStatus notifications published on <prefix>/events/rpc as
+ * well as the component status published on <prefix>/status/<component>
+ * into device status for the push queue. Lost connections to the broker
+ * are reestablished automatically.
+ */
+class mqttclient {
+	configuration_ptr	_config;
+	pushqueue_ptr	_queue;
+	std::string	_hostname;
+	int	_port;
+	std::string	_clientid;
+	std::string	_username;
+	std::string	_password;
+	std::list<std::string>	_topics;
+	int	_keepalive;
+	int	_fd;
+	std::string	_buffer;
+	std::chrono::steady_clock::time_point	_lastsent;
+	std::chrono::steady_clock::time_point	_lastreceived;
+	std::atomic<bool>	_running;
+	std::thread	_thread;
+	void	main();
+	void	connect();
+	void	disconnect();
+	void	send(uint8_t header, const std::string& body);
+	bool	receive(uint8_t& header, std::string& body, int timeout);
+	void	publish(uint8_t header, const std::string& body);
+	void	message(const std::string& topic, const std::string& payload);
+	mqttclient(const mqttclient& other);
+	mqttclient&	operator=(const mqttclient& other);
+public:
+	mqttclient(configuration_ptr config, pushqueue_ptr queue);
+	~mqttclient();
+};
+
+} // namespace shelly
+
+#endif /* _mqtt_h */
@@ -0,0 +1,312 @@
+/*
+ * partition.cpp -- management of the time partitions of the readings table
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "partition.h"
+#include "schema.h"
+#include "metrics.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <chrono>
+#include <cstdlib>
+
+namespace shelly {
+
+/**
+ * \brief Create the partition manager and start its thread
+ *
+ * \param config	the configuration containing the partitions section
+ */
+partitioner::partitioner(configuration_ptr config) : _config(config),
+	_table(schema(config).table), _daily(false), _ahead(3),
+	_retention(0), _interval(3600), _mysql(NULL), _running(true) {
+	if (_config->has("partitions.table")) {
+		_table = _config->stringvalue("partitions.table");
+	}
+	if (_config->has("partitions.archive")) {
+		_archive = _config->stringvalue("partitions.archive");
+	}
+	if (_config->has("partitions.interval")) {
+		std::string	interval
+			= _config->stringvalue("partitions.interval");
+		if (interval == "day") {
+			_daily = true;
+		} else if (interval != "month") {
+			throw shellyexception(stringprintf("unknown partition "
+				"interval %s", interval.c_str()));
+		}
+	}
+	if (_config->has("partitions.ahead")) {
+		_ahead = _config->intvalue("partitions.ahead");
+	}
+	if (_config->has("partitions.retention")) {
+		_retention = _config->intvalue("partitions.retention");
+	}
+	if (_config->has("partitions.check")) {
+		_interval = _config->intvalue("partitions.check");
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "managing %s partitions of %s, "
+		"%d ahead, retention %d", (_daily) ? "daily" : "monthly",
+		_table.c_str(), _ahead, _retention);
+	_thread = std::thread(&partitioner::main, this);
+}
+
+/**
+ * \brief Stop the thread
+ */
+partitioner::~partitioner() {
+	_running = false;
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	disconnect();
+}
+
+/**
+ * \brief Start of the interval n intervals after the one containing t
+ *
+ * Intervals are days or months in UTC, like the timekeys.
+ *
+ * \param t		the time
+ * \param n		the number of intervals to move, may be negative
+ */
+time_t	partitioner::shift(time_t t, int n) const {
+	if (_daily) {
+		return (t - (t % 86400)) + n * 86400;
+	}
+	struct tm	tm;
+	gmtime_r(&t, &tm);
+	tm.tm_mday = 1;
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_mon += n;
+	return timegm(&tm);
+}
+
+/**
+ * \brief Name of the partition for the interval starting at t
+ *
+ * \param t		start of the interval
+ */
+std::string	partitioner::name(time_t t) const {
+	struct tm	tm;
+	gmtime_r(&t, &tm);
+	char	buffer[16];
+	strftime(buffer, sizeof(buffer), (_daily) ? "p%Y%m%d" : "p%Y%m", &tm);
+	return std::string(buffer);
+}
+
+/**
+ * \brief Connect to the database
+ */
+bool	partitioner::connect() {
+	if (NULL != _mysql) {
+		return true;
+	}
+	_mysql = mysql_init(NULL);
+	if (NULL == _mysql) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot create mysql");
+		return false;
+	}
+	std::string	hostname = _config->stringvalue("database.hostname");
+	std::string	username = _config->stringvalue("database.username");
+	std::string	password = _config->stringvalue("database.password");
+	std::string	dbname = _config->stringvalue("database.dbname");
+	int	port = _config->intvalue("database.port");
+	if (NULL == mysql_real_connect(_mysql, hostname.c_str(),
+		username.c_str(), password.c_str(), dbname.c_str(),
+		port, NULL, 0)) {
+		debug(LOG_ERR, DEBUG_LOG, 0,
+			"cannot connect to the database: %s",
+			mysql_error(_mysql));
+		disconnect();
+		return false;
+	}
+	metrics::connects++;
+	return true;
+}
+
+/**
+ * \brief Close the connection
+ */
+void	partitioner::disconnect() {
+	if (NULL != _mysql) {
+		mysql_close(_mysql);
+		_mysql = NULL;
+	}
+}
+
+/**
+ * \brief Execute a statement that does not return a result
+ *
+ * In dryrun mode, the statement is only logged.
+ *
+ * \param query		the statement
+ */
+void	partitioner::execute(const std::string& query) {
+	if (dryrun) {
+		debug(LOG_INFO, DEBUG_LOG, 0, "dryrun: not executing '%s'",
+			query.c_str());
+		return;
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "executing '%s'", query.c_str());
+	if (mysql_real_query(_mysql, query.data(), query.size())) {
+		std::string	error = stringprintf("cannot execute '%s': %s",
+			query.c_str(), mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		throw shellyexception(error);
+	}
+}
+
+/**
+ * \brief Read the partitions of the table in the order of their bounds
+ */
+std::vector<partitioner::partition>	partitioner::partitions() {
+	std::vector<partition>	result;
+	std::string	query = stringprintf("select partition_name, "
+		"partition_description from information_schema.partitions "
+		"where table_schema = database() and table_name = '%s' "
+		"and partition_name is not null "
+		"order by partition_ordinal_position", _table.c_str());
+	if (mysql_real_query(_mysql, query.data(), query.size())) {
+		std::string	error = stringprintf("cannot read "
+			"partitions of %s: %s", _table.c_str(),
+			mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		throw shellyexception(error);
+	}
+	MYSQL_RES	*res = mysql_store_result(_mysql);
+	if (NULL == res) {
+		throw shellyexception(stringprintf("no partitions of %s: %s",
+			_table.c_str(), mysql_error(_mysql)));
+	}
+	MYSQL_ROW	row;
+	while (NULL != (row = mysql_fetch_row(res))) {
+		partition	p;
+		p.name = (row[0]) ? row[0] : "";
+		std::string	description = (row[1]) ? row[1] : "";
+		p.maxvalue = (description == "MAXVALUE");
+		p.bound = (p.maxvalue) ? 0 : strtoll(description.c_str(),
+			NULL, 10);
+		result.push_back(p);
+	}
+	mysql_free_result(res);
+	return result;
+}
+
+/**
+ * \brief Create the partitions up to ahead intervals after now
+ *
+ * \param p		the current partitions
+ * \param now		the current time
+ */
+void	partitioner::create(const std::vector<partition>& p, time_t now) {
+	const partition	*last = NULL;
+	const partition	*maxvalue = NULL;
+	for (auto& q : p) {
+		if (q.maxvalue) {
+			maxvalue = &q;
+		} else {
+			last = &q;
+		}
+	}
+	time_t	start = (last) ? last->bound : shift(now, 0);
+	time_t	target = shift(now, _ahead + 1);
+	std::string	maxname = (maxvalue) ? maxvalue->name : "";
+	while (start < target) {
+		time_t	bound = shift(start, 1);
+		std::string	pname = name(start);
+		std::string	definition = stringprintf("partition %s values "
+			"less than (%lld)", pname.c_str(), (long long)bound);
+		if (maxname.size() > 0) {
+			execute(stringprintf("alter table %s reorganize "
+				"partition %s into (%s, partition %s values "
+				"less than maxvalue)", _table.c_str(),
+				maxname.c_str(), definition.c_str(),
+				maxname.c_str()));
+		} else {
+			execute(stringprintf("alter table %s add partition "
+				"(%s)", _table.c_str(), definition.c_str()));
+		}
+		debug(LOG_INFO, DEBUG_LOG, 0, "partition %s of %s created",
+			pname.c_str(), _table.c_str());
+		metrics::partitionsadded++;
+		start = bound;
+	}
+}
+
+/**
+ * \brief Drop the partitions holding data older than the retention
+ *
+ * The partition holding the oldest data that must be kept, and all
+ * later ones, are never touched. If an archive table is configured,
+ * a partition is only dropped after its rows have been copied.
+ *
+ * \param p		the current partitions
+ * \param now		the current time
+ */
+void	partitioner::expire(std::vector<partition>& p, time_t now) {
+	if (_retention <= 0) {
+		return;
+	}
+	time_t	cutoff = shift(now, -_retention);
+	for (size_t i = 0; i + 1 < p.size(); i++) {
+		if (p[i].maxvalue || (p[i].bound > cutoff)) {
+			break;
+		}
+		if (_archive.size() > 0) {
+			execute(stringprintf("insert ignore into %s select * "
+				"from %s partition (%s)", _archive.c_str(),
+				_table.c_str(), p[i].name.c_str()));
+		}
+		execute(stringprintf("alter table %s drop partition %s",
+			_table.c_str(), p[i].name.c_str()));
+		debug(LOG_INFO, DEBUG_LOG, 0, "partition %s of %s %s",
+			p[i].name.c_str(), _table.c_str(),
+			(_archive.size() > 0) ? "archived" : "dropped");
+		metrics::partitionsdropped++;
+	}
+}
+
+/**
+ * \brief Bring the partitions of the table up to date
+ */
+void	partitioner::check() {
+	if (!connect()) {
+		return;
+	}
+	try {
+		std::vector<partition>	p = partitions();
+		if (p.size() == 0) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s is not partitioned by "
+				"timekey", _table.c_str());
+			return;
+		}
+		time_t	now = time(NULL);
+		create(p, now);
+		expire(p, now);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "partition check failed: %s",
+			x.what());
+		// the connection may be broken, reconnect next time
+		disconnect();
+	}
+}
+
+/**
+ * \brief Main function of the partition thread
+ *
+ * The partitions are checked right away and then every check seconds.
+ */
+void	partitioner::main() {
+	while (_running) {
+		check();
+		for (int i = 0; (i < _interval) && _running; i++) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "partition manager terminated");
+}
+
+} // namespace shelly
@@ -0,0 +1,70 @@
+/*
+ * partition.h -- management of the time partitions of the readings table
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _partition_h
+#define _partition_h
+
+#include <mysql.h>
+#include <atomic>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+#include "configuration.h"
+
+namespace shelly {
+
+/**
+ * \brief Thread maintaining the range partitions on timekey
+ *
+ * The table the readings are inserted into can be partitioned by range
+ * on timekey, one partition per day or month. Inserts then only touch
+ * the indexes of the newest partition, which stay small and in the
+ * buffer pool. The thread checks the partitions periodically on a
+ * connection of its own. It creates the partitions for the next few
+ * intervals ahead of time, so an insert never has to wait for one. If
+ * a retention is configured, partitions holding only older data are
+ * dropped, after copying their rows to an archive table if one is
+ * named. Partitions are named p followed by the start of the interval
+ * they hold. A catch-all partition for MAXVALUE is split instead of
+ * adding partitions after it. Partitioning the table initially is left
+ * to the operator.
+ */
+class partitioner {
+	typedef struct {
+		std::string	name;
+		bool	maxvalue;
+		time_t	bound;
+	} partition;
+	configuration_ptr	_config;
+	std::string	_table;
+	std::string	_archive;
+	bool	_daily;
+	int	_ahead;
+	int	_retention;
+	int	_interval;
+	MYSQL	*_mysql;
+	std::atomic<bool>	_running;
+	std::thread	_thread;
+	time_t	shift(time_t t, int n) const;
+	std::string	name(time_t t) const;
+	bool	connect();
+	void	disconnect();
+	void	execute(const std::string& query);
+	std::vector<partition>	partitions();
+	void	create(const std::vector<partition>& p, time_t now);
+	void	expire(std::vector<partition>& p, time_t now);
+	void	check();
+	void	main();
+	partitioner(const partitioner& other);
+	partitioner&	operator=(const partitioner& other);
+public:
+	partitioner(configuration_ptr config);
+	~partitioner();
+};
+
+} // namespace shelly
+
+#endif /* _partition_h */
@@ -0,0 +1,211 @@
+/*
+ * provision.cpp -- create the station and sensor rows of configured devices
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "provision.h"
+#include "statistics.h"
+#include "metrics.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+
+namespace shelly {
+
+/**
+ * \brief Connect to the database
+ *
+ * \param config	the configuration with the devices to provision
+ */
+provisioner::provisioner(configuration_ptr config) : database(config) {
+}
+
+/**
+ * \brief The additional columns configured for new rows of a table
+ *
+ * \param table		the table, station or sensor
+ * \param values	receives the values of the columns
+ * \return		the column names, each preceded by a comma
+ */
+std::string	provisioner::columns(const std::string& table,
+		std::string& values) {
+	std::string	names;
+	values.clear();
+	std::string	path = "provision." + table;
+	if (!_config->has(path)) {
+		return names;
+	}
+	nlohmann::json	defaults = _config->value(path);
+	for (auto c = defaults.begin(); c != defaults.end(); c++) {
+		if (c.key().find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_")
+			!= std::string::npos) {
+			throw shellyexception(stringprintf("bad column name %s",
+				c.key().c_str()));
+		}
+		names += ", " + c.key();
+		values += ", " + ((c.value().is_string())
+			? quote(mysql, c.value().get<std::string>())
+			: c.value().dump());
+	}
+	return names;
+}
+
+/**
+ * \brief Execute a statement and hand the rows of the result to row
+ *
+ * \param sql		the statement
+ * \param row		called for each row of the result, if any
+ */
+void	provisioner::query(const std::string& sql,
+		std::function<void(MYSQL_ROW)> row) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "executing '%s'", sql.c_str());
+	if (mysql_real_query(mysql, sql.data(), sql.size())) {
+		std::string	error = stringprintf("'%s' failed: %s",
+			sql.c_str(), mysql_error(mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		throw shellyexception(error);
+	}
+	MYSQL_RES	*res = mysql_store_result(mysql);
+	if (NULL == res) {
+		return;
+	}
+	MYSQL_ROW	r;
+	while (NULL != (r = mysql_fetch_row(res))) {
+		if (row) {
+			row(r);
+		}
+	}
+	mysql_free_result(res);
+}
+
+/**
+ * \brief Find the sensor ids of a set of station/sensor pairs
+ *
+ * \param pairs		the pairs to look up
+ * \return		the ids of the pairs found
+ */
+std::map<database::sensorkey, int>	provisioner::lookup(
+		const std::set<sensorkey>& pairs) {
+	stopwatch	watch(statistics::sensorid);
+	std::map<sensorkey, int>	result;
+	std::string	sql = sensorquery(mysql, pairs);
+	if (sql.size() == 0) {
+		return result;
+	}
+	query(sql, [&](MYSQL_ROW row) {
+		result[sensorkey(row[0], row[1])] = std::stoi(row[2]);
+	});
+	return result;
+}
+
+/**
+ * \brief Create the missing stations and sensors in one transaction
+ *
+ * \param missing	the pairs not found in the database
+ */
+void	provisioner::create(const std::set<sensorkey>& missing) {
+	std::set<std::string>	names;
+	for (auto& p : missing) {
+		names.insert(p.first);
+	}
+	std::string	list;
+	for (auto& n : names) {
+		list += (list.size() ? "," : "") + quote(mysql, n);
+	}
+	std::string	stationvalues;
+	std::string	stationcolumns = columns("station", stationvalues);
+	std::string	sensorvalues;
+	std::string	sensorcolumns = columns("sensor", sensorvalues);
+
+	mysql_autocommit(mysql, 0);
+	try {
+		// stations that do not exist yet
+		std::map<std::string, int>	stations;
+		auto	collect = [&](MYSQL_ROW row) {
+			stations[row[1]] = std::stoi(row[0]);
+		};
+		std::string	select = "select id, name from station "
+			"where name in (" + list + ")";
+		query(select, collect);
+		std::string	rows;
+		for (auto& n : names) {
+			if (stations.count(n) == 0) {
+				rows += (rows.size() ? ",(" : "(")
+					+ quote(mysql, n) + stationvalues + ")";
+				debug(LOG_INFO, DEBUG_LOG, 0, "creating "
+					"station %s", n.c_str());
+			}
+		}
+		if (rows.size() > 0) {
+			query("insert into station(name" + stationcolumns
+				+ ") values " + rows);
+			query(select, collect);
+		}
+
+		// sensors of the missing pairs
+		rows.clear();
+		for (auto& p : missing) {
+			rows += stringprintf("%s(%s,%d%s)",
+				(rows.size() ? "," : ""),
+				quote(mysql, p.second).c_str(),
+				stations.at(p.first), sensorvalues.c_str());
+			debug(LOG_INFO, DEBUG_LOG, 0, "creating sensor %s/%s",
+				p.first.c_str(), p.second.c_str());
+		}
+		query("insert into sensor(name, stationid" + sensorcolumns
+			+ ") values " + rows);
+		if (mysql_commit(mysql)) {
+			throw shellyexception(stringprintf("cannot commit: %s",
+				mysql_error(mysql)));
+		}
+	} catch (const std::exception& x) {
+		mysql_rollback(mysql);
+		mysql_autocommit(mysql, 1);
+		throw;
+	}
+	mysql_autocommit(mysql, 1);
+	metrics::provisioned += missing.size();
+}
+
+/**
+ * \brief Resolve the sensor ids of all devices of the configuration
+ *
+ * In dryrun mode, missing rows are only reported.
+ */
+void	provisioner::run() {
+	std::set<sensorkey>	pairs;
+	if (_config->has("devices")) {
+		for (auto device : _config->value("devices")) {
+			pairs.insert(sensorkey(device["station"],
+				device["sensor"]));
+		}
+	}
+	std::map<sensorkey, int>	found = lookup(pairs);
+	std::set<sensorkey>	missing;
+	for (auto& p : pairs) {
+		if (found.count(p) == 0) {
+			missing.insert(p);
+		}
+	}
+	if (missing.size() > 0) {
+		if (dryrun) {
+			for (auto& p : missing) {
+				debug(LOG_INFO, DEBUG_LOG, 0, "dryrun: not "
+					"creating sensor %s/%s",
+					p.first.c_str(), p.second.c_str());
+			}
+		} else {
+			create(missing);
+			found = lookup(pairs);
+		}
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "%lu of %lu sensors resolved, %lu "
+		"created", (unsigned long)found.size(),
+		(unsigned long)pairs.size(),
+		(unsigned long)((dryrun) ? 0 : missing.size()));
+	std::unique_lock<std::mutex>	lock(_sensorlock);
+	_knownsensors = found;
+}
+
+} // namespace shelly
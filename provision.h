@@ -0,0 +1,44 @@
+/*
+ * provision.h -- create the station and sensor rows of configured devices
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _provision_h
+#define _provision_h
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include "database.h"
+
+namespace shelly {
+
+/**
+ * \brief Resolve the sensor ids of all configured devices at once
+ *
+ * A device whose station/sensor pair is missing in the database would
+ * fail its sensor id lookup in every cycle and its data would be lost.
+ * The provisioner looks up the pairs of all configured devices with a
+ * single query and creates the missing station and sensor rows in one
+ * transaction, so a new device is stored from its first cycle on. The
+ * ids found go to the cache of known sensors of the database class,
+ * which is replaced as a whole, so that the cycles never look them up
+ * again. Columns of the new rows other than the names can be given in
+ * the provision section of the configuration.
+ */
+class provisioner : public database {
+	std::string	columns(const std::string& table, std::string& values);
+	void	query(const std::string& sql,
+			std::function<void(MYSQL_ROW)> row = nullptr);
+	std::map<sensorkey, int>	lookup(
+					const std::set<sensorkey>& pairs);
+	void	create(const std::set<sensorkey>& missing);
+public:
+	provisioner(configuration_ptr config);
+	void	run();
+};
+
+} // namespace shelly
+
+#endif /* _provision_h */
@@ -0,0 +1,130 @@
+/*
+ * pushqueue.cpp -- queue of device status pushed by the devices
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "pushqueue.h"
+#include "metrics.h"
+#include "debug.h"
+#include <algorithm>
+
+namespace shelly {
+
+/**
+ * \brief Create an empty queue
+ *
+ * \param config	the configuration containing the devices
+ */
+pushqueue::pushqueue(configuration_ptr config) : _config(config),
+	_topics(config->topics()), _items(nlohmann::json::array()),
+	_invalid(false) {
+}
+
+/**
+ * \brief Use a new configuration snapshot to identify devices
+ *
+ * \param config	the new configuration
+ */
+void	pushqueue::configure(configuration_ptr config) {
+	std::map<std::string, std::string>	topics = config->topics();
+	std::unique_lock<std::mutex>	lock(_mutex);
+	_config = config;
+	std::swap(_topics, topics);
+}
+
+/**
+ * \brief Find the configured device id for a source name
+ *
+ * Devices identify themselves with names like shellyhtg3-<mac>, while
+ * the configuration uses the id of the cloud, which is the mac address.
+ * A device can also be identified by the topic prefix configured for it.
+ *
+ * \param source	the id or source name sent by the device
+ * \return		the device id, or an empty string if unknown
+ */
+std::string	pushqueue::deviceid(const std::string& source) const {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	auto	t = _topics.find(source);
+	if (t != _topics.end()) {
+		return t->second;
+	}
+	std::list<std::string>	candidates;
+	candidates.push_back(source);
+	size_t	p = source.rfind('-');
+	if (p != std::string::npos) {
+		std::string	mac = source.substr(p + 1);
+		std::transform(mac.begin(), mac.end(), mac.begin(), ::tolower);
+		candidates.push_back(mac);
+	}
+	for (auto id : candidates) {
+		try {
+			_config->device(id);
+			return id;
+		} catch (const std::exception& x) {
+		}
+	}
+	return std::string();
+}
+
+/**
+ * \brief Merge a status into the known status of a device and queue it
+ *
+ * Notifications may only contain the components that changed, so the
+ * device is only queued once temperature and humidity are known. The
+ * battery is optional, devices like the first generation H&T do not
+ * report the voltage, and the last value received is used until a new
+ * one arrives. Only the most recent status of each device is kept in
+ * the queue.
+ *
+ * \param id		the configured id of the device
+ * \param status	the (partial) status of the device
+ * \return		whether the device was queued
+ */
+bool	pushqueue::push(const std::string& id, const nlohmann::json& status) {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	nlohmann::json&	merged = _status[id];
+	merged.merge_patch(status);
+	static const char	*required[2][2] = {
+		{ "temperature:0", "tC" },
+		{ "humidity:0", "rh" }
+	};
+	for (int i = 0; i < 2; i++) {
+		const nlohmann::json	*j = &merged;
+		for (int k = 0; (k < 2) && (NULL != j); k++) {
+			j = (j->is_object() && j->contains(required[i][k]))
+				? &(*j)[required[i][k]] : NULL;
+		}
+		if ((NULL == j) || !j->is_number()) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "status of %s "
+				"incomplete", id.c_str());
+			return false;
+		}
+	}
+	nlohmann::json	item;
+	item["id"] = id;
+	item["status"] = merged;
+	for (auto i = _items.begin(); i != _items.end(); i++) {
+		if ((*i)["id"] == id) {
+			_items.erase(i);
+			break;
+		}
+	}
+	_items.push_back(item);
+	metrics::pushes++;
+	metrics::queuedepth[metrics::pushed] = _items.size();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "status of %s queued", id.c_str());
+	return true;
+}
+
+/**
+ * \brief Get all items received since the last call
+ */
+nlohmann::json	pushqueue::receive() {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	nlohmann::json	result = nlohmann::json::array();
+	std::swap(result, _items);
+	metrics::queuedepth[metrics::pushed] = 0;
+	return result;
+}
+
+} // namespace shelly
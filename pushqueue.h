@@ -0,0 +1,53 @@
+/*
+ * pushqueue.h -- queue of device status pushed by the devices
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _pushqueue_h
+#define _pushqueue_h
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <json.hpp>
+#include "configuration.h"
+
+namespace shelly {
+
+/**
+ * \brief Queue between the receivers of pushed data and the loop
+ *
+ * Receivers like the webhook server or the MQTT client run in threads
+ * of their own and add the (possibly partial) status of a device. The
+ * queue merges partial status updates, and once all values needed are
+ * known, it queues an item of the same form as the items returned by
+ * the cloud, i.e. an object with the device id and its status, until
+ * the loop picks it up with receive(). A receiver that may have missed
+ * data invalidates the queue, the loop then polls all devices again.
+ */
+class pushqueue {
+	configuration_ptr	_config;
+	std::map<std::string, std::string>	_topics;
+	mutable std::mutex	_mutex;
+	nlohmann::json	_items;
+	std::map<std::string, nlohmann::json>	_status;
+	std::atomic<bool>	_invalid;
+	pushqueue(const pushqueue& other);
+	pushqueue&	operator=(const pushqueue& other);
+public:
+	pushqueue(configuration_ptr config);
+	void	configure(configuration_ptr config);
+	std::string	deviceid(const std::string& source) const;
+	bool	push(const std::string& id, const nlohmann::json& status);
+	nlohmann::json	receive();
+	void	invalidate() { _invalid = true; }
+	bool	invalidated() { return _invalid.exchange(false); }
+};
+
+typedef std::shared_ptr<pushqueue>	pushqueue_ptr;
+
+} // namespace shelly
+
+#endif /* _pushqueue_h */
@@ -0,0 +1,113 @@
+/*
+ * ratelimit.cpp -- client side rate limiting of cloud requests
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "ratelimit.h"
+
+namespace shelly {
+
+/**
+ * \brief Create a full bucket
+ *
+ * \param rate		the sustained rate in requests per second, a rate
+ *			of 0 or less disables the limiter
+ * \param burst		the number of requests that may be sent at once
+ */
+tokenbucket::tokenbucket(double rate, double burst) : _rate(rate),
+	_burst((burst < 1.) ? 1. : burst), _tokens(_burst) {
+}
+
+std::mutex	tokenbucket::_bucketslock;
+std::map<std::string, tokenbucket_ptr>	tokenbucket::_buckets;
+
+/**
+ * \brief Get the bucket of an account
+ *
+ * The bucket is created on first use. If the limits of the account
+ * have changed, it is replaced by a full bucket with the new limits.
+ *
+ * \param account	the key identifying the account
+ * \param rate		the sustained rate in requests per second
+ * \param burst		the number of requests that may be sent at once
+ */
+tokenbucket_ptr	tokenbucket::shared(const std::string& account, double rate,
+		double burst) {
+	std::unique_lock<std::mutex>	lock(_bucketslock);
+	tokenbucket_ptr&	b = _buckets[account];
+	if (!b || (b->_rate != rate)
+		|| (b->_burst != ((burst < 1.) ? 1. : burst))) {
+		b = tokenbucket_ptr(new tokenbucket(rate, burst));
+	}
+	return b;
+}
+
+/**
+ * \brief Take a token from the bucket
+ *
+ * If the bucket is empty, the token is taken in advance, so that the
+ * next caller has to wait correspondingly longer.
+ *
+ * \param now		the current time
+ * \return		the time when the request may be sent
+ */
+clocksource::time_point	tokenbucket::acquire(
+		const clocksource::time_point& now) {
+	if (_rate <= 0) {
+		return now;
+	}
+	std::unique_lock<std::mutex>	lock(_mutex);
+	clocksource::time_point	start = (now < _hold) ? _hold : now;
+	if (start > _last) {
+		std::chrono::duration<double>	elapsed = start - _last;
+		_tokens += elapsed.count() * _rate;
+		if (_tokens > _burst) {
+			_tokens = _burst;
+		}
+		_last = start;
+	}
+	_tokens -= 1.;
+	if (_tokens >= 0) {
+		return start;
+	}
+	std::chrono::duration<double>	wait(-_tokens / _rate);
+	return start + std::chrono::duration_cast<
+		clocksource::time_point::duration>(wait);
+}
+
+/**
+ * \brief Return a token taken for a request that is not sent
+ *
+ * A request that is given up before it is started must not delay the
+ * requests after it.
+ */
+void	tokenbucket::refund() {
+	if (_rate <= 0) {
+		return;
+	}
+	std::unique_lock<std::mutex>	lock(_mutex);
+	_tokens += 1.;
+	if (_tokens > _burst) {
+		_tokens = _burst;
+	}
+}
+
+/**
+ * \brief Hold the bucket empty until some time
+ *
+ * Used when the server answers with Retry-After, after that time the
+ * requests start again with a single token.
+ *
+ * \param until		the time when requests may be sent again
+ */
+void	tokenbucket::hold(const clocksource::time_point& until) {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	if (until <= _hold) {
+		return;
+	}
+	_hold = until;
+	_last = until;
+	_tokens = 1.;
+}
+
+} // namespace shelly
@@ -0,0 +1,58 @@
+/*
+ * ratelimit.h -- client side rate limiting of cloud requests
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _ratelimit_h
+#define _ratelimit_h
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "clock.h"
+
+namespace shelly {
+
+/**
+ * \brief Token bucket limiting the rate of requests to the cloud
+ *
+ * The bucket holds at most burst tokens and is refilled at rate tokens
+ * per second, each request consumes one token. Requests are never
+ * refused, instead acquire() tells when the request may be sent. A
+ * server asking the client to back off can hold the bucket empty until
+ * a point in time. Time is taken from the clock of the loop, so that
+ * the limiter also works with a simulated clock.
+ *
+ * The limit applies to a cloud account, so all requests to an account
+ * share a bucket, obtained with shared(), even if they come from other
+ * threads like device discovery or from the endpoints of an earlier
+ * configuration snapshot.
+ */
+class tokenbucket {
+	double	_rate;
+	double	_burst;
+	double	_tokens;
+	clocksource::time_point	_last;
+	clocksource::time_point	_hold;
+	std::mutex	_mutex;
+	static std::mutex	_bucketslock;
+	static std::map<std::string, std::shared_ptr<tokenbucket> >
+		_buckets;
+	tokenbucket(const tokenbucket& other);
+	tokenbucket&	operator=(const tokenbucket& other);
+public:
+	tokenbucket(double rate, double burst = 1.);
+	static std::shared_ptr<tokenbucket>	shared(
+				const std::string& account, double rate,
+				double burst);
+	clocksource::time_point	acquire(const clocksource::time_point& now);
+	void	refund();
+	void	hold(const clocksource::time_point& until);
+};
+
+typedef std::shared_ptr<tokenbucket>	tokenbucket_ptr;
+
+} // namespace shelly
+
+#endif /* _ratelimit_h */
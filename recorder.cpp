@@ -0,0 +1,122 @@
+/*
+ * recorder.cpp -- record raw cloud responses for later replay
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "recorder.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <zlib.h>
+
+namespace shelly {
+
+/**
+ * \brief create a recorder for a directory
+ *
+ * \param directory	the directory containing the recorded responses
+ */
+recorder::recorder(const std::string& directory) : _directory(directory) {
+}
+
+/**
+ * \brief Store a response
+ *
+ * \param timekey	the timekey of the cycle
+ * \param chunk		the number of the chunk within the cycle
+ * \param response	the raw response received from the cloud
+ */
+void	recorder::record(time_t timekey, int chunk,
+		const std::string& response) {
+	std::string	filename = stringprintf("%s/%ld-%04d.json.gz",
+		_directory.c_str(), (long)timekey, chunk);
+	gzFile	gz = gzopen(filename.c_str(), "wb");
+	if (NULL == gz) {
+		std::string	error = stringprintf("cannot create %s: %s",
+			filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		throw shellyexception(error);
+	}
+	int	bytes = gzwrite(gz, response.data(), response.size());
+	int	rc = gzclose(gz);
+	if ((bytes != (int)response.size()) || (rc != Z_OK)) {
+		std::string	error = stringprintf("cannot write %s",
+			filename.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		throw shellyexception(error);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "recorded %lu bytes to %s",
+		(unsigned long)response.size(), filename.c_str());
+}
+
+/**
+ * \brief List all recorded responses in chronological order
+ */
+std::list<recorder::entry>	recorder::entries() const {
+	std::list<entry>	result;
+	DIR	*dir = opendir(_directory.c_str());
+	if (NULL == dir) {
+		std::string	error = stringprintf("cannot open %s: %s",
+			_directory.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		throw shellyexception(error);
+	}
+	struct dirent	*d;
+	while (NULL != (d = readdir(dir))) {
+		std::string	name(d->d_name);
+		size_t	l = name.size();
+		if ((l < 8) || (name.substr(l - 8) != ".json.gz")) {
+			continue;
+		}
+		char	*end = NULL;
+		entry	e;
+		e.timekey = strtol(name.c_str(), &end, 10);
+		if (*end != '-') {
+			continue;
+		}
+		e.chunk = strtol(end + 1, NULL, 10);
+		e.filename = _directory + "/" + name;
+		result.push_back(e);
+	}
+	closedir(dir);
+	result.sort([](const entry& a, const entry& b) {
+		return (a.timekey < b.timekey) || ((a.timekey == b.timekey)
+			&& (a.chunk < b.chunk));
+	});
+	return result;
+}
+
+/**
+ * \brief Read a recorded response
+ *
+ * \param e		the entry to read
+ */
+std::string	recorder::read(const entry& e) const {
+	gzFile	gz = gzopen(e.filename.c_str(), "rb");
+	if (NULL == gz) {
+		std::string	error = stringprintf("cannot open %s: %s",
+			e.filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		throw shellyexception(error);
+	}
+	std::string	result;
+	char	buffer[65536];
+	int	bytes;
+	while ((bytes = gzread(gz, buffer, sizeof(buffer))) > 0) {
+		result.append(buffer, bytes);
+	}
+	gzclose(gz);
+	if (bytes < 0) {
+		std::string	error = stringprintf("cannot decompress %s",
+			e.filename.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		throw shellyexception(error);
+	}
+	return result;
+}
+
+} // namespace shelly
@@ -0,0 +1,39 @@
+/*
+ * recorder.h -- record raw cloud responses for later replay
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _recorder_h
+#define _recorder_h
+
+#include <ctime>
+#include <list>
+#include <string>
+
+namespace shelly {
+
+/**
+ * \brief Archive of raw cloud responses
+ *
+ * Each response is stored gzip compressed in a file named
+ * <timekey>-<chunk>.json.gz in the archive directory, so that the
+ * timekey of the cycle is preserved for replay.
+ */
+class recorder {
+	std::string	_directory;
+public:
+	typedef struct {
+		time_t	timekey;
+		int	chunk;
+		std::string	filename;
+	} entry;
+	recorder(const std::string& directory);
+	const std::string&	directory() const { return _directory; }
+	void	record(time_t timekey, int chunk, const std::string& response);
+	std::list<entry>	entries() const;
+	std::string	read(const entry& e) const;
+};
+
+} // namespace shelly
+
+#endif /* _recorder_h */
@@ -0,0 +1,141 @@
+/*
+ * reload.cpp -- reload the configuration while the daemon is running
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "reload.h"
+#include "metrics.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+namespace shelly {
+
+volatile sig_atomic_t	configwatcher::_requested = 0;
+
+/**
+ * \brief Request a reload, this is safe to call from a signal handler
+ */
+void	configwatcher::request() {
+	_requested = 1;
+}
+
+/**
+ * \brief Create the watcher and start the watcher thread
+ *
+ * If inotify is not available, the configuration is only reloaded on
+ * request.
+ *
+ * \param filename	absolute path name of the configuration file
+ * \param initial	the configuration read at startup
+ */
+configwatcher::configwatcher(const std::string& filename,
+	configuration_ptr initial) : _filename(filename), _current(initial),
+	_fd(-1), _running(true) {
+	_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_fd < 0) {
+		debug(LOG_ERR, DEBUG_LOG, DEBUG_ERRNO, "cannot watch %s",
+			_filename.c_str());
+	} else {
+		// editors often replace the file, so watch the directory
+		size_t	slash = _filename.rfind('/');
+		std::string	directory = (slash == std::string::npos)
+			? std::string(".") : _filename.substr(0, slash + 1);
+		if (inotify_add_watch(_fd, directory.c_str(),
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+			debug(LOG_ERR, DEBUG_LOG, DEBUG_ERRNO, "cannot watch "
+				"%s", directory.c_str());
+			close(_fd);
+			_fd = -1;
+		}
+	}
+	_thread = std::thread(&configwatcher::main, this);
+}
+
+/**
+ * \brief Stop the watcher thread
+ */
+configwatcher::~configwatcher() {
+	_running = false;
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	if (_fd >= 0) {
+		close(_fd);
+	}
+}
+
+/**
+ * \brief Get the current configuration snapshot
+ */
+configuration_ptr	configwatcher::current() const {
+	return std::atomic_load(&_current);
+}
+
+/**
+ * \brief Parse and validate the file and replace the current snapshot
+ */
+void	configwatcher::reload() {
+	try {
+		configuration_ptr	c(new configuration(_filename));
+		c->validate();
+		std::atomic_store(&_current, c);
+		metrics::reloads++;
+		debug(LOG_INFO, DEBUG_LOG, 0, "configuration %s reloaded",
+			_filename.c_str());
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "keeping current configuration, "
+			"cannot reload %s: %s", _filename.c_str(), x.what());
+	}
+}
+
+/**
+ * \brief Main function of the watcher thread
+ *
+ * Writing a file usually causes a burst of events, the file is only
+ * read once no event arrived for a short while.
+ */
+void	configwatcher::main() {
+	std::string	basename = _filename.substr(_filename.rfind('/') + 1);
+	bool	changed = false;
+	while (_running) {
+		if (_requested) {
+			_requested = 0;
+			reload();
+		}
+		if (_fd < 0) {
+			usleep(200000);
+			continue;
+		}
+		struct pollfd	pfd;
+		pfd.fd = _fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 200) <= 0) {
+			if (changed) {
+				changed = false;
+				reload();
+			}
+			continue;
+		}
+		char	buffer[4096] __attribute__ ((aligned(
+				__alignof__(struct inotify_event))));
+		ssize_t	bytes;
+		while ((bytes = read(_fd, buffer, sizeof(buffer))) > 0) {
+			for (char *p = buffer; p < buffer + bytes; ) {
+				struct inotify_event	*e
+					= (struct inotify_event *)p;
+				if ((e->len > 0) && (basename == e->name)) {
+					changed = true;
+				}
+				p += sizeof(struct inotify_event) + e->len;
+			}
+		}
+	}
+}
+
+} // namespace shelly
@@ -0,0 +1,51 @@
+/*
+ * reload.h -- reload the configuration while the daemon is running
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _reload_h
+#define _reload_h
+
+#include <atomic>
+#include <csignal>
+#include <string>
+#include <thread>
+#include "configuration.h"
+
+namespace shelly {
+
+/**
+ * \brief Watcher replacing the configuration when the file changes
+ *
+ * The watcher thread waits for inotify events on the directory of the
+ * configuration file or for a reload requested through SIGHUP. It then
+ * parses and validates the file and, if that succeeds, replaces the
+ * current snapshot with an atomic store. Readers get the snapshot with
+ * an atomic load and keep using it as long as they hold the pointer,
+ * so neither side ever takes a lock and a snapshot in use is never
+ * modified. A file that cannot be parsed or validated leaves the
+ * current configuration in place.
+ */
+class configwatcher {
+	std::string	_filename;
+	configuration_ptr	_current;
+	int	_fd;
+	std::atomic<bool>	_running;
+	std::thread	_thread;
+	static volatile sig_atomic_t	_requested;
+	void	main();
+	void	reload();
+	configwatcher(const configwatcher& other);
+	configwatcher&	operator=(const configwatcher& other);
+public:
+	configwatcher(const std::string& filename, configuration_ptr initial);
+	~configwatcher();
+	configuration_ptr	current() const;
+	static void	request();
+};
+
+typedef std::shared_ptr<configwatcher>	configwatcher_ptr;
+
+} // namespace shelly
+
+#endif /* _reload_h */
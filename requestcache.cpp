@@ -0,0 +1,108 @@
+/*
+ * requestcache.cpp -- prebuilt request bodies for the cloud
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "requestcache.h"
+#include "debug.h"
+#include "json.hpp"
+
+namespace shelly {
+
+/**
+ * \brief Take the request parameters from an endpoint section
+ *
+ * \param settings	the section describing the cloud endpoint
+ */
+requestcache::requestcache(const nlohmann::json& settings) : _timeout(10),
+	_compression(true) {
+	_url = settings.value("url", std::string())
+		+ settings.value("endpoint", std::string())
+		+ "?auth_key=" + settings.value("key", std::string());
+	if (settings.contains("timeout")) {
+		_timeout = settings["timeout"].get<long>();
+	}
+	if (settings.contains("compression")) {
+		_compression = settings["compression"].get<bool>();
+	}
+}
+
+/**
+ * \brief Serialize the request body for a list of device ids
+ *
+ * Only the status components needed for the readings are picked, to
+ * keep the response small.
+ *
+ * \param ids		the device ids to query
+ */
+std::string	requestcache::build(const std::list<std::string>& ids) {
+	nlohmann::json	requestjson;
+	requestjson["ids"] = nlohmann::json::array();
+	for (auto id : ids) {
+		requestjson["ids"].push_back(id);
+	}
+	requestjson["select"] = nlohmann::json::array({ "status" });
+	requestjson["pick"]["status"] = nlohmann::json::array({ "ts",
+		"temperature:0", "humidity:0", "devicepower:0", "sys" });
+	requestjson["pick"]["settings"] = nlohmann::json::array();
+	return requestjson.dump();
+}
+
+/**
+ * \brief Split the devices of the endpoint into chunks
+ *
+ * \param ids		the ids of the devices, in the order of the
+ *			configuration
+ * \param chunksize	the maximum number of ids in a chunk, 0 for all
+ *			ids in a single chunk
+ */
+void	requestcache::partition(const std::list<std::string>& ids,
+		size_t chunksize) {
+	_chunks.clear();
+	_bodies.clear();
+	_chunkof.clear();
+	auto	i = ids.begin();
+	while (i != ids.end()) {
+		std::shared_ptr<std::list<std::string> >	chunk(
+			new std::list<std::string>());
+		while ((i != ids.end()) && ((chunksize == 0)
+			|| (chunk->size() < chunksize))) {
+			_chunkof[*i] = _chunks.size();
+			chunk->push_back(*i++);
+		}
+		_chunks.push_back(chunk);
+	}
+	_bodies.resize(_chunks.size());
+}
+
+/**
+ * \brief Find the chunk a device belongs to
+ *
+ * \param id		the device id
+ * \return		the index of the chunk, or chunks() if the device is
+ *			not in any chunk
+ */
+size_t	requestcache::chunkof(const std::string& id) const {
+	auto	i = _chunkof.find(id);
+	return (i == _chunkof.end()) ? _chunks.size() : i->second;
+}
+
+/**
+ * \brief Get the body for a chunk, serializing it on first use
+ *
+ * \param index		the index of the chunk
+ */
+std::shared_ptr<const std::string>	requestcache::body(size_t index) {
+	std::shared_ptr<const std::string>&	b = _bodies[index];
+	if (!b) {
+		b = std::shared_ptr<const std::string>(
+			new std::string(build(*_chunks[index])));
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "request body for chunk %lu "
+			"of %lu devices built, %lu bytes", (unsigned long)index,
+			(unsigned long)_chunks[index]->size(),
+			(unsigned long)b->size());
+	}
+	return b;
+}
+
+} // namespace shelly
@@ -0,0 +1,58 @@
+/*
+ * requestcache.h -- prebuilt request bodies for the cloud
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _requestcache_h
+#define _requestcache_h
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <json.hpp>
+
+namespace shelly {
+
+/**
+ * \brief Serialized request bodies for the chunks of device ids
+ *
+ * The body of a cloud request only depends on the device ids it asks
+ * for. The devices of an endpoint are split into chunks once for each
+ * configuration snapshot, and the body of each chunk is serialized on
+ * first use and kept as an immutable buffer, looked up by the index of
+ * the chunk. The request URL and the transfer options are also taken
+ * from the endpoint section only once. Every cloud endpoint has a
+ * cache of its own, it is replaced with the configuration snapshot.
+ */
+class requestcache {
+	std::vector<std::shared_ptr<const std::list<std::string> > >	_chunks;
+	std::vector<std::shared_ptr<const std::string> >	_bodies;
+	std::map<std::string, size_t>	_chunkof;
+	std::string	_url;
+	long	_timeout;
+	bool	_compression;
+	requestcache(const requestcache& other);
+	requestcache&	operator=(const requestcache& other);
+public:
+	requestcache(const nlohmann::json& settings);
+	const std::string&	url() const { return _url; }
+	long	timeout() const { return _timeout; }
+	bool	compression() const { return _compression; }
+	static std::string	build(const std::list<std::string>& ids);
+	void	partition(const std::list<std::string>& ids, size_t chunksize);
+	size_t	chunks() const { return _chunks.size(); }
+	size_t	chunkof(const std::string& id) const;
+	std::shared_ptr<const std::list<std::string> >	chunk(
+			size_t index) const {
+		return _chunks[index];
+	}
+	std::shared_ptr<const std::string>	body(size_t index);
+};
+
+typedef std::shared_ptr<requestcache>	requestcache_ptr;
+
+} // namespace shelly
+
+#endif /* _requestcache_h */
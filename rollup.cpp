@@ -0,0 +1,328 @@
+/*
+ * rollup.cpp -- incremental computation of the meteo averages
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "rollup.h"
+#include "database.h"
+#include "metrics.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <cmath>
+#include <fstream>
+#include <regex>
+#include <sstream>
+
+namespace shelly {
+
+/**
+ * \brief Database connection writing averages to the averages table
+ *
+ * The connection uses the sensor and field id lookups of the database
+ * class, the field ids are those of the names of the averages.
+ */
+class averagewriter : public database {
+	std::string	_table;
+	std::map<std::string, int>	_fieldids;
+	std::string	_values;
+	size_t	_rows;
+public:
+	averagewriter(configuration_ptr config, const std::string& table)
+		: database(config), _table(table), _rows(0) { }
+	void	store(const std::string& station, const std::string& sensor,
+			time_t timekey, int intval, const std::string& name,
+			double value);
+	virtual void	flush();
+};
+
+/**
+ * \brief Add an average to the rows to write
+ *
+ * \param station	station name
+ * \param sensor	sensor name
+ * \param timekey	start of the interval
+ * \param intval	the interval as stored in the averages table
+ * \param name		name of the average, a field name in meteo
+ * \param value		the value of the average
+ */
+void	averagewriter::store(const std::string& station,
+		const std::string& sensor, time_t timekey, int intval,
+		const std::string& name, double value) {
+	auto	f = _fieldids.find(name);
+	if (f == _fieldids.end()) {
+		f = _fieldids.insert(std::make_pair(name, fieldid(name))).first;
+	}
+	_values += stringprintf("%s(%lld,%d,%d,%d,%.9g)",
+		(_rows > 0) ? "," : "", (long long)timekey, intval,
+		sensorid(station, sensor), f->second, value);
+	_rows++;
+}
+
+/**
+ * \brief Write all averages stored
+ *
+ * Existing rows are replaced, so that averages computed again after
+ * a failure do not cause duplicate key errors.
+ */
+void	averagewriter::flush() {
+	if (_rows == 0) {
+		return;
+	}
+	if (dryrun) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "dryrun: not writing %lu "
+			"averages", (unsigned long)_rows);
+	} else {
+		std::string	query = "replace into " + _table
+			+ "(timekey, intval, sensorid, fieldid, value) values "
+			+ _values;
+		if (mysql_real_query(mysql, query.data(), query.size())) {
+			std::string	error = stringprintf("cannot write "
+				"averages: %s", mysql_error(mysql));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+			throw shellyexception(error);
+		}
+		metrics::averages += _rows;
+	}
+	_values.clear();
+	_rows = 0;
+}
+
+/**
+ * \brief Create the rollup from the configuration
+ *
+ * The rollup section names the meteo configuration file containing the
+ * averages, the table to write them to and the intervals. An interval
+ * is given as its length in seconds, or as an object with the length
+ * and the value of the intval column if that differs from the length.
+ *
+ * \param config	the configuration containing the rollup section
+ */
+rollup::rollup(configuration_ptr config) : _config(config), _table("avg"),
+	_started(0) {
+	if (!_config->has("rollup.averages")) {
+		throw shellyexception("no averages file for the rollup");
+	}
+	parse(_config->stringvalue("rollup.averages"));
+	if (_config->has("rollup.table")) {
+		_table = _config->stringvalue("rollup.table");
+	}
+	if (_config->has("rollup.intervals")) {
+		for (auto i : _config->value("rollup.intervals")) {
+			if (i.is_object()) {
+				long	length = i["length"];
+				_lengths.push_back(length);
+				_intvals.push_back(i.value("intval", length));
+			} else {
+				long	length = i;
+				_lengths.push_back(length);
+				_intvals.push_back(length);
+			}
+		}
+	} else {
+		_lengths = { 3600, 86400 };
+		_intvals = { 3600, 86400 };
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "rollup of %lu sensors into %s, "
+		"%lu intervals", (unsigned long)_averages.size(),
+		_table.c_str(), (unsigned long)_lengths.size());
+}
+
+/**
+ * \brief Read the averages sections of the meteo configuration file
+ *
+ * Only the station, averages, sensor and average elements are of
+ * interest, the file is scanned for them without a full XML parser.
+ *
+ * \param filename	the meteo configuration file
+ */
+void	rollup::parse(const std::string& filename) {
+	std::ifstream	in(filename);
+	if (!in) {
+		throw shellyexception(stringprintf("cannot read %s",
+			filename.c_str()));
+	}
+	std::stringstream	ss;
+	ss << in.rdbuf();
+	std::string	text = std::regex_replace(ss.str(),
+		std::regex("<!--[\\s\\S]*?-->"), "");
+
+	static const std::regex	tagpattern(
+		"<\\s*(/?)\\s*([A-Za-z_]+)([^>]*?)(/?)>");
+	static const std::regex	attrpattern(
+		"([A-Za-z_]+)\\s*=\\s*\"([^\"]*)\"");
+	std::string	station;
+	std::string	sensor;
+	bool	averages = false;
+	for (std::sregex_iterator t(text.begin(), text.end(), tagpattern);
+		t != std::sregex_iterator(); t++) {
+		bool	closing = ((*t)[1].length() > 0);
+		std::string	element = (*t)[2];
+		std::map<std::string, std::string>	attributes;
+		std::string	a = (*t)[3];
+		for (std::sregex_iterator i(a.begin(), a.end(), attrpattern);
+			i != std::sregex_iterator(); i++) {
+			attributes[(*i)[1]] = (*i)[2];
+		}
+		if (element == "station") {
+			station = (closing) ? "" : attributes["name"];
+		} else if (element == "averages") {
+			averages = !closing;
+		} else if (averages && (element == "sensor")) {
+			sensor = (closing) ? "" : attributes["name"];
+		} else if (averages && (sensor.size() > 0)
+			&& (element == "average")) {
+			average	avg;
+			avg.name = attributes["name"];
+			std::string	base = attributes["base"];
+			std::string	operation = attributes["operator"];
+			avg.field = 0;
+			while ((avg.field < schema::nfields)
+				&& (base != schema::fieldname(avg.field))) {
+				avg.field++;
+			}
+			if (operation == "avg") {
+				avg.operation = rollup::avg;
+			} else if (operation == "min") {
+				avg.operation = rollup::min;
+			} else if (operation == "max") {
+				avg.operation = rollup::max;
+			} else {
+				avg.field = schema::nfields;
+			}
+			if ((avg.field == schema::nfields)
+				|| (avg.name.size() == 0)) {
+				debug(LOG_WARNING, DEBUG_LOG, 0, "ignoring "
+					"average %s of %s/%s: base %s, "
+					"operator %s", avg.name.c_str(),
+					station.c_str(), sensor.c_str(),
+					base.c_str(), operation.c_str());
+				continue;
+			}
+			_averages[std::make_pair(station, sensor)]
+				.push_back(avg);
+		}
+	}
+}
+
+/**
+ * \brief Add the values of a sensor to the buckets containing timekey
+ *
+ * \param station	station name
+ * \param sensor	sensor name
+ * \param timekey	timekey of the values
+ * \param values	the values in the order of the schema fields
+ */
+void	rollup::add(const std::string& station, const std::string& sensor,
+		time_t timekey, const float values[schema::nfields]) {
+	if (_averages.count(std::make_pair(station, sensor)) == 0) {
+		return;
+	}
+	if (_started == 0) {
+		_started = timekey;
+	}
+	for (size_t i = 0; i < _lengths.size(); i++) {
+		time_t	start = timekey - (timekey % _lengths[i]);
+		auto	b = _buckets.find(bucketkey(i, start, station, sensor));
+		if (b == _buckets.end()) {
+			bucketfields	empty;
+			for (auto& e : empty) {
+				e.sum = 0;
+				e.count = 0;
+				e.min = e.max = 0;
+			}
+			b = _buckets.insert(std::make_pair(bucketkey(i, start,
+				station, sensor), empty)).first;
+		}
+		for (int f = 0; f < schema::nfields; f++) {
+			if (std::isnan(values[f])) {
+				continue;
+			}
+			bucket&	e = b->second[f];
+			if ((e.count == 0) || (values[f] < e.min)) {
+				e.min = values[f];
+			}
+			if ((e.count == 0) || (values[f] > e.max)) {
+				e.max = values[f];
+			}
+			e.sum += values[f];
+			e.count++;
+		}
+	}
+}
+
+/**
+ * \brief Write the averages of all buckets that are complete
+ *
+ * A bucket is complete when its interval has ended before now. If the
+ * averages cannot be written, the buckets are kept and written with
+ * the next flush.
+ *
+ * \param now		the current timekey
+ */
+void	rollup::flush(time_t now) {
+	std::vector<std::map<bucketkey, bucketfields>::iterator>
+		complete;
+	auto	b = _buckets.begin();
+	while (b != _buckets.end()) {
+		int	i = std::get<0>(b->first);
+		time_t	start = std::get<1>(b->first);
+		if (start + _lengths[i] > now) {
+			b++;
+			continue;
+		}
+		if (start < _started) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "dropping incomplete "
+				"bucket %ld of %s/%s", (long)start,
+				std::get<2>(b->first).c_str(),
+				std::get<3>(b->first).c_str());
+			b = _buckets.erase(b);
+			continue;
+		}
+		complete.push_back(b++);
+	}
+	if (complete.size() == 0) {
+		return;
+	}
+	try {
+		averagewriter	writer(_config, _table);
+		for (auto c : complete) {
+			int	i = std::get<0>(c->first);
+			const std::string&	station = std::get<2>(c->first);
+			const std::string&	sensor = std::get<3>(c->first);
+			for (auto& avg : _averages[std::make_pair(station,
+				sensor)]) {
+				const bucket&	e = c->second[avg.field];
+				if (e.count == 0) {
+					continue;
+				}
+				double	value = 0;
+				switch (avg.operation) {
+				case rollup::avg:
+					value = e.sum / e.count;
+					break;
+				case rollup::min:
+					value = e.min;
+					break;
+				case rollup::max:
+					value = e.max;
+					break;
+				}
+				writer.store(station, sensor,
+					std::get<1>(c->first), _intvals[i],
+					avg.name, value);
+			}
+		}
+		writer.flush();
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot write averages, keeping "
+			"%lu buckets: %s", (unsigned long)complete.size(),
+			x.what());
+		return;
+	}
+	for (auto c : complete) {
+		_buckets.erase(c);
+	}
+}
+
+} // namespace shelly
@@ -0,0 +1,74 @@
+/*
+ * rollup.h -- incremental computation of the meteo averages
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _rollup_h
+#define _rollup_h
+
+#include <array>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "configuration.h"
+#include "schema.h"
+
+namespace shelly {
+
+/**
+ * \brief Averages of the readings maintained as the readings arrive
+ *
+ * The averages section of the meteo configuration file defines, for
+ * each sensor, averages as the avg, min or max of a field. Instead of
+ * having them recomputed from the raw readings, the rollup keeps a
+ * running sum, count, minimum and maximum per sensor, field and
+ * interval, for hourly and daily intervals by default. When a bucket
+ * is complete, the averages defined for its sensor are written to the
+ * averages table of meteo, the bucket is then forgotten. Buckets that
+ * were already running when the daemon started lack readings, they are
+ * never written.
+ */
+class rollup {
+public:
+	typedef enum { avg, min, max } op;
+	typedef struct {
+		std::string	name;
+		int	field;
+		op	operation;
+	} average;
+private:
+	typedef struct {
+		double	sum;
+		unsigned long	count;
+		float	min;
+		float	max;
+	} bucket;
+	typedef std::array<bucket, schema::nfields>	bucketfields;
+	typedef std::pair<std::string, std::string>	sensorkey;
+	// interval index, start of the bucket, station, sensor
+	typedef std::tuple<int, time_t, std::string, std::string>
+		bucketkey;
+	configuration_ptr	_config;
+	std::string	_table;
+	std::vector<long>	_lengths;
+	std::vector<int>	_intvals;
+	std::map<sensorkey, std::vector<average> >	_averages;
+	std::map<bucketkey, bucketfields>	_buckets;
+	time_t	_started;
+	void	parse(const std::string& filename);
+public:
+	rollup(configuration_ptr config);
+	void	add(const std::string& station, const std::string& sensor,
+			time_t timekey, const float values[schema::nfields]);
+	void	flush(time_t now);
+};
+
+typedef std::shared_ptr<rollup>	rollup_ptr;
+
+} // namespace shelly
+
+#endif /* _rollup_h */
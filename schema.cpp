@@ -0,0 +1,139 @@
+/*
+ * schema.cpp -- layout of the tables the readings are stored in
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "schema.h"
+#include "format.h"
+#include "common.h"
+
+namespace shelly {
+
+/**
+ * \brief names of the fields, in the order datasink::add takes them
+ */
+static const char	*fieldnames[schema::nfields] = {
+	"temperature", "humidity", "battery", "capacity"
+};
+
+/**
+ * \brief Get the name of a field
+ *
+ * \param field		the index of the field
+ */
+const char	*schema::fieldname(int field) {
+	return fieldnames[field];
+}
+
+/**
+ * \brief Read the layout from the database section of the configuration
+ *
+ * \param config	the configuration to use
+ */
+schema::schema(configuration_ptr config) : wide(false), table("sdata"),
+	view("sdata"), legacy("sdata_eav") {
+	if (config->has("database.schema")) {
+		std::string	s = config->stringvalue("database.schema");
+		if (s == "wide") {
+			wide = true;
+		} else if (s != "eav") {
+			throw shellyexception(stringprintf("unknown schema %s",
+				s.c_str()));
+		}
+	}
+	if (!wide) {
+		return;
+	}
+	table = "sdata_wide";
+	if (config->has("database.table")) {
+		table = config->stringvalue("database.table");
+	}
+	if (config->has("database.view")) {
+		view = config->stringvalue("database.view");
+	}
+	// a view of another name leaves the sdata table in place
+	if (config->has("database.legacy")) {
+		legacy = config->stringvalue("database.legacy");
+	} else if (view != "sdata") {
+		legacy = "sdata";
+	}
+	if (!config->has("database.columns")) {
+		for (int f = 0; f < nfields; f++) {
+			columns.push_back(f);
+		}
+		return;
+	}
+	for (auto c : config->value("database.columns")) {
+		std::string	name = c;
+		int	f = 0;
+		while ((f < nfields) && (name != fieldnames[f])) {
+			f++;
+		}
+		if (f == nfields) {
+			throw shellyexception(stringprintf("unknown field %s",
+				name.c_str()));
+		}
+		columns.push_back(f);
+	}
+}
+
+/**
+ * \brief The column list of an insert into the table
+ */
+std::string	schema::insertcolumns() const {
+	if (!wide) {
+		return std::string("timekey, sensorid, fieldid, value");
+	}
+	std::string	result("timekey, sensorid");
+	for (auto c : columns) {
+		result += std::string(", ") + fieldnames[c];
+	}
+	return result;
+}
+
+/**
+ * \brief The statements migrating to the wide table
+ *
+ * If the view is named sdata, the rename moves the existing readings to
+ * the legacy table and must only be executed once, the view then takes
+ * the place of the table. Without a legacy table, the view only
+ * presents the wide table.
+ */
+std::string	schema::ddl() const {
+	if (!wide) {
+		return std::string("-- readings are stored in the sdata table "
+			"of meteo\n");
+	}
+	std::string	result;
+	if ((legacy.size() > 0) && (view == "sdata")) {
+		result += "-- once: move the existing readings to the legacy "
+			"table\nrename table sdata to " + legacy + ";\n\n";
+	}
+	result += "create table if not exists " + table + " (\n"
+		"\ttimekey int not null,\n"
+		"\tsensorid int not null,\n";
+	for (auto c : columns) {
+		result += stringprintf("\t%s float,\n", fieldnames[c]);
+	}
+	result += "\tprimary key (timekey, sensorid),\n"
+		"\tkey (sensorid, timekey)\n"
+		") engine=InnoDB;\n\n";
+	result += "create or replace view " + view + " as\n";
+	if (legacy.size() > 0) {
+		result += "select timekey, sensorid, fieldid, value from "
+			+ legacy + "\n";
+	}
+	for (size_t i = 0; i < columns.size(); i++) {
+		const char	*name = fieldnames[columns[i]];
+		result += stringprintf("%sselect w.timekey, w.sensorid, "
+			"f.id as fieldid, w.%s as value\n"
+			"from %s w, mfield f\n"
+			"where f.name = '%s' and w.%s is not null\n",
+			((i > 0) || (legacy.size() > 0)) ? "union all\n" : "",
+			name, table.c_str(), name, name);
+	}
+	result += ";\n";
+	return result;
+}
+
+} // namespace shelly
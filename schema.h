@@ -0,0 +1,44 @@
+/*
+ * schema.h -- layout of the tables the readings are stored in
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _schema_h
+#define _schema_h
+
+#include <string>
+#include <vector>
+#include "configuration.h"
+
+namespace shelly {
+
+/**
+ * \brief Storage layout of the readings
+ *
+ * In the default layout, the readings go to the sdata table of meteo,
+ * one row per value with the field id. In the wide layout, all values
+ * of a device and timekey go to a single row of a table with one
+ * column per field, which holds a quarter of the rows. The sdata table
+ * is renamed to the legacy table, and a view named sdata presents the
+ * union of the legacy table and the wide table in the layout of sdata,
+ * so that the meteo programs read old and new data as before. The
+ * fields stored in the wide table, in the order of their columns, are
+ * configured in database.columns.
+ */
+class schema {
+public:
+	static const int	nfields = 4;
+	static const char	*fieldname(int field);
+	bool	wide;
+	std::string	table;
+	std::string	view;
+	std::string	legacy;
+	std::vector<int>	columns;
+	schema(configuration_ptr config);
+	std::string	insertcolumns() const;
+	std::string	ddl() const;
+};
+
+} // namespace shelly
+
+#endif /* _schema_h */
@@ -0,0 +1,444 @@
+/*
+ * shellybench.cpp -- end to end throughput benchmark with synthetic fleets
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <new>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include "loop.h"
+#include "metrics.h"
+#include "mockserver.h"
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif /* HAVE_SQLITE3 */
+
+// allocation counting, only allocations of the benchmark thread count,
+// so that the allocations of the mock server threads are excluded
+static std::atomic<unsigned long>	allocations(0);
+static thread_local bool	counting = false;
+
+void	*operator new(size_t size) {
+	if (counting) {
+		allocations++;
+	}
+	void	*p = malloc(size ? size : 1);
+	if (NULL == p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+__attribute__((noinline)) void	operator delete(void *p) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void	operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+namespace shelly {
+
+/**
+ * \brief Data sink that only counts the values
+ */
+class nullsink : public datasink {
+public:
+	virtual void	add(const std::string& /* station */,
+			const std::string& /* sensor */, time_t /* timekey */,
+			float /* temperature */, float /* humidity */,
+			float /* voltage */, float /* capacity */) {
+		metrics::inserted += 4;
+	}
+};
+
+#ifdef HAVE_SQLITE3
+/**
+ * \brief Data sink writing to an in memory SQLite database
+ *
+ * The database has the same station, sensor and sdata tables as the
+ * meteo database, and each value is written with the same sequence of
+ * sensor lookup and inserts as in the database class.
+ */
+class sqlitesink : public datasink {
+	sqlite3	*db;
+	sqlite3_stmt	*lookup;
+	sqlite3_stmt	*insert;
+	void	exec(const std::string& sql);
+public:
+	sqlitesink(const nlohmann::json& devices);
+	~sqlitesink();
+	virtual void	add(const std::string& station,
+			const std::string& sensor, time_t timekey,
+			float temperature, float humidity, float voltage,
+			float capacity);
+};
+
+/**
+ * \brief Execute a statement that does not return data
+ *
+ * \param sql		the statement to execute
+ */
+void	sqlitesink::exec(const std::string& sql) {
+	char	*error = NULL;
+	if (SQLITE_OK != sqlite3_exec(db, sql.c_str(), NULL, NULL, &error)) {
+		std::string	e = stringprintf("sqlite failed: %s", error);
+		sqlite3_free(error);
+		throw shellyexception(e);
+	}
+}
+
+/**
+ * \brief Create the in memory database with all sensors of the fleet
+ *
+ * \param devices	the devices array of the configuration
+ */
+sqlitesink::sqlitesink(const nlohmann::json& devices) : db(NULL),
+	lookup(NULL), insert(NULL) {
+	sqlite3_open(":memory:", &db);
+	exec("create table station(id integer primary key, name text)");
+	exec("create table sensor(id integer primary key, stationid int, "
+		"name text)");
+	exec("create unique index sensorname on sensor(stationid, name)");
+	exec("create table sdata(timekey int, sensorid int, fieldid int, "
+		"value real, primary key(timekey, sensorid, fieldid))");
+	exec("insert into station(id, name) values (1, 'Mock')");
+	exec("begin");
+	for (auto device : devices) {
+		std::string	sensor = device["sensor"];
+		exec(stringprintf("insert into sensor(stationid, name) "
+			"values (1, '%s')", sensor.c_str()));
+	}
+	exec("commit");
+	sqlite3_prepare_v2(db, "select b.id from station a, sensor b "
+		"where a.id = b.stationid and a.name = ? and b.name = ?",
+		-1, &lookup, NULL);
+	sqlite3_prepare_v2(db, "insert or replace into "
+		"sdata(timekey, sensorid, fieldid, value) values (?, ?, ?, ?)",
+		-1, &insert, NULL);
+}
+
+/**
+ * \brief Close the database
+ */
+sqlitesink::~sqlitesink() {
+	sqlite3_finalize(lookup);
+	sqlite3_finalize(insert);
+	sqlite3_close(db);
+}
+
+/**
+ * \brief Add the values of a sensor
+ */
+void	sqlitesink::add(const std::string& station, const std::string& sensor,
+		time_t timekey, float temperature, float humidity,
+		float voltage, float capacity) {
+	sqlite3_reset(lookup);
+	sqlite3_bind_text(lookup, 1, station.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_text(lookup, 2, sensor.c_str(), -1, SQLITE_STATIC);
+	if (SQLITE_ROW != sqlite3_step(lookup)) {
+		throw shellyexception("query did not return a row");
+	}
+	int	sid = sqlite3_column_int(lookup, 0);
+	const struct {
+		int	fieldid;
+		float	value;
+	} values[4] = {
+		{ 0, temperature }, { 10, humidity },
+		{ 110, voltage }, { 109, capacity }
+	};
+	for (int i = 0; i < 4; i++) {
+		sqlite3_reset(insert);
+		sqlite3_bind_int64(insert, 1, timekey);
+		sqlite3_bind_int(insert, 2, sid);
+		sqlite3_bind_int(insert, 3, values[i].fieldid);
+		sqlite3_bind_double(insert, 4, values[i].value);
+		if (SQLITE_DONE != sqlite3_step(insert)) {
+			throw shellyexception(sqlite3_errmsg(db));
+		}
+		metrics::inserted++;
+	}
+}
+#endif /* HAVE_SQLITE3 */
+
+/**
+ * \brief Loop writing to a stand-in for the database
+ */
+class benchloop : public loop {
+	std::string	_sinktype;
+	datasink_ptr	_sink;
+public:
+	benchloop(configuration_ptr config, const nlohmann::json& devices,
+		const std::string& sinktype)
+		: loop(config), _sinktype(sinktype) {
+#ifdef HAVE_SQLITE3
+		if (_sinktype == "sqlite") {
+			_sink = datasink_ptr(new sqlitesink(devices));
+		}
+#endif /* HAVE_SQLITE3 */
+		if (_sinktype == "null") {
+			_sink = datasink_ptr(new nullsink());
+		}
+	}
+	virtual datasink_ptr	opensink() {
+		if (_sink) {
+			return _sink;
+		}
+		return loop::opensink();
+	}
+};
+
+/**
+ * \brief The resident set size of the process right now in MB
+ *
+ * The peak reported by getrusage() never decreases, so it would show
+ * the largest fleet so far instead of the current one.
+ */
+static double	residentmb() {
+	std::ifstream	statm("/proc/self/statm");
+	unsigned long	size = 0;
+	unsigned long	resident = 0;
+	if (!(statm >> size >> resident)) {
+		return 0;
+	}
+	return resident * (double)sysconf(_SC_PAGESIZE) / 1024. / 1024.;
+}
+
+/**
+ * \brief display a short usage message
+ *
+ * \param progname	the programm name to use
+ */
+static void	usage(char *progname) {
+	std::cout << progname << " [ options ]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "measure the throughput of the complete pipeline against "
+		"a local cloud stand-in" << std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << " -h,-?,--help        display this help message and exit"
+		<< std::endl;
+	std::cout << " -d,--debug          enable debug messages" << std::endl;
+	std::cout << " -f,--fleets=<l>     comma separated list of fleet sizes"
+		<< std::endl;
+	std::cout << " -n,--cycles=<n>     number of cycles per fleet"
+		<< std::endl;
+	std::cout << " -m,--maxids=<m>     device ids per request" << std::endl;
+	std::cout << " -l,--latency=<l>    cloud response latency in ms"
+		<< std::endl;
+	std::cout << " -L,--lan            poll the devices locally instead of "
+		"through the cloud" << std::endl;
+	std::cout << " -i,--identity       do not ask the cloud to compress "
+		"responses" << std::endl;
+	std::cout << " -s,--sink=<s>       database stand-in: sqlite, null "
+		"or database," << std::endl;
+	std::cout << "                     array or rows for the database with "
+		"array binding" << std::endl;
+	std::cout << "                     or multi-row inserts" << std::endl;
+	std::cout << " -c,--config=<c>     database section for the database "
+		"sink" << std::endl;
+	std::cout << " -b,--budget=<b>     skip larger fleets once a cycle "
+		"takes more than <b> seconds" << std::endl;
+}
+
+static struct option	longopts[] = {
+{ "budget",		required_argument,	NULL,		'b' },
+{ "config",		required_argument,	NULL,		'c' },
+{ "cycles",		required_argument,	NULL,		'n' },
+{ "debug",		no_argument,		NULL,		'd' },
+{ "fleets",		required_argument,	NULL,		'f' },
+{ "help",		no_argument,		NULL,		'h' },
+{ "identity",		no_argument,		NULL,		'i' },
+{ "lan",		no_argument,		NULL,		'L' },
+{ "latency",		required_argument,	NULL,		'l' },
+{ "maxids",		required_argument,	NULL,		'm' },
+{ "sink",		required_argument,	NULL,		's' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+/**
+ * \brief The shellybench main function
+ *
+ * \param argc		the number of command line parameters
+ * \param argv		array of command line parameters
+ */
+int	main(int argc, char *const argv[]) {
+	std::string	fleets("10,100,1000,10000,100000");
+	int	cycles = 3;
+	double	budget = 60;
+	bool	compression = true;
+	std::string	configfilename;
+	mockoptions	options;
+	options.maxids = 100;
+#ifdef HAVE_SQLITE3
+	std::string	sinktype("sqlite");
+#else
+	std::string	sinktype("null");
+#endif /* HAVE_SQLITE3 */
+
+	int	c;
+	int	longindex;
+	while (EOF != (c = getopt_long(argc, argv, "b:c:d?f:hiLl:m:n:s:",
+		longopts, &longindex)))
+		switch (c) {
+		case 'b':
+			budget = std::stod(optarg);
+			break;
+		case 'c':
+			configfilename = std::string(optarg);
+			break;
+		case 'd':
+			debuglevel = LOG_DEBUG;
+			break;
+		case 'f':
+			fleets = std::string(optarg);
+			break;
+		case 'h':
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		case 'i':
+			compression = false;
+			break;
+		case 'L':
+			options.lan = true;
+			break;
+		case 'l':
+			options.latency = std::stoi(optarg);
+			break;
+		case 'm':
+			options.maxids = std::stoi(optarg);
+			break;
+		case 'n':
+			cycles = std::stoi(optarg);
+			break;
+		case 's':
+			sinktype = std::string(optarg);
+			break;
+		}
+
+	// the database sink needs the connection parameters
+	nlohmann::json	databaseconfig;
+	if (configfilename.size() > 0) {
+		std::ifstream	ifs(configfilename);
+		databaseconfig = nlohmann::json::parse(ifs)["database"];
+	}
+	bool	database = (sinktype == "database") || (sinktype == "array")
+		|| (sinktype == "rows");
+	if (database && databaseconfig.is_null()) {
+		std::cerr << "database sink needs --config" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// parse the fleet sizes
+	std::list<int>	sizes;
+	size_t	p = 0;
+	while (p < fleets.size()) {
+		size_t	e = fleets.find(',', p);
+		if (e == std::string::npos) {
+			e = fleets.size();
+		}
+		sizes.push_back(std::stoi(fleets.substr(p, e - p)));
+		p = e + 1;
+	}
+
+	printf("%-8s %-8s %12s %12s %14s %10s %12s %12s\n", "devices",
+		"sink", "cycle [s]", "max [s]", "readings/s", "rss [MB]",
+		"allocs/read", "wire [kB]");
+	double	peak = 0;
+	for (auto size : sizes) {
+		options.devices = size;
+		mockserver	server(options);
+		nlohmann::json	data = server.configuration("127.0.0.1");
+		if (!databaseconfig.is_null()) {
+			data["database"] = databaseconfig;
+		}
+		if ((sinktype == "array") || (sinktype == "rows")) {
+			data["database"]["insert"] = sinktype;
+		}
+		data["cloud"]["compression"] = compression;
+		configuration_ptr	config(new configuration(data));
+		benchloop	l(config, data["devices"], sinktype);
+
+		double	total = 0;
+		double	longest = 0;
+		uint64_t	readings = 0;
+		unsigned long	allocs = 0;
+		uint64_t	wirebefore = metrics::wirebytes;
+		int	n = 0;
+		while ((n < cycles) && (longest <= budget)) {
+			uint64_t	before = metrics::inserted;
+			unsigned long	allocsbefore = allocations;
+			std::chrono::steady_clock::time_point	start
+				= std::chrono::steady_clock::now();
+			counting = true;
+			l.cycle();
+			counting = false;
+			double	t = std::chrono::duration<double>(
+				std::chrono::steady_clock::now()
+				- start).count();
+			total += t;
+			longest = (t > longest) ? t : longest;
+			readings += metrics::inserted - before;
+			allocs += allocations - allocsbefore;
+			n++;
+		}
+
+		double	rss = residentmb();
+		peak = (rss > peak) ? rss : peak;
+		printf("%-8d %-8s %12.3f %12.3f %14.0f %10.1f %12.1f "
+			"%12.1f%s\n", size, sinktype.c_str(), total / n,
+			longest, (total > 0) ? readings / total : 0., rss,
+			(readings > 0)
+				? allocs / (double)readings : 0.,
+			(metrics::wirebytes - wirebefore) / 1024. / n,
+			(longest > 60) ? "  exceeds 60s window" : "");
+		fflush(stdout);
+		if (longest > budget) {
+			printf("cycle took longer than %.0f seconds, skipping "
+				"larger fleets\n", budget);
+			break;
+		}
+	}
+	// the kernel updates the peak lazily, it may lag behind a reading
+	struct rusage	usage;
+	getrusage(RUSAGE_SELF, &usage);
+	if (usage.ru_maxrss / 1024. > peak) {
+		peak = usage.ru_maxrss / 1024.;
+	}
+	printf("peak rss of all fleets: %.1f MB\n", peak);
+	printf("rss is measured after the last cycle of a fleet and includes "
+		"the in process\ncloud stand-in, allocations only count the "
+		"pipeline,\nwire is the cloud response size per cycle before "
+		"decoding\n");
+	return EXIT_SUCCESS;
+}
+
+} // namespace shelly
+
+int	main(int argc, char *const argv[]) {
+	try {
+		return shelly::main(argc, argv);
+	} catch (const std::exception& x) {
+		std::cerr << "terminated by exception: " << x.what();
+		std::cerr << std::endl;
+	} catch (...) {
+		std::cerr << "terminated by unknown exception" << std::endl;
+	}
+	return EXIT_FAILURE;
+}
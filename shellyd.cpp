@@ -5,14 +5,28 @@
  */
 #include <stdexcept>
 #include <cstdio>
+#include <climits>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <getopt.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <csignal>
 #include "debug.h"
 #include "loop.h"
 #include "common.h"
 #include "configuration.h"
+#include "statistics.h"
+#include "metrics.h"
+#include "trace.h"
+#include "webhook.h"
+#include "mqtt.h"
+#include "events.h"
+#include "reload.h"
+#include "schema.h"
+#include "partition.h"
+#include "discovery.h"
 
 namespace shelly {
 
@@ -30,6 +44,8 @@ void	usage(char *progname) {
 	std::cout << " -h,-?,--help        display this help message and exit"
 		<< std::endl;
 	std::cout << " -d,--debug          enable debug messages" << std::endl;
+	std::cout << " -D,--schema         print the statements creating the "
+		"tables and exit" << std::endl;
 	std::cout << " -c,--config=<c>     read configuration from file <c>"
 		<< std::endl;
 	std::cout << " -f,--foreground     run in the foreground" << std::endl;
@@ -37,15 +53,46 @@ void	usage(char *progname) {
 		<< std::endl;
 	std::cout << " -s,--syslog         send log messages to syslog"
 		<< std::endl;
+	std::cout << " -S,--statistics=<n> log latency statistics every <n> "
+		"cycles" << std::endl;
+	std::cout << " -r,--record=<d>     record all cloud responses in "
+		"directory <d>" << std::endl;
+	std::cout << " -R,--replay=<d>     process the responses recorded in "
+		"directory <d> and exit" << std::endl;
+	std::cout << " -T,--trace=<f>      write a chrome trace of all cycles "
+		"to file <f>" << std::endl;
+}
+
+/**
+ * \brief signal handler to request a latency statistics summary
+ *
+ * \param sig		the signal number
+ */
+static void	summary_handler(int /* sig */) {
+	statistics::request();
+}
+
+/**
+ * \brief signal handler to request a configuration reload
+ *
+ * \param sig		the signal number
+ */
+static void	reload_handler(int /* sig */) {
+	configwatcher::request();
 }
 
 static struct option	longopts[] = {
 { "config",		required_argument,	NULL,		'c' },
 { "debug",		no_argument,		NULL,		'd' },
+{ "schema",		no_argument,		NULL,		'D' },
 { "syslog",		no_argument,		NULL,		's' },
 { "help",		no_argument,		NULL,		'h' },
 { "dryrun",		no_argument,		NULL,		'n' },
 { "foreground",		no_argument,		NULL,		'f' },
+{ "record",		required_argument,	NULL,		'r' },
+{ "replay",		required_argument,	NULL,		'R' },
+{ "statistics",		required_argument,	NULL,		'S' },
+{ "trace",		required_argument,	NULL,		'T' },
 { NULL,			0,			NULL,		 0  }
 };
 
@@ -57,13 +104,17 @@ static struct option	longopts[] = {
  */
 int	main(int argc, char *const argv[]) {
 	bool	foreground = false;
+	bool	printschema = false;
+	std::string	tracefilename;
+	std::string	recorddirectory;
+	std::string	replaydirectory;
 	std::string	configfilename(SHELLYCONFFILE);
 	configuration_ptr	config;
 
 	int	c;
 	int	longindex;
-	while (EOF != (c = getopt_long(argc, argv, "c:d?hfsn", longopts,
-		&longindex)))
+	while (EOF != (c = getopt_long(argc, argv, "c:dD?hfsnr:R:S:T:",
+		longopts, &longindex)))
 		switch (c) {
 		case 'c':
 			configfilename = std::string(optarg);
@@ -73,6 +124,9 @@ int	main(int argc, char *const argv[]) {
 		case 'd':
 			debuglevel = LOG_DEBUG;
 			break;
+		case 'D':
+			printschema = true;
+			break;
 		case 'h':
 		case '?':
 			usage(argv[0]);
@@ -86,12 +140,79 @@ int	main(int argc, char *const argv[]) {
 		case 'n':
 			dryrun = true;
 			break;
+		case 'S':
+			statistics::enabled = true;
+			statistics::interval = std::stoi(optarg);
+			break;
+		case 'r':
+			recorddirectory = std::string(optarg);
+			break;
+		case 'R':
+			replaydirectory = std::string(optarg);
+			break;
+		case 'T':
+			tracefilename = std::string(optarg);
+			break;
 		}
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "command line parsed");
 
 	// parse the configuration file
 	config = configuration_ptr(new configuration(configfilename));
 
+	// the tables of the configured schema are created by the operator
+	if (printschema) {
+		std::cout << schema(config).ddl();
+		return EXIT_SUCCESS;
+	}
+
+	// the daemon changes to the root directory, but the file must still
+	// be found when it is reloaded
+	char	path[PATH_MAX];
+	if (NULL != realpath(configfilename.c_str(), path)) {
+		configfilename = std::string(path);
+	}
+
+	// the trace file need not exist yet, so it is only made absolute
+	if ((tracefilename.size() > 0) && (tracefilename[0] != '/')) {
+		if (NULL != getcwd(path, sizeof(path))) {
+			tracefilename = std::string(path) + "/" + tracefilename;
+		}
+	}
+
+	// responses are recorded into an existing directory
+	if (recorddirectory.size() > 0) {
+		if (NULL == realpath(recorddirectory.c_str(), path)) {
+			debug(LOG_ERR, DEBUG_LOG, DEBUG_ERRNO, "cannot record "
+				"to %s", recorddirectory.c_str());
+			return EXIT_FAILURE;
+		}
+		recorddirectory = std::string(path);
+	}
+
+	// latency statistics can also be enabled in the configuration
+	if (config->has("statistics.interval")) {
+		statistics::enabled = true;
+		statistics::interval = config->intvalue("statistics.interval");
+	}
+	if (statistics::enabled && (debuglevel < LOG_NOTICE)) {
+		debuglevel = LOG_NOTICE;
+	}
+	signal(SIGUSR1, summary_handler);
+
+	// replaying recorded data is a batch job that runs in the foreground
+	if (replaydirectory.size() > 0) {
+		if (tracefilename.size() > 0) {
+			tracer::open(tracefilename);
+		}
+		loop	l(config);
+		l.replay(replaydirectory);
+		if (statistics::enabled) {
+			statistics::summarize();
+		}
+		tracer::close();
+		return EXIT_SUCCESS;
+	}
+
 	// daemonize unless prevented by the --foreground option
 	if (foreground) {
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "stay in foreground");
@@ -116,8 +237,62 @@ int	main(int argc, char *const argv[]) {
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "database hostname: %s",
 		hostname.c_str());
 
-	// start the main loop
+	// start the metrics server, this must happen after the fork
+	// because threads do not survive it
+	std::unique_ptr<metricsserver>	server;
+	if (config->has("metrics")) {
+		if (!statistics::enabled) {
+			statistics::enabled = true;
+			statistics::interval = 0;
+		}
+		server.reset(new metricsserver(config));
+	}
+
+	// keep the partitions of the readings table ahead of time
+	std::unique_ptr<partitioner>	partitions;
+	if (config->has("partitions")) {
+		partitions.reset(new partitioner(config));
+	}
+
+	// start tracing, the trace writer also runs in a thread
+	if (tracefilename.size() > 0) {
+		tracer::open(tracefilename);
+	}
+
+	// start the main loop, watching the configuration file for changes
 	loop	l(config);
+	configwatcher_ptr	watcher(new configwatcher(configfilename,
+					config));
+	l.watch(watcher);
+	signal(SIGHUP, reload_handler);
+
+	// devices found in the cloud accounts are added by a reload
+	std::unique_ptr<discoverer>	discovery;
+	if (config->has("discovery")) {
+		discovery.reset(new discoverer(watcher));
+	}
+	if (recorddirectory.size() > 0) {
+		l.record(recorddirectory);
+	}
+
+	// accept data pushed by the devices, polling only as a fallback
+	std::unique_ptr<webhookserver>	webhook;
+	std::unique_ptr<mqttclient>	mqtt;
+	std::unique_ptr<eventstream>	events;
+	if (config->has("webhook") || config->has("mqtt")
+		|| config->has("events.url")) {
+		pushqueue_ptr	queue(new pushqueue(config));
+		l.pushes(queue);
+		if (config->has("webhook")) {
+			webhook.reset(new webhookserver(config, queue));
+		}
+		if (config->has("mqtt")) {
+			mqtt.reset(new mqttclient(config, queue));
+		}
+		if (config->has("events.url")) {
+			events.reset(new eventstream(config, queue));
+		}
+	}
 	l.run();
 	
 	return EXIT_SUCCESS;
@@ -0,0 +1,360 @@
+/*
+ * shellymicro.cpp -- microbenchmarks for the parsing and mapping hot path
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <new>
+#include <sstream>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include "loop.h"
+#include "mockserver.h"
+
+// count all allocations made while a benchmark runs
+static std::atomic<unsigned long>	allocations(0);
+
+void	*operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	void	*p = malloc(size ? size : 1);
+	if (NULL == p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+__attribute__((noinline)) void	operator delete(void *p) noexcept {
+	free(p);
+}
+
+__attribute__((noinline)) void	operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+namespace shelly {
+
+// results are stored here so that the compiler cannot drop the work
+static volatile size_t	blackhole = 0;
+
+/**
+ * \brief Data sink that discards everything
+ */
+class discardsink : public datasink {
+public:
+	virtual void	add(const std::string& station,
+			const std::string& /* sensor */, time_t /* timekey */,
+			float temperature, float /* humidity */,
+			float /* voltage */, float /* capacity */) {
+		blackhole += station.size() + (temperature > 0);
+	}
+};
+
+/**
+ * \brief Loop with the database replaced by a discarding sink
+ */
+class microloop : public loop {
+	datasink_ptr	_sink;
+public:
+	microloop(configuration_ptr config) : loop(config),
+		_sink(new discardsink()) { }
+	virtual datasink_ptr	opensink() { return _sink; }
+};
+
+/**
+ * \brief Result of a single benchmark
+ */
+typedef struct {
+	std::string	name;
+	unsigned long	iterations;
+	double	nanoseconds;
+	double	allocs;
+} result;
+
+/**
+ * \brief Run a benchmark until it has run for at least mintime seconds
+ *
+ * The number of iterations is doubled until the total time exceeds
+ * the minimum time, the result is the time per iteration of the
+ * last run.
+ *
+ * \param name		the name of the benchmark
+ * \param mintime	minimum duration of a run in seconds
+ * \param body		the code to measure
+ */
+static result	measure(const std::string& name, double mintime,
+		std::function<void()> body) {
+	result	r;
+	r.name = name;
+	unsigned long	n = 1;
+	while (1) {
+		unsigned long	before = allocations;
+		std::chrono::steady_clock::time_point	start
+			= std::chrono::steady_clock::now();
+		for (unsigned long i = 0; i < n; i++) {
+			body();
+		}
+		double	t = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+		if ((t >= mintime) || (n >= (1UL << 30))) {
+			r.iterations = n;
+			r.nanoseconds = 1e9 * t / n;
+			r.allocs = (allocations - before) / (double)n;
+			return r;
+		}
+		n *= 2;
+	}
+}
+
+/**
+ * \brief display a short usage message
+ *
+ * \param progname	the programm name to use
+ */
+static void	usage(char *progname) {
+	std::cout << progname << " [ options ]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "microbenchmarks of the parsing and mapping hot path"
+		<< std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << " -h,-?,--help        display this help message and exit"
+		<< std::endl;
+	std::cout << " -n,--devices=<n>    size of the synthetic fleet"
+		<< std::endl;
+	std::cout << " -r,--response=<r>   use the recorded cloud response in "
+		"file <r>" << std::endl;
+	std::cout << " -f,--filter=<f>     only run benchmarks containing <f>"
+		<< std::endl;
+	std::cout << " -t,--mintime=<t>    run each benchmark for at least "
+		"<t> seconds" << std::endl;
+	std::cout << " -o,--out=<o>        write JSON results to file <o>"
+		<< std::endl;
+}
+
+static struct option	longopts[] = {
+{ "devices",		required_argument,	NULL,		'n' },
+{ "filter",		required_argument,	NULL,		'f' },
+{ "help",		no_argument,		NULL,		'h' },
+{ "mintime",		required_argument,	NULL,		't' },
+{ "out",		required_argument,	NULL,		'o' },
+{ "response",		required_argument,	NULL,		'r' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+/**
+ * \brief The shellymicro main function
+ *
+ * \param argc		the number of command line parameters
+ * \param argv		array of command line parameters
+ */
+int	main(int argc, char *const argv[]) {
+	int	devices = 100;
+	double	mintime = 0.5;
+	std::string	filter;
+	std::string	outfilename;
+	std::string	responsefilename;
+
+	int	c;
+	int	longindex;
+	while (EOF != (c = getopt_long(argc, argv, "f:?hn:o:r:t:", longopts,
+		&longindex)))
+		switch (c) {
+		case 'f':
+			filter = std::string(optarg);
+			break;
+		case 'h':
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		case 'n':
+			devices = std::stoi(optarg);
+			break;
+		case 'o':
+			outfilename = std::string(optarg);
+			break;
+		case 'r':
+			responsefilename = std::string(optarg);
+			break;
+		case 't':
+			mintime = std::stod(optarg);
+			break;
+		}
+
+	// get a response, either a recorded one or a synthetic one
+	std::string	response;
+	nlohmann::json	responsejson;
+	if (responsefilename.size() > 0) {
+		std::ifstream	ifs(responsefilename);
+		std::stringstream	ss;
+		ss << ifs.rdbuf();
+		response = ss.str();
+		responsejson = nlohmann::json::parse(response);
+	} else {
+		responsejson = nlohmann::json::array();
+		time_t	now = time(NULL);
+		for (int i = 0; i < devices; i++) {
+			nlohmann::json	item;
+			item["id"] = mockserver::id(i);
+			item["status"] = mockserver::status(i, now);
+			responsejson.push_back(item);
+		}
+		response = responsejson.dump();
+	}
+
+	// build a configuration mapping all devices of the response
+	nlohmann::json	data;
+	data["cloud"]["url"] = "http://127.0.0.1:8080";
+	data["cloud"]["endpoint"] = "/v2/devices/api/get";
+	data["cloud"]["key"] = "micro";
+	data["database"]["hostname"] = "localhost";
+	data["database"]["port"] = 3306;
+	data["devices"] = nlohmann::json::array();
+	int	n = 0;
+	std::string	firstid, lastid;
+	for (auto item : responsejson) {
+		nlohmann::json	device;
+		device["id"] = item["id"];
+		device["station"] = "Micro";
+		device["sensor"] = stringprintf("micro%d", n++);
+		data["devices"].push_back(device);
+		lastid = item["id"];
+		if (firstid.size() == 0) {
+			firstid = lastid;
+		}
+	}
+	configuration_ptr	config(new configuration(data));
+	microloop	l(config);
+	std::list<std::string>	chunk = config->idlist();
+	while (chunk.size() > 100) {
+		chunk.pop_back();
+	}
+	requestcache	requests(data["cloud"]);
+	requests.partition(chunk, 0);
+	time_t	now = l.timekey().count();
+
+	// send log messages to /dev/null for the vdebug benchmarks
+	int	nullfd = open("/dev/null", O_WRONLY);
+	debug_fd(nullfd);
+	debuglevel = LOG_ERR;
+
+	// the benchmarks
+	typedef std::pair<std::string, std::function<void()> >	benchmark;
+	std::list<benchmark>	benchmarks;
+	benchmarks.push_back(benchmark("json_parse", [&]() {
+		nlohmann::json	j = nlohmann::json::parse(response);
+		blackhole += j.size();
+	}));
+	benchmarks.push_back(benchmark("loop_process", [&]() {
+		l.process(responsejson, now);
+	}));
+	benchmarks.push_back(benchmark("configuration_device_first", [&]() {
+		nlohmann::json	d = config->device(firstid);
+		blackhole += d.size();
+	}));
+	benchmarks.push_back(benchmark("configuration_device_last", [&]() {
+		nlohmann::json	d = config->device(lastid);
+		blackhole += d.size();
+	}));
+	benchmarks.push_back(benchmark("configuration_idlist", [&]() {
+		blackhole += config->idlist().size();
+	}));
+	benchmarks.push_back(benchmark("configuration_stringvalue", [&]() {
+		blackhole += config->stringvalue("cloud.url").size();
+	}));
+	benchmarks.push_back(benchmark("configuration_intvalue", [&]() {
+		blackhole += config->intvalue("database.port");
+	}));
+	benchmarks.push_back(benchmark("configuration_has", [&]() {
+		blackhole += config->has("cloud.timeout");
+	}));
+	benchmarks.push_back(benchmark("request_body_build", [&]() {
+		blackhole += requestcache::build(chunk).size();
+	}));
+	benchmarks.push_back(benchmark("request_body_cached", [&]() {
+		blackhole += requests.body(0)->size();
+	}));
+	benchmarks.push_back(benchmark("stringprintf", [&]() {
+		blackhole += stringprintf("adding to %s/%s (temperature=%.1f, "
+			"humidity=%.0f)", "Micro", "micro1", 21.5, 45.).size();
+	}));
+	benchmarks.push_back(benchmark("vdebug_off", [&]() {
+		debuglevel = LOG_ERR;
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "processing id %s",
+			firstid.c_str());
+	}));
+	benchmarks.push_back(benchmark("vdebug_on", [&]() {
+		debuglevel = LOG_DEBUG;
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "processing id %s",
+			firstid.c_str());
+		debuglevel = LOG_ERR;
+	}));
+
+	// run all benchmarks
+	std::list<result>	results;
+	for (auto b : benchmarks) {
+		if ((filter.size() > 0)
+			&& (std::string::npos == b.first.find(filter))) {
+			continue;
+		}
+		result	r = measure(b.first, mintime, b.second);
+		fprintf(stderr, "%-30s %12.1f ns %10.1f allocs %12lu "
+			"iterations\n", r.name.c_str(), r.nanoseconds,
+			r.allocs, r.iterations);
+		results.push_back(r);
+	}
+
+	// report the results in a format compatible with google benchmark
+	nlohmann::json	report;
+	char	date[64];
+	now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	report["context"]["date"] = date;
+	report["context"]["executable"] = argv[0];
+	report["context"]["devices"] = (int)responsejson.size();
+	report["context"]["response_bytes"] = response.size();
+	report["benchmarks"] = nlohmann::json::array();
+	for (auto r : results) {
+		nlohmann::json	b;
+		b["name"] = r.name;
+		b["run_type"] = "iteration";
+		b["iterations"] = r.iterations;
+		b["real_time"] = r.nanoseconds;
+		b["cpu_time"] = r.nanoseconds;
+		b["time_unit"] = "ns";
+		b["allocs_per_iter"] = r.allocs;
+		report["benchmarks"].push_back(b);
+	}
+	if (outfilename.size() > 0) {
+		std::ofstream	out(outfilename);
+		out << report.dump(4) << std::endl;
+	} else {
+		std::cout << report.dump(4) << std::endl;
+	}
+	return EXIT_SUCCESS;
+}
+
+} // namespace shelly
+
+int	main(int argc, char *const argv[]) {
+	try {
+		return shelly::main(argc, argv);
+	} catch (const std::exception& x) {
+		std::cerr << "terminated by exception: " << x.what();
+		std::cerr << std::endl;
+	} catch (...) {
+		std::cerr << "terminated by unknown exception" << std::endl;
+	}
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,181 @@
+/*
+ * shellymock.cpp -- local stand-in for the shelly cloud
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <csignal>
+#include <thread>
+#include <getopt.h>
+#include <unistd.h>
+#include "debug.h"
+#include "mockserver.h"
+
+namespace shelly {
+
+/**
+ * \brief display a short usage message
+ *
+ * \param progname	the programm name to use
+ */
+static void	usage(char *progname) {
+	std::cout << progname << " [ options ]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "simulate the shelly cloud for a fleet of synthetic "
+		"H&T devices" << std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << " -h,-?,--help        display this help message and exit"
+		<< std::endl;
+	std::cout << " -d,--debug          enable debug messages" << std::endl;
+	std::cout << " -p,--port=<p>       listen on port <p>" << std::endl;
+	std::cout << " -n,--devices=<n>    simulate a fleet of <n> devices"
+		<< std::endl;
+	std::cout << " -l,--latency=<l>    delay each response by <l> ms"
+		<< std::endl;
+	std::cout << " -e,--errorrate=<e>  fail a fraction <e> of the requests"
+		<< std::endl;
+	std::cout << " -E,--events=<i>     send status events every <i> ms"
+		<< std::endl;
+	std::cout << " -r,--ratelimit=<r>  allow at most <r> requests per "
+		"second" << std::endl;
+	std::cout << " -m,--maxids=<m>     accept at most <m> ids per request"
+		<< std::endl;
+	std::cout << " -P,--padding=<b>    add <b> bytes of payload per device"
+		<< std::endl;
+	std::cout << " -k,--key=<k>        require the auth key <k>"
+		<< std::endl;
+	std::cout << " -a,--accounts=<a>   split the fleet into <a> cloud "
+		"accounts" << std::endl;
+	std::cout << " -c,--config=<c>     write a shellyd configuration for "
+		"the fleet to <c>" << std::endl;
+	std::cout << " -L,--lan            configure the fleet for local "
+		"polling" << std::endl;
+}
+
+static struct option	longopts[] = {
+{ "accounts",		required_argument,	NULL,		'a' },
+{ "config",		required_argument,	NULL,		'c' },
+{ "debug",		no_argument,		NULL,		'd' },
+{ "devices",		required_argument,	NULL,		'n' },
+{ "errorrate",		required_argument,	NULL,		'e' },
+{ "events",		required_argument,	NULL,		'E' },
+{ "help",		no_argument,		NULL,		'h' },
+{ "key",		required_argument,	NULL,		'k' },
+{ "lan",		no_argument,		NULL,		'L' },
+{ "latency",		required_argument,	NULL,		'l' },
+{ "maxids",		required_argument,	NULL,		'm' },
+{ "padding",		required_argument,	NULL,		'P' },
+{ "port",		required_argument,	NULL,		'p' },
+{ "ratelimit",		required_argument,	NULL,		'r' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+static volatile sig_atomic_t	terminate = 0;
+
+/**
+ * \brief signal handler to terminate the server
+ */
+static void	terminate_handler(int /* sig */) {
+	terminate = 1;
+}
+
+/**
+ * \brief The shellymock main function
+ *
+ * \param argc		the number of command line parameters
+ * \param argv		array of command line parameters
+ */
+int	main(int argc, char *const argv[]) {
+	mockoptions	options;
+	options.port = 8080;
+	std::string	configfilename;
+
+	int	c;
+	int	longindex;
+	while (EOF != (c = getopt_long(argc, argv, "a:c:d?hE:e:k:Ll:m:n:P:p:r:",
+		longopts, &longindex)))
+		switch (c) {
+		case 'a':
+			options.accounts = std::stoi(optarg);
+			if (options.accounts < 1) {
+				options.accounts = 1;
+			}
+			break;
+		case 'c':
+			configfilename = std::string(optarg);
+			break;
+		case 'd':
+			debuglevel = LOG_DEBUG;
+			break;
+		case 'E':
+			options.events = std::stoi(optarg);
+			break;
+		case 'e':
+			options.errorrate = std::stod(optarg);
+			break;
+		case 'h':
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		case 'k':
+			options.key = std::string(optarg);
+			break;
+		case 'L':
+			options.lan = true;
+			break;
+		case 'l':
+			options.latency = std::stoi(optarg);
+			break;
+		case 'm':
+			options.maxids = std::stoi(optarg);
+			break;
+		case 'n':
+			options.devices = std::stoi(optarg);
+			break;
+		case 'P':
+			options.padding = std::stoi(optarg);
+			break;
+		case 'p':
+			options.port = std::stoi(optarg);
+			break;
+		case 'r':
+			options.ratelimit = std::stoi(optarg);
+			break;
+		}
+
+	mockserver	server(options);
+	if (configfilename.size() > 0) {
+		std::ofstream	out(configfilename);
+		out << server.configuration("127.0.0.1").dump(8) << std::endl;
+	}
+	std::cout << "serving " << options.devices << " devices on port "
+		<< server.port() << std::endl;
+
+	// run until terminated
+	signal(SIGINT, terminate_handler);
+	signal(SIGTERM, terminate_handler);
+	while (!terminate) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	}
+	std::cout << server.requests() << " requests, " << server.errors()
+		<< " errors" << std::endl;
+	return EXIT_SUCCESS;
+}
+
+} // namespace shelly
+
+int	main(int argc, char *const argv[]) {
+	try {
+		return shelly::main(argc, argv);
+	} catch (const std::exception& x) {
+		std::cerr << "terminated by exception: " << x.what();
+		std::cerr << std::endl;
+	} catch (...) {
+		std::cerr << "terminated by unknown exception" << std::endl;
+	}
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,207 @@
+/*
+ * shellysim.cpp -- time warp simulation of the scheduler
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <getopt.h>
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include "loop.h"
+#include "clock.h"
+#include "metrics.h"
+#include "statistics.h"
+#include "mockserver.h"
+
+namespace shelly {
+
+/**
+ * \brief Data sink that only spends simulated time
+ *
+ * Each device added advances the simulated clock by the configured
+ * insert latency, so a slow database can be simulated without waiting.
+ */
+class simulatedsink : public datasink {
+	std::shared_ptr<simulatedclock>	_clock;
+	std::chrono::microseconds	_latency;
+public:
+	simulatedsink(std::shared_ptr<simulatedclock> clock,
+		std::chrono::microseconds latency)
+		: _clock(clock), _latency(latency) { }
+	virtual void	add(const std::string& /* station */,
+			const std::string& /* sensor */, time_t /* timekey */,
+			float /* temperature */, float /* humidity */,
+			float /* voltage */, float /* capacity */) {
+		_clock->advance(_latency);
+		metrics::inserted += 4;
+	}
+};
+
+/**
+ * \brief Loop running on simulated time
+ */
+class simulationloop : public loop {
+	datasink_ptr	_sink;
+public:
+	simulationloop(configuration_ptr config,
+		std::shared_ptr<simulatedclock> clock,
+		std::chrono::microseconds insertlatency)
+		: loop(config),
+		  _sink(new simulatedsink(clock, insertlatency)) {
+		loop::clock(clock);
+	}
+	virtual datasink_ptr	opensink() { return _sink; }
+};
+
+/**
+ * \brief display a short usage message
+ *
+ * \param progname	the programm name to use
+ */
+static void	usage(char *progname) {
+	std::cout << progname << " [ options ]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "run the polling loop on a simulated clock against a "
+		"local cloud stand-in" << std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << " -h,-?,--help        display this help message and exit"
+		<< std::endl;
+	std::cout << " -d,--debug          enable debug messages" << std::endl;
+	std::cout << " -c,--cycles=<c>     number of cycles to simulate"
+		<< std::endl;
+	std::cout << " -n,--devices=<n>    size of the synthetic fleet"
+		<< std::endl;
+	std::cout << " -m,--maxids=<m>     device ids per request" << std::endl;
+	std::cout << " -l,--latency=<l>    cloud response latency in ms"
+		<< std::endl;
+	std::cout << " -e,--errorrate=<e>  fail a fraction <e> of the requests"
+		<< std::endl;
+	std::cout << " -i,--insert=<i>     simulated database time per device "
+		"in ms" << std::endl;
+	std::cout << " -x,--speedup=<x>    scale real time spent working by "
+		"<x>" << std::endl;
+}
+
+static struct option	longopts[] = {
+{ "cycles",		required_argument,	NULL,		'c' },
+{ "debug",		no_argument,		NULL,		'd' },
+{ "devices",		required_argument,	NULL,		'n' },
+{ "errorrate",		required_argument,	NULL,		'e' },
+{ "help",		no_argument,		NULL,		'h' },
+{ "insert",		required_argument,	NULL,		'i' },
+{ "latency",		required_argument,	NULL,		'l' },
+{ "maxids",		required_argument,	NULL,		'm' },
+{ "speedup",		required_argument,	NULL,		'x' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+/**
+ * \brief The shellysim main function
+ *
+ * \param argc		the number of command line parameters
+ * \param argv		array of command line parameters
+ */
+int	main(int argc, char *const argv[]) {
+	unsigned long	cycles = 1440;
+	double	insertlatency = 0;
+	double	speedup = 1;
+	mockoptions	options;
+	options.devices = 1000;
+	options.maxids = 100;
+
+	int	c;
+	int	longindex;
+	while (EOF != (c = getopt_long(argc, argv, "c:d?e:hi:l:m:n:x:",
+		longopts, &longindex)))
+		switch (c) {
+		case 'c':
+			cycles = std::stoul(optarg);
+			break;
+		case 'd':
+			debuglevel = LOG_DEBUG;
+			break;
+		case 'e':
+			options.errorrate = std::stod(optarg);
+			break;
+		case 'h':
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		case 'i':
+			insertlatency = std::stod(optarg);
+			break;
+		case 'l':
+			options.latency = std::stoi(optarg);
+			break;
+		case 'm':
+			options.maxids = std::stoi(optarg);
+			break;
+		case 'n':
+			options.devices = std::stoi(optarg);
+			break;
+		case 'x':
+			speedup = std::stod(optarg);
+			break;
+		}
+
+	// start the simulated time at the current minute
+	std::chrono::minutes	minute
+		= std::chrono::duration_cast<std::chrono::minutes>(
+			std::chrono::system_clock::now().time_since_epoch());
+	clocksource::time_point	begin(minute);
+	std::shared_ptr<simulatedclock>	clock(
+		new simulatedclock(begin, speedup));
+
+	mockserver	server(options);
+	configuration_ptr	config(new configuration(
+		server.configuration("127.0.0.1")));
+	simulationloop	l(config, clock, std::chrono::microseconds(
+		(long long)(1000 * insertlatency)));
+
+	statistics::enabled = true;
+	statistics::interval = 0;
+	std::chrono::steady_clock::time_point	start
+		= std::chrono::steady_clock::now();
+	l.run(cycles);
+	double	real = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	double	simulated = std::chrono::duration<double>(
+		clock->now() - begin).count();
+
+	printf("cycles:             %lu\n", cycles);
+	printf("simulated time:     %.0f s\n", simulated);
+	printf("real time:          %.3f s (%.0fx faster)\n", real,
+		(real > 0) ? simulated / real : 0.);
+	printf("overruns:           %llu\n",
+		(unsigned long long)metrics::overruns.load());
+	printf("requests per cycle: %.1f (%lu failed)\n",
+		server.requests() / (double)cycles, server.errors());
+	printf("readings per cycle: %.1f\n",
+		metrics::inserted.load() / (double)cycles);
+	printf("drift:              %s\n",
+		statistics::get(statistics::drift).summary().c_str());
+	printf("cycle (real time):  %s\n",
+		statistics::get(statistics::cycle).summary().c_str());
+	printf("fetch (real time):  %s\n",
+		statistics::get(statistics::fetch).summary().c_str());
+	return EXIT_SUCCESS;
+}
+
+} // namespace shelly
+
+int	main(int argc, char *const argv[]) {
+	try {
+		return shelly::main(argc, argv);
+	} catch (const std::exception& x) {
+		std::cerr << "terminated by exception: " << x.what();
+		std::cerr << std::endl;
+	} catch (...) {
+		std::cerr << "terminated by unknown exception" << std::endl;
+	}
+	return EXIT_FAILURE;
+}
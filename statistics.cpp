@@ -0,0 +1,209 @@
+/*
+ * statistics.cpp -- latency statistics for the stages of a cycle
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "statistics.h"
+#include "debug.h"
+#include "format.h"
+
+namespace shelly {
+
+/**
+ * \brief Compute the bucket index for a value
+ *
+ * Values below 16 get a bucket of their own, larger values are
+ * classified by the position of the most significant bit and the
+ * next four bits below it.
+ *
+ * \param value		the value to classify
+ */
+int	histogram::bucket(uint64_t value) {
+	if (value < (uint64_t)subbuckets) {
+		return (int)value;
+	}
+	int	msb = 63 - __builtin_clzll(value);
+	int	shift = msb - subbits;
+	if (shift >= magnitudes) {
+		return nbuckets - 1;
+	}
+	int	sub = (int)(value >> shift) - subbuckets;
+	return (shift + 1) * subbuckets + sub;
+}
+
+/**
+ * \brief Compute the largest value that falls into a bucket
+ *
+ * \param bucket	the bucket index
+ */
+uint64_t	histogram::upper(int bucket) {
+	if (bucket < subbuckets) {
+		return bucket;
+	}
+	int	shift = bucket / subbuckets - 1;
+	uint64_t	sub = bucket % subbuckets + subbuckets;
+	return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * \brief Construct an empty histogram
+ */
+histogram::histogram() {
+	reset();
+}
+
+/**
+ * \brief Clear all counters of the histogram
+ */
+void	histogram::reset() {
+	for (int i = 0; i < nbuckets; i++) {
+		counts[i].store(0, std::memory_order_relaxed);
+	}
+	_count.store(0);
+	_sum.store(0);
+	_max.store(0);
+}
+
+/**
+ * \brief Record a value
+ *
+ * \param value		the value in microseconds
+ */
+void	histogram::record(uint64_t value) {
+	counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+	_count.fetch_add(1, std::memory_order_relaxed);
+	_sum.fetch_add(value, std::memory_order_relaxed);
+	uint64_t	m = _max.load(std::memory_order_relaxed);
+	while ((value > m) && !_max.compare_exchange_weak(m, value,
+		std::memory_order_relaxed)) { }
+}
+
+/**
+ * \brief Retrieve the number of values recorded in a bucket
+ *
+ * \param bucket	the bucket index
+ */
+uint64_t	histogram::bucketcount(int bucket) const {
+	return counts[bucket].load(std::memory_order_relaxed);
+}
+
+/**
+ * \brief Compute a percentile
+ *
+ * The result is the upper bound of the bucket containing the percentile,
+ * but never more than the largest value recorded.
+ *
+ * \param p		the percentile as a fraction between 0 and 1
+ */
+uint64_t	histogram::percentile(double p) const {
+	uint64_t	n = count();
+	if (n == 0) {
+		return 0;
+	}
+	uint64_t	target = (uint64_t)(p * n + 0.5);
+	if (target < 1) {
+		target = 1;
+	}
+	uint64_t	seen = 0;
+	for (int i = 0; i < nbuckets; i++) {
+		seen += bucketcount(i);
+		if (seen >= target) {
+			uint64_t	u = upper(i);
+			return (u < max()) ? u : max();
+		}
+	}
+	return max();
+}
+
+/**
+ * \brief Format a one line summary of the histogram in milliseconds
+ */
+std::string	histogram::summary() const {
+	return stringprintf("n=%llu p50=%.3fms p90=%.3fms p99=%.3fms "
+		"max=%.3fms", (unsigned long long)count(),
+		percentile(0.50) / 1000., percentile(0.90) / 1000.,
+		percentile(0.99) / 1000., max() / 1000.);
+}
+
+histogram	statistics::_histograms[statistics::stages];
+volatile sig_atomic_t	statistics::_requested = 0;
+bool	statistics::enabled = false;
+int	statistics::interval = 60;
+
+static const char	*stagenames[statistics::stages] = {
+	"cycle", "fetch", "parse", "process", "connect", "sensorid", "insert",
+	"drift"
+};
+
+/**
+ * \brief Get the name of a stage
+ *
+ * \param s		the stage
+ */
+const char	*statistics::name(stage s) {
+	return stagenames[s];
+}
+
+/**
+ * \brief Write a summary of all stage histograms to the log
+ */
+void	statistics::summarize() {
+	_requested = 0;
+	if (!enabled) {
+		debug(LOG_NOTICE, DEBUG_LOG, 0, "latency statistics disabled");
+		return;
+	}
+	for (int s = 0; s < stages; s++) {
+		const histogram&	h = _histograms[s];
+		if (h.count() == 0) {
+			continue;
+		}
+		debug(LOG_NOTICE, DEBUG_LOG, 0, "%-8s %s",
+			name((stage)s), h.summary().c_str());
+	}
+}
+
+/**
+ * \brief Clear all stage histograms
+ */
+void	statistics::reset() {
+	for (int s = 0; s < stages; s++) {
+		_histograms[s].reset();
+	}
+}
+
+/**
+ * \brief Request a summary, this is safe to call from a signal handler
+ */
+void	statistics::request() {
+	_requested = 1;
+}
+
+/**
+ * \brief Find out whether a summary was requested
+ */
+bool	statistics::requested() {
+	return _requested != 0;
+}
+
+/**
+ * \brief Stop the stopwatch and record the elapsed time
+ */
+void	stopwatch::stop() {
+	if (!_running) {
+		return;
+	}
+	_running = false;
+	std::chrono::microseconds	d
+		= std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - _start);
+	if (statistics::enabled) {
+		statistics::get(_stage).record(d.count());
+	}
+	if (tracer::enabled) {
+		tracer::add(statistics::name(_stage), "stage", _tracestart,
+			tracer::now() - _tracestart);
+	}
+}
+
+} // namespace shelly
@@ -0,0 +1,106 @@
+/*
+ * statistics.h -- latency statistics for the stages of a cycle
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _statistics_h
+#define _statistics_h
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <csignal>
+#include "trace.h"
+
+namespace shelly {
+
+/**
+ * \brief Fixed bucket latency histogram
+ *
+ * Values are recorded in microseconds. Each power of two is subdivided
+ * into 16 linear sub buckets, as in HDR histograms, which gives a relative
+ * precision of about 6% over the whole range from 1us to several days.
+ * All counters are atomic, so recording never takes a lock and the
+ * histogram can be read from other threads while it is being updated.
+ */
+class histogram {
+public:
+	static const int	subbits = 4;
+	static const int	subbuckets = 1 << subbits;
+	static const int	magnitudes = 40;
+	static const int	nbuckets = (magnitudes + 1) * subbuckets;
+private:
+	std::atomic<uint64_t>	counts[nbuckets];
+	std::atomic<uint64_t>	_count;
+	std::atomic<uint64_t>	_sum;
+	std::atomic<uint64_t>	_max;
+	histogram(const histogram& other);
+	histogram&	operator=(const histogram& other);
+public:
+	static int	bucket(uint64_t value);
+	static uint64_t	upper(int bucket);
+	histogram();
+	void	record(uint64_t value);
+	uint64_t	count() const { return _count.load(); }
+	uint64_t	sum() const { return _sum.load(); }
+	uint64_t	max() const { return _max.load(); }
+	uint64_t	bucketcount(int bucket) const;
+	uint64_t	percentile(double p) const;
+	void	reset();
+	std::string	summary() const;
+};
+
+/**
+ * \brief Registry of the latency histograms for all stages of a cycle
+ */
+class statistics {
+public:
+	typedef enum {
+		cycle = 0, fetch, parse, process, connect, sensorid, insert,
+		drift, stages
+	} stage;
+private:
+	static histogram	_histograms[stages];
+	static volatile sig_atomic_t	_requested;
+public:
+	static bool	enabled;
+	static int	interval;
+	static histogram&	get(stage s) { return _histograms[s]; }
+	static const char	*name(stage s);
+	static void	summarize();
+	static void	reset();
+	static void	request();
+	static bool	requested();
+};
+
+/**
+ * \brief Timing span recording its duration into a stage histogram
+ *
+ * The constructor only reads the clock if statistics or tracing are
+ * enabled, so a disabled stopwatch costs a test of two flags. If tracing
+ * is enabled, the stage is also added to the trace as a span.
+ */
+class stopwatch {
+	statistics::stage	_stage;
+	bool	_running;
+	std::chrono::steady_clock::time_point	_start;
+	int64_t	_tracestart;
+public:
+	stopwatch(statistics::stage s) : _stage(s),
+		_running(statistics::enabled || tracer::enabled),
+		_tracestart(0) {
+		if (_running) {
+			_start = std::chrono::steady_clock::now();
+			if (tracer::enabled) {
+				_tracestart = tracer::now();
+			}
+		}
+	}
+	~stopwatch() { stop(); }
+	void	stop();
+};
+
+} // namespace shelly
+
+#endif /* _statistics_h */
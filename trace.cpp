@@ -0,0 +1,201 @@
+/*
+ * trace.cpp -- chrome trace event export for profiling cycles
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "trace.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include "json.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+namespace shelly {
+
+bool	tracer::enabled = false;
+
+// state shared between the loop and the writer thread
+static std::mutex	tracemutex;
+static std::condition_variable	tracecondition;
+static std::vector<tracer::event>	tracebuffer;
+static std::list<std::vector<tracer::event> >	tracequeue;
+static std::thread	tracethread;
+static bool	tracestop = false;
+static FILE	*tracefile = NULL;
+static bool	tracefirst = true;
+static std::chrono::steady_clock::time_point	traceorigin;
+static std::atomic<int>	tracethreads(0);
+
+/**
+ * \brief Get a small integer identifying the calling thread
+ */
+static int	threadid() {
+	static thread_local int	tid = 0;
+	if (0 == tid) {
+		tid = ++tracethreads;
+	}
+	return tid;
+}
+
+/**
+ * \brief Write a batch of events to the trace file
+ *
+ * \param events	the events to write
+ */
+static void	writeevents(const std::vector<tracer::event>& events) {
+	int	pid = getpid();
+	for (auto e : events) {
+		nlohmann::json	j;
+		j["name"] = e.name;
+		j["cat"] = e.category;
+		j["ph"] = "X";
+		j["ts"] = e.start;
+		j["dur"] = e.duration;
+		j["pid"] = pid;
+		j["tid"] = e.tid;
+		if (e.detail.size() > 0) {
+			j["args"]["detail"] = e.detail;
+		}
+		fprintf(tracefile, "%s%s", (tracefirst) ? "" : ",\n",
+			j.dump().c_str());
+		tracefirst = false;
+	}
+	fflush(tracefile);
+}
+
+/**
+ * \brief Main function of the writer thread
+ */
+static void	writer() {
+	std::unique_lock<std::mutex>	lock(tracemutex);
+	while (1) {
+		while (tracequeue.empty() && !tracestop) {
+			tracecondition.wait(lock);
+		}
+		if (tracequeue.empty() && tracestop) {
+			return;
+		}
+		std::vector<tracer::event>	events;
+		events.swap(tracequeue.front());
+		tracequeue.pop_front();
+		lock.unlock();
+		writeevents(events);
+		lock.lock();
+	}
+}
+
+/**
+ * \brief Open the trace file and start the writer thread
+ *
+ * \param filename	the name of the trace file
+ */
+void	tracer::open(const std::string& filename) {
+	tracefile = fopen(filename.c_str(), "w");
+	if (NULL == tracefile) {
+		std::string	error = stringprintf("cannot open trace file "
+			"%s: %s", filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		throw shellyexception(error);
+	}
+	fprintf(tracefile, "[\n");
+	tracefirst = true;
+	traceorigin = std::chrono::steady_clock::now();
+	tracebuffer.reserve(1024);
+	tracestop = false;
+	tracethread = std::thread(writer);
+	enabled = true;
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "tracing to %s", filename.c_str());
+}
+
+/**
+ * \brief Write all pending events, stop the writer and close the file
+ */
+void	tracer::close() {
+	if (!enabled) {
+		return;
+	}
+	flush();
+	enabled = false;
+	{
+		std::unique_lock<std::mutex>	lock(tracemutex);
+		tracestop = true;
+	}
+	tracecondition.notify_all();
+	tracethread.join();
+	fprintf(tracefile, "\n]\n");
+	fclose(tracefile);
+	tracefile = NULL;
+}
+
+/**
+ * \brief Get the current time in microseconds since the trace was opened
+ */
+int64_t	tracer::now() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - traceorigin).count();
+}
+
+/**
+ * \brief Add an event to the buffer of the current cycle
+ *
+ * \param name		the name of the span
+ * \param category	the category of the span
+ * \param start		start time in microseconds
+ * \param duration	duration in microseconds
+ * \param detail	additional detail shown as an argument of the span
+ */
+void	tracer::add(const char *name, const char *category, int64_t start,
+		int64_t duration, const std::string& detail) {
+	event	e;
+	e.name = name;
+	e.category = category;
+	e.detail = detail;
+	e.start = start;
+	e.duration = duration;
+	e.tid = threadid();
+	std::unique_lock<std::mutex>	lock(tracemutex);
+	tracebuffer.push_back(e);
+}
+
+/**
+ * \brief Hand the events of the current cycle to the writer thread
+ */
+void	tracer::flush() {
+	if (!enabled) {
+		return;
+	}
+	{
+		std::unique_lock<std::mutex>	lock(tracemutex);
+		if (tracebuffer.empty()) {
+			return;
+		}
+		size_t	capacity = tracebuffer.capacity();
+		tracequeue.push_back(std::vector<event>());
+		tracequeue.back().swap(tracebuffer);
+		tracebuffer.reserve(capacity);
+	}
+	tracecondition.notify_all();
+}
+
+/**
+ * \brief Stop the span and add it to the trace
+ */
+void	tracespan::stop() {
+	if (!_running) {
+		return;
+	}
+	_running = false;
+	tracer::add(_name, _category, _start, tracer::now() - _start,
+		_detail);
+}
+
+} // namespace shelly
@@ -0,0 +1,68 @@
+/*
+ * trace.h -- chrome trace event export for profiling cycles
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _trace_h
+#define _trace_h
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace shelly {
+
+/**
+ * \brief Collector for trace events
+ *
+ * Events are only stored in memory while a cycle runs. At the end of
+ * the cycle, flush() hands the buffer to a writer thread that formats
+ * the events as Chrome trace event JSON and appends them to the trace
+ * file, which can be loaded into Perfetto or chrome://tracing.
+ */
+class tracer {
+public:
+	typedef struct {
+		const char	*name;
+		const char	*category;
+		std::string	detail;
+		int64_t	start;
+		int64_t	duration;
+		int	tid;
+	} event;
+	static bool	enabled;
+	static void	open(const std::string& filename);
+	static void	close();
+	static int64_t	now();
+	static void	add(const char *name, const char *category,
+				int64_t start, int64_t duration,
+				const std::string& detail = std::string());
+	static void	flush();
+};
+
+/**
+ * \brief A span in the trace, recorded when the object goes out of scope
+ */
+class tracespan {
+	const char	*_name;
+	const char	*_category;
+	std::string	_detail;
+	bool	_running;
+	int64_t	_start;
+public:
+	tracespan(const char *name, const char *category = "shellyd",
+		const std::string& detail = std::string())
+		: _name(name), _category(category),
+		  _running(tracer::enabled), _start(0) {
+		if (_running) {
+			_detail = detail;
+			_start = tracer::now();
+		}
+	}
+	~tracespan() { stop(); }
+	void	stop();
+};
+
+} // namespace shelly
+
+#endif /* _trace_h */
@@ -0,0 +1,417 @@
+/*
+ * webhook.cpp -- receiver for data pushed by the devices
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#include "webhook.h"
+#include "debug.h"
+#include "format.h"
+#include "common.h"
+#include <algorithm>
+#include <map>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace shelly {
+
+// requests larger than this are rejected
+static const size_t	maxrequest = 65536;
+
+// seconds a connection may take to deliver its request
+static const int	requesttimeout = 10;
+
+/**
+ * \brief Decode a percent encoded query string component
+ *
+ * \param s		the encoded string
+ */
+static std::string	urldecode(const std::string& s) {
+	std::string	result;
+	for (size_t i = 0; i < s.size(); i++) {
+		if ((s[i] == '%') && (i + 2 < s.size())) {
+			result.push_back((char)strtol(
+				s.substr(i + 1, 2).c_str(), NULL, 16));
+			i += 2;
+		} else if (s[i] == '+') {
+			result.push_back(' ');
+		} else {
+			result.push_back(s[i]);
+		}
+	}
+	return result;
+}
+
+/**
+ * \brief Create the webhook server and start the server thread
+ *
+ * \param config	the configuration containing the webhook section
+ * \param queue		the queue to add the pushed data to
+ */
+webhookserver::webhookserver(configuration_ptr config, pushqueue_ptr queue)
+	: _config(config), _queue(queue), _path("/webhook"), _fd(-1),
+	  _epfd(-1), _accepting(true), _running(true) {
+	if (config->has("webhook.path")) {
+		_path = config->stringvalue("webhook.path");
+	}
+	if (config->has("webhook.token")) {
+		_token = config->stringvalue("webhook.token");
+	}
+	std::string	address("0.0.0.0");
+	if (config->has("webhook.address")) {
+		address = config->stringvalue("webhook.address");
+	}
+	int	port = config->intvalue("webhook.port");
+	struct sockaddr_in	sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (0 == inet_aton(address.c_str(), &sin.sin_addr)) {
+		throw shellyexception(stringprintf("bad webhook address %s",
+			address.c_str()));
+	}
+	std::string	error;
+	_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int	on = 1;
+	if (_fd >= 0) {
+		setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	}
+	if ((_fd < 0) || (bind(_fd, (struct sockaddr *)&sin,
+		sizeof(sin)) < 0)) {
+		error = stringprintf("cannot bind to %s:%d: %s",
+			address.c_str(), port, strerror(errno));
+	} else if (listen(_fd, 64) < 0) {
+		error = stringprintf("cannot listen: %s", strerror(errno));
+	} else if ((_epfd = epoll_create1(0)) < 0) {
+		error = stringprintf("cannot create epoll: %s",
+			strerror(errno));
+	} else {
+		struct epoll_event	event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = _fd;
+		if (epoll_ctl(_epfd, EPOLL_CTL_ADD, _fd, &event) < 0) {
+			error = stringprintf("cannot add listener: %s",
+				strerror(errno));
+		}
+	}
+	if (error.size() > 0) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", error.c_str());
+		if (_epfd >= 0) {
+			close(_epfd);
+		}
+		if (_fd >= 0) {
+			close(_fd);
+		}
+		throw shellyexception(error);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "webhooks on %s:%d%s", address.c_str(),
+		port, _path.c_str());
+	_thread = std::thread(&webhookserver::main, this);
+}
+
+/**
+ * \brief Stop the server thread and close all connections
+ */
+webhookserver::~webhookserver() {
+	_running = false;
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	for (auto c : _connections) {
+		close(c.first);
+	}
+	close(_epfd);
+	close(_fd);
+}
+
+/**
+ * \brief Handle a complete request
+ *
+ * \param request	the request including header and body
+ * \param message	the message to return to the device
+ */
+int	webhookserver::handle(const std::string& request,
+		std::string& message) {
+	// request line
+	size_t	e = request.find("\r\n");
+	std::string	line = request.substr(0, e);
+	size_t	s1 = line.find(' ');
+	size_t	s2 = line.find(' ', s1 + 1);
+	if ((s1 == std::string::npos) || (s2 == std::string::npos)) {
+		message = "bad request";
+		return 400;
+	}
+	std::string	method = line.substr(0, s1);
+	std::string	target = line.substr(s1 + 1, s2 - s1 - 1);
+	std::string	body = request.substr(request.find("\r\n\r\n") + 4);
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "webhook %s %s", method.c_str(),
+		target.c_str());
+
+	// split the target into path and query parameters
+	std::map<std::string, std::string>	parameters;
+	size_t	q = target.find('?');
+	std::string	path = target.substr(0, q);
+	if (path != _path) {
+		message = "not found";
+		return 404;
+	}
+	while (q != std::string::npos) {
+		size_t	next = target.find('&', q + 1);
+		std::string	pair = target.substr(q + 1,
+			(next == std::string::npos) ? std::string::npos
+			: next - q - 1);
+		size_t	eq = pair.find('=');
+		if (eq != std::string::npos) {
+			parameters[urldecode(pair.substr(0, eq))]
+				= urldecode(pair.substr(eq + 1));
+		}
+		q = next;
+	}
+	if ((_token.size() > 0) && (parameters["token"] != _token)) {
+		message = "forbidden";
+		return 403;
+	}
+
+	// a JSON body is either a cloud style item or an RPC notification
+	std::string	source;
+	nlohmann::json	status;
+	if ((method == "POST") && (body.size() > 0)) {
+		try {
+			nlohmann::json	j = nlohmann::json::parse(body);
+			if (j.contains("id") && j.contains("status")) {
+				source = j["id"];
+				status = j["status"];
+			} else if (j.contains("src") && j.contains("params")) {
+				source = j["src"];
+				status = j["params"];
+			} else {
+				throw shellyexception("no device status");
+			}
+		} catch (const std::exception& x) {
+			message = stringprintf("bad body: %s", x.what());
+			return 400;
+		}
+	} else {
+		// values as query parameters
+		static const struct {
+			const char	*name;
+			const char	*component;
+			const char	*field;
+		} names[] = {
+			{ "temp",	"temperature:0",	"tC" },
+			{ "temperature", "temperature:0",	"tC" },
+			{ "tC",		"temperature:0",	"tC" },
+			{ "hum",	"humidity:0",		"rh" },
+			{ "humidity",	"humidity:0",		"rh" },
+			{ "rh",		"humidity:0",		"rh" },
+			{ "voltage",	"devicepower:0",	"V" },
+			{ "V",		"devicepower:0",	"V" },
+			{ "battery",	"devicepower:0",	"percent" },
+			{ "percent",	"devicepower:0",	"percent" },
+			{ NULL,		NULL,			NULL }
+		};
+		source = parameters["id"];
+		status = nlohmann::json::object();
+		for (int i = 0; names[i].name; i++) {
+			auto	p = parameters.find(names[i].name);
+			if (p == parameters.end()) {
+				continue;
+			}
+			double	value;
+			try {
+				value = std::stod(p->second);
+			} catch (const std::exception& x) {
+				message = stringprintf("bad value for %s",
+					names[i].name);
+				return 400;
+			}
+			if (0 == strcmp(names[i].component, "devicepower:0")) {
+				status[names[i].component]["battery"]
+					[names[i].field] = value;
+			} else {
+				status[names[i].component][names[i].field]
+					= value;
+			}
+		}
+	}
+	if (source.size() == 0) {
+		message = "no device id";
+		return 400;
+	}
+	std::string	id = _queue->deviceid(source);
+	if (id.size() == 0) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "push from unknown device %s",
+			source.c_str());
+		message = "unknown device";
+		return 404;
+	}
+	if (!_queue->push(id, status)) {
+		message = "incomplete status";
+		return 202;
+	}
+	message = "ok";
+	return 200;
+}
+
+/**
+ * \brief Accept all pending connections
+ */
+void	webhookserver::accept() {
+	int	fd;
+	while ((fd = accept4(_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		struct epoll_event	event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			close(fd);
+			continue;
+		}
+		_connections[fd].deadline = std::chrono::steady_clock::now()
+			+ std::chrono::seconds(requesttimeout);
+	}
+
+	// the listener stays readable while no descriptors are left
+	if ((errno == EMFILE) || (errno == ENFILE)) {
+		debug(LOG_WARNING, DEBUG_LOG, DEBUG_ERRNO, "cannot accept, "
+			"pausing");
+		epoll_ctl(_epfd, EPOLL_CTL_DEL, _fd, NULL);
+		_accepting = false;
+		_resume = std::chrono::steady_clock::now()
+			+ std::chrono::seconds(1);
+	}
+}
+
+/**
+ * \brief Close a connection
+ *
+ * \param fd		the connection to close
+ */
+void	webhookserver::finish(int fd) {
+	epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	_connections.erase(fd);
+}
+
+/**
+ * \brief Close the connections past their deadline and resume accepting
+ */
+void	webhookserver::expire() {
+	std::chrono::steady_clock::time_point	now
+		= std::chrono::steady_clock::now();
+	auto	c = _connections.begin();
+	while (c != _connections.end()) {
+		if (c->second.deadline > now) {
+			c++;
+			continue;
+		}
+		int	fd = (c++)->first;
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "request timed out");
+		finish(fd);
+	}
+	if (!_accepting && (now >= _resume)) {
+		struct epoll_event	event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = _fd;
+		if (epoll_ctl(_epfd, EPOLL_CTL_ADD, _fd, &event) == 0) {
+			_accepting = true;
+		}
+	}
+}
+
+/**
+ * \brief Read available data from a connection and answer the request
+ *        once it is complete
+ *
+ * \param fd		the connection that has become readable
+ */
+void	webhookserver::input(int fd) {
+	std::string&	request = _connections[fd].request;
+	char	buffer[4096];
+	ssize_t	bytes;
+	while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+		request.append(buffer, bytes);
+	}
+	if ((bytes == 0) || ((bytes < 0) && (errno != EAGAIN)
+		&& (errno != EWOULDBLOCK))) {
+		finish(fd);
+		return;
+	}
+
+	// find out whether the request is complete
+	int	code = 0;
+	std::string	message;
+	size_t	headerend = request.find("\r\n\r\n");
+	if (request.size() > maxrequest) {
+		code = 413;
+		message = "request too large";
+	} else if (headerend == std::string::npos) {
+		return;
+	} else {
+		std::string	header = request.substr(0, headerend + 2);
+		std::transform(header.begin(), header.end(), header.begin(),
+			::tolower);
+		size_t	length = 0;
+		size_t	p = header.find("\r\ncontent-length:");
+		if (p != std::string::npos) {
+			length = strtoul(header.c_str() + p + 17, NULL, 10);
+		}
+		if (request.size() < headerend + 4 + length) {
+			return;
+		}
+		code = handle(request, message);
+	}
+
+	// send the response and close the connection
+	static const std::map<int, std::string>	reasons = {
+		{ 200, "OK" }, { 202, "Accepted" }, { 400, "Bad Request" },
+		{ 403, "Forbidden" }, { 404, "Not Found" },
+		{ 413, "Payload Too Large" }
+	};
+	message.append("\n");
+	std::string	response = stringprintf("HTTP/1.1 %d %s\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: %lu\r\n"
+		"Connection: close\r\n\r\n", code, reasons.at(code).c_str(),
+		(unsigned long)message.size()) + message;
+	if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) < 0) {
+		debug(LOG_DEBUG, DEBUG_LOG, DEBUG_ERRNO, "cannot answer");
+	}
+	finish(fd);
+}
+
+/**
+ * \brief Main function of the server thread
+ */
+void	webhookserver::main() {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "webhook server started");
+	struct epoll_event	events[64];
+	while (_running) {
+		int	n = epoll_wait(_epfd, events, 64, 1000);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			debug(LOG_ERR, DEBUG_LOG, DEBUG_ERRNO, "epoll failed");
+			return;
+		}
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == _fd) {
+				accept();
+			} else {
+				input(events[i].data.fd);
+			}
+		}
+		expire();
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "webhook server terminated");
+}
+
+} // namespace shelly
@@ -0,0 +1,61 @@
+/*
+ * webhook.h -- receiver for data pushed by the devices
+ *
+ * (c) 2025 Prof Dr Andreas Müller
+ */
+#ifndef _webhook_h
+#define _webhook_h
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include "configuration.h"
+#include "pushqueue.h"
+
+namespace shelly {
+
+/**
+ * \brief Embedded HTTP server accepting webhook calls of the devices
+ *
+ * A single thread multiplexes all connections with epoll. Each request
+ * is converted into a device status and added to the push queue.
+ * Devices can either call a URL with the values as query parameters, or
+ * post a status notification in JSON. A connection that has not
+ * delivered a complete request by its deadline is closed, and while
+ * no file descriptors are left, the listener is not watched for a
+ * second, so that the thread does not spin on it.
+ */
+class webhookserver {
+	configuration_ptr	_config;
+	pushqueue_ptr	_queue;
+	std::string	_path;
+	std::string	_token;
+	int	_fd;
+	int	_epfd;
+	std::atomic<bool>	_running;
+	std::thread	_thread;
+	typedef struct {
+		std::string	request;
+		std::chrono::steady_clock::time_point	deadline;
+	} connection;
+	std::map<int, connection>	_connections;
+	bool	_accepting;
+	std::chrono::steady_clock::time_point	_resume;
+	void	main();
+	void	accept();
+	void	input(int fd);
+	void	finish(int fd);
+	void	expire();
+	int	handle(const std::string& request, std::string& message);
+	webhookserver(const webhookserver& other);
+	webhookserver&	operator=(const webhookserver& other);
+public:
+	webhookserver(configuration_ptr config, pushqueue_ptr queue);
+	~webhookserver();
+};
+
+} // namespace shelly
+
+#endif /* _webhook_h */